@@ -0,0 +1,164 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "buffer_pool.h"
+#include "err_util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/**
+ * The free buffers of each size class and the counters.
+ * Guarded by mutex, since buffers may be released by any thread.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    struct Buffer* freeLists[NUM_SIZE_CLASSES];
+    size_t maxCachedBytes;
+    Boolean hugePages;
+    struct BufferPoolStats stats;
+} pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+void bufferPoolInit(size_t maxCachedBytes, Boolean hugePages)
+{
+    pthread_mutex_lock(&pool.mutex);
+    pool.maxCachedBytes = maxCachedBytes;
+    pool.hugePages = hugePages;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+static unsigned int sizeClassOf(size_t size)
+{
+    unsigned int sizeClass = 0;
+    while (sizeClass < NUM_SIZE_CLASSES && ((size_t) 1 << (MIN_BUFFER_SHIFT + sizeClass)) < size) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+/**
+ * Map the memory of a new buffer. Explicit huge pages are rarely reserved,
+ * so fall back to transparent huge pages.
+ */
+static char* mapBuffer(size_t capacity, Boolean hugePages)
+{
+    void* data = MAP_FAILED;
+
+    if (hugePages && capacity % HUGE_PAGE_SIZE == 0) {
+        data = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (data == MAP_FAILED) {
+        data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            errMsg("mmap buffer");
+            return NULL;
+        }
+        if (hugePages && capacity >= HUGE_PAGE_SIZE) {
+            madvise(data, capacity, MADV_HUGEPAGE);
+        }
+    }
+    return data;
+}
+
+struct Buffer* bufferAcquire(size_t size)
+{
+    unsigned int sizeClass = sizeClassOf(size);
+    struct Buffer* buffer = NULL;
+    Boolean hugePages;
+
+    pthread_mutex_lock(&pool.mutex);
+    if (sizeClass < NUM_SIZE_CLASSES && pool.freeLists[sizeClass] != NULL) {
+        buffer = pool.freeLists[sizeClass];
+        pool.freeLists[sizeClass] = buffer->nextFree;
+        pool.stats.bytesCached -= buffer->capacity;
+        pool.stats.bytesInUse += buffer->capacity;
+        pool.stats.reuses++;
+    }
+    hugePages = pool.hugePages;
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (buffer == NULL) {
+        buffer = malloc(sizeof(struct Buffer));
+        if (buffer == NULL) {
+            errMsg("malloc buffer");
+            return NULL;
+        }
+        buffer->sizeClass = sizeClass;
+        buffer->capacity = sizeClass < NUM_SIZE_CLASSES
+            ? (size_t) 1 << (MIN_BUFFER_SHIFT + sizeClass)
+            : size;
+        buffer->data = mapBuffer(buffer->capacity, hugePages);
+        if (buffer->data == NULL) {
+            free(buffer);
+            return NULL;
+        }
+        pthread_mutex_lock(&pool.mutex);
+        pool.stats.bytesInUse += buffer->capacity;
+        pool.stats.allocations++;
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    atomic_init(&buffer->refCount, 1);
+    buffer->nextFree = NULL;
+    return buffer;
+}
+
+struct Buffer* bufferRef(struct Buffer* buffer)
+{
+    atomic_fetch_add_explicit(&buffer->refCount, 1, memory_order_relaxed);
+    return buffer;
+}
+
+void bufferUnref(struct Buffer* buffer)
+{
+    Boolean cached = FALSE;
+
+    if (atomic_fetch_sub_explicit(&buffer->refCount, 1, memory_order_acq_rel) > 1) {
+        return;
+    }
+    pthread_mutex_lock(&pool.mutex);
+    pool.stats.bytesInUse -= buffer->capacity;
+    if (buffer->sizeClass < NUM_SIZE_CLASSES
+            && pool.stats.bytesCached + buffer->capacity <= pool.maxCachedBytes) {
+        buffer->nextFree = pool.freeLists[buffer->sizeClass];
+        pool.freeLists[buffer->sizeClass] = buffer;
+        pool.stats.bytesCached += buffer->capacity;
+        cached = TRUE;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (!cached) {
+        if (munmap(buffer->data, buffer->capacity) == -1) {
+            errMsg("munmap buffer");
+        }
+        free(buffer);
+    }
+}
+
+void bufferPoolGetStats(struct BufferPoolStats* stats)
+{
+    pthread_mutex_lock(&pool.mutex);
+    *stats = pool.stats;
+    pthread_mutex_unlock(&pool.mutex);
+}
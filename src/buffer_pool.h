@@ -0,0 +1,95 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include "boolean_util.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffers come in power of two sizes from 64 KiB to 128 MiB.
+#define MIN_BUFFER_SHIFT 16
+#define NUM_SIZE_CLASSES 12
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Free buffers the server keeps for the next images.
+#define POOL_CACHE_MEGABYTES 32
+
+/**
+ * A reference counted memory buffer, e.g. for the contents of an image.
+ * The buffer goes back to the pool when the last reference is dropped.
+ * References may be acquired and dropped from any thread.
+ */
+struct Buffer {
+    _Atomic int refCount;
+    unsigned int sizeClass; // NUM_SIZE_CLASSES for buffers larger than all classes
+    size_t capacity;
+    char* data;
+    struct Buffer* nextFree;
+};
+
+struct BufferPoolStats {
+    size_t bytesInUse;     // capacity of the buffers handed out
+    size_t bytesCached;    // capacity of the free buffers kept for reuse
+    uint64_t allocations;  // buffers that had to be mapped
+    uint64_t reuses;       // buffers that were taken from the pool
+};
+
+/**
+ * Configure the pool. Without a call, no huge pages are used
+ * and no free buffers are kept.
+ *
+ * \param maxCachedBytes
+ * Free buffers are kept for reuse up to this total capacity,
+ * the others are unmapped.
+ * \param hugePages
+ * Back buffers of at least HUGE_PAGE_SIZE with huge pages,
+ * or at least advise the kernel to use transparent huge pages.
+ */
+void bufferPoolInit(size_t maxCachedBytes, Boolean hugePages);
+
+/**
+ * Get a buffer for at least size bytes, preferably a free one
+ * of the matching size class. The contents are undefined.
+ *
+ * \return the buffer with a reference count of one, or NULL on error.
+ */
+struct Buffer* bufferAcquire(size_t size);
+
+/**
+ * Acquire another reference to the buffer.
+ */
+struct Buffer* bufferRef(struct Buffer* buffer);
+
+/**
+ * Drop a reference. The buffer is returned to the pool
+ * when no reference is left.
+ */
+void bufferUnref(struct Buffer* buffer);
+
+/**
+ * Take a snapshot of the counters of the pool.
+ */
+void bufferPoolGetStats(struct BufferPoolStats* stats);
+
+#endif
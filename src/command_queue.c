@@ -0,0 +1,202 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "command_queue.h"
+#include "err_util.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Increment the eventfd counter so that a thread polling on it wakes up.
+ */
+static void notifyFd(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN) // counter saturated, the reader will wake up anyway
+            return;
+        errExit("eventfd write");
+    }
+}
+
+/**
+ * Wait until the eventfd becomes readable and reset its counter.
+ * Returns FALSE if the timeout expired.
+ */
+static Boolean waitFd(int fd, int timeoutMs)
+{
+    struct pollfd pfd;
+    uint64_t value;
+    int res;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do {
+        res = poll(&pfd, 1, timeoutMs);
+    } while (res == -1 && errno == EINTR);
+    if (res == -1) {
+        errExit("poll eventfd");
+    }
+    if (res == 0) {
+        return FALSE;
+    }
+    if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        errExit("eventfd read");
+    }
+    return TRUE;
+}
+
+void commandQueueInit(struct CommandQueue* queue, size_t depth, OverflowPolicy policy)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->enqueued, 0);
+    atomic_init(&queue->dequeued, 0);
+    atomic_init(&queue->dropped, 0);
+    queue->capacity = depth > 0 ? depth : 1;
+    queue->policy = policy;
+    pthread_mutex_init(&queue->dropLock, NULL);
+
+    queue->slots = calloc(queue->capacity, sizeof(struct Command));
+    if (queue->slots == NULL) {
+        errExit("calloc command queue");
+    }
+    queue->dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->dataFd == -1 || queue->spaceFd == -1) {
+        errExit("eventfd");
+    }
+}
+
+/**
+ * Copy line into the slot at tail and publish it to the consumer.
+ */
+static void storeCommand(struct CommandQueue* queue, size_t tail, const char* line)
+{
+    struct Command* slot = &queue->slots[tail % queue->capacity];
+    strncpy(slot->line, line, MAX_COMMAND_LENGTH - 1);
+    slot->line[MAX_COMMAND_LENGTH - 1] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &slot->received);
+    slot->fd = -1;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * The queue is full: discard the oldest command and store line in its slot.
+ * The consumer may be copying that slot, hence the lock.
+ */
+static void replaceOldest(struct CommandQueue* queue, size_t tail, const char* line)
+{
+    size_t head;
+
+    pthread_mutex_lock(&queue->dropLock);
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    // If the consumer got there first, there is room now anyway.
+    if (tail - head == queue->capacity) {
+        atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+    }
+    storeCommand(queue, tail, line);
+    pthread_mutex_unlock(&queue->dropLock);
+}
+
+Boolean commandQueuePush(struct CommandQueue* queue, const char* line)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - head < queue->capacity) {
+            storeCommand(queue, tail, line);
+            break;
+        }
+        if (queue->policy == OVERFLOW_DROP_NEWEST) {
+            atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+            return FALSE;
+        }
+        if (queue->policy == OVERFLOW_DROP_OLDEST) {
+            replaceOldest(queue, tail, line);
+            break;
+        }
+        waitFd(queue->spaceFd, -1);
+    }
+    atomic_fetch_add_explicit(&queue->enqueued, 1, memory_order_relaxed);
+
+    notifyFd(queue->dataFd);
+    return TRUE;
+}
+
+Boolean commandQueuePop(struct CommandQueue* queue, struct Command* command)
+{
+    Boolean dropping = queue->policy == OVERFLOW_DROP_OLDEST ? TRUE : FALSE;
+    size_t head;
+    size_t tail;
+
+    if (dropping) {
+        pthread_mutex_lock(&queue->dropLock);
+    }
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        if (dropping) {
+            pthread_mutex_unlock(&queue->dropLock);
+        }
+        return FALSE;
+    }
+    memcpy(command, &queue->slots[head % queue->capacity], sizeof(struct Command));
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    if (dropping) {
+        pthread_mutex_unlock(&queue->dropLock);
+    }
+    atomic_fetch_add_explicit(&queue->dequeued, 1, memory_order_relaxed);
+
+    if (queue->policy == OVERFLOW_BLOCK) {
+        notifyFd(queue->spaceFd);
+    }
+    return TRUE;
+}
+
+void commandQueueGetStats(struct CommandQueue* queue, struct CommandQueueStats* stats)
+{
+    stats->enqueued = atomic_load_explicit(&queue->enqueued, memory_order_relaxed);
+    stats->dequeued = atomic_load_explicit(&queue->dequeued, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&queue->dropped, memory_order_relaxed);
+}
+
+int parseOverflowPolicy(const char* name, OverflowPolicy* policy)
+{
+    if (strcmp(name, "block") == 0) {
+        *policy = OVERFLOW_BLOCK;
+    } else if (strcmp(name, "drop-oldest") == 0) {
+        *policy = OVERFLOW_DROP_OLDEST;
+    } else if (strcmp(name, "drop-newest") == 0) {
+        *policy = OVERFLOW_DROP_NEWEST;
+    } else {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMMAND_QUEUE_H_
+#define COMMAND_QUEUE_H_
+
+#include "boolean_util.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MAX_COMMAND_LENGTH 255
+#define CACHE_LINE_SIZE 64
+
+/**
+ * What the producer does if it finds the queue full.
+ */
+typedef enum {
+    OVERFLOW_BLOCK,       // wait until the consumer has made room
+    OVERFLOW_DROP_OLDEST, // discard the oldest queued command
+    OVERFLOW_DROP_NEWEST  // discard the command that is being pushed
+} OverflowPolicy;
+
+/**
+ * A command line together with the time it was pushed into the queue
+ * (CLOCK_MONOTONIC), which is used to measure the end-to-end lag.
+ * A producer may hand over the image file already opened as fd,
+ * otherwise fd is -1. Whoever consumes the command owns fd.
+ */
+struct Command {
+    char line[MAX_COMMAND_LENGTH];
+    struct timespec received;
+    int fd;
+};
+
+struct CommandQueueStats {
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t dropped;
+};
+
+/**
+ * Bounded single-producer/single-consumer queue of command lines.
+ *
+ * head is only advanced by the consumer, tail is only advanced by the producer.
+ * The one exception is OVERFLOW_DROP_OLDEST, where the producer discards the
+ * oldest element by advancing head and then overwrites its slot. The slot may
+ * be the one the consumer is copying at that moment, so with this policy the
+ * consumer copies and the producer drops and overwrites under dropLock.
+ * Without a drop, the producer only writes the slot at tail, which the
+ * consumer never reads.
+ *
+ * The consumer is woken up through dataFd, a producer blocked by
+ * OVERFLOW_BLOCK is woken up through spaceFd. Both are eventfds and
+ * can be put into a poll set.
+ */
+struct CommandQueue {
+    alignas(CACHE_LINE_SIZE) _Atomic size_t head;
+    alignas(CACHE_LINE_SIZE) _Atomic size_t tail;
+
+    alignas(CACHE_LINE_SIZE) _Atomic uint64_t enqueued;
+    _Atomic uint64_t dequeued;
+    _Atomic uint64_t dropped;
+
+    alignas(CACHE_LINE_SIZE) size_t capacity;
+    OverflowPolicy policy;
+    int dataFd;
+    int spaceFd;
+    struct Command* slots;
+    pthread_mutex_t dropLock; // OVERFLOW_DROP_OLDEST only
+};
+
+/**
+ * Allocate the slots and the eventfds of the queue.
+ * Terminates the process if the resources cannot be allocated.
+ *
+ * \param depth
+ * Maximal number of commands that can be queued.
+ * \param policy
+ * What to do if a command is pushed into a full queue.
+ */
+void commandQueueInit(struct CommandQueue* queue, size_t depth, OverflowPolicy policy);
+
+/**
+ * Producer side: copy the null-terminated line into the queue
+ * and wake up the consumer.
+ *
+ * \return
+ * TRUE if the line has been queued, FALSE if it was dropped.
+ */
+Boolean commandQueuePush(struct CommandQueue* queue, const char* line);
+
+/**
+ * Consumer side: move the oldest command into command. Does not block.
+ *
+ * \return
+ * TRUE if a command has been copied, FALSE if the queue is empty.
+ */
+Boolean commandQueuePop(struct CommandQueue* queue, struct Command* command);
+
+/**
+ * Take a consistent enough snapshot of the counters.
+ */
+void commandQueueGetStats(struct CommandQueue* queue, struct CommandQueueStats* stats);
+
+/**
+ * Parse "block", "drop-oldest" or "drop-newest".
+ * \return 0 on success, -1 if the name is unknown.
+ */
+int parseOverflowPolicy(const char* name, OverflowPolicy* policy);
+
+#endif
@@ -0,0 +1,1256 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "connection.h"
+#include "err_util.h"
+#include "log_util.h"
+#include "net_util.h"
+#include "preview.h"
+#include "stats.h"
+#include "time_util.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLRDHUP)
+// Maximal number of message headers that are sent with one sendmsg() call.
+#define MAX_GATHER 16
+// Capabilities of protocol version 2 that this server implements.
+#define SUPPORTED_CAPABILITIES (CAP_ACK | CAP_CHUNKED | CAP_METADATA)
+// Capabilities announced to clients, CAP_DEDUP, CAP_PREVIEW and CAP_RESUME are added at runtime.
+static uint8_t supportedCapabilities = SUPPORTED_CAPABILITIES;
+static HashRequest requestHash;
+static ImageLookup findResumable;
+// Hosts that have sent a hello, their connections wait for it.
+#define MAX_HELLO_HOSTS 32
+static char helloHosts[MAX_HELLO_HOSTS][NI_MAXHOST];
+static size_t nextHelloHost;
+// Unsent bytes that the kernel may hold for a connection that accepts chunks.
+// An image taken frame waits at most for these and the current chunk.
+#define NOTSENT_LOWAT (2 * CHUNK_SIZE)
+
+/**
+ * Return TRUE if a connection from host has sent a hello before.
+ */
+static Boolean hasSentHello(const char* host)
+{
+    size_t i;
+    for (i = 0; i < MAX_HELLO_HOSTS; ++i) {
+        if (strcmp(helloHosts[i], host) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Remember that host speaks version 2. The oldest host is forgotten
+ * once the table is full.
+ */
+static void rememberHello(const char* host)
+{
+    if (hasSentHello(host)) {
+        return;
+    }
+    snprintf(helloHosts[nextHelloHost], NI_MAXHOST, "%s", host);
+    nextHelloHost = (nextHelloHost + 1) % MAX_HELLO_HOSTS;
+}
+
+struct Connection* connectionCreate(int epollFd, int cfd, ConnectionType type,
+        const struct sockaddr* addr, socklen_t addrlen)
+{
+    struct Connection* conn = calloc(1, sizeof(struct Connection));
+    if (conn == NULL) {
+        errMsg("calloc connection");
+        return NULL;
+    }
+    conn->source.type = SOURCE_CONNECTION;
+    conn->source.fd = cfd;
+    atomic_init(&conn->state, CLIENT_ALIVE);
+    conn->epollFd = epollFd;
+    conn->type = type;
+    if (getnameinfo(addr, addrlen, conn->peerHost, sizeof(conn->peerHost),
+                NULL, 0, NI_NUMERICHOST) != 0) {
+        snprintf(conn->peerHost, sizeof(conn->peerHost), "?UNKNOWN?");
+    }
+    if (type == CONNECTION_DATA && hasSentHello(conn->peerHost)) {
+        struct timespec timeout = { 0, NEGOTIATION_TIMEOUT_MS * 1000000L };
+        conn->protocol = PROTOCOL_NEGOTIATING;
+        conn->negotiationDeadline = timespecAdd(monotonicNow(), timeout);
+    } else {
+        // Version 1 clients are served right away, a hello may still upgrade the connection.
+        conn->protocol = PROTOCOL_V1;
+        conn->upgradable = type == CONNECTION_DATA;
+    }
+    // We coalesce messages ourselves, small messages must not wait for Nagle.
+    if (setNoDelay(cfd) == -1) {
+        errMsg("setsockopt TCP_NODELAY");
+    }
+    addEventSource(epollFd, &conn->source, CONNECTION_EVENTS);
+    return conn;
+}
+
+static void freeMessage(struct OutMessage* msg)
+{
+    if (msg->image != NULL) {
+        imageUnref(msg->image);
+    }
+    free(msg);
+}
+
+static void freeMessages(struct OutMessage* msg)
+{
+    while (msg != NULL) {
+        struct OutMessage* next = msg->next;
+        freeMessage(msg);
+        msg = next;
+    }
+}
+
+void connectionDestroy(struct Connection* conn)
+{
+    freeMessages(conn->queueHead);
+    freeMessages(conn->controlHead);
+    freeMessages(conn->previewsHead);
+    if (close(conn->source.fd) == -1) {
+        errMsg("close");
+    }
+    free(conn);
+}
+
+static struct OutMessage* newMessage(MessageType type)
+{
+    struct OutMessage* msg = calloc(1, sizeof(struct OutMessage));
+    if (msg == NULL) {
+        errExit("calloc message");
+    }
+    msg->type = type;
+    return msg;
+}
+
+static void appendMessage(struct Connection* conn, struct OutMessage* msg)
+{
+    if (conn->queueTail == NULL) {
+        conn->queueHead = msg;
+    } else {
+        conn->queueTail->next = msg;
+    }
+    conn->queueTail = msg;
+    conn->queueLength++;
+}
+
+static void prependMessage(struct Connection* conn, struct OutMessage* msg)
+{
+    msg->next = conn->queueHead;
+    conn->queueHead = msg;
+    if (conn->queueTail == NULL) {
+        conn->queueTail = msg;
+    }
+    conn->queueLength++;
+}
+
+static void popMessage(struct Connection* conn)
+{
+    struct OutMessage* msg = conn->queueHead;
+    conn->queueHead = msg->next;
+    if (conn->queueHead == NULL) {
+        conn->queueTail = NULL;
+    }
+    conn->queueLength--;
+    freeMessage(msg);
+}
+
+void connectionQueueCommand(struct Connection* conn, MessageType type)
+{
+    struct OutMessage* msg = newMessage(type);
+
+    if (type != MESSAGE_IMAGE_TAKEN) {
+        appendMessage(conn, msg);
+        return;
+    }
+    if (conn->controlTail == NULL) {
+        conn->controlHead = msg;
+    } else {
+        conn->controlTail->next = msg;
+    }
+    conn->controlTail = msg;
+    conn->queueLength++;
+}
+
+/**
+ * Append msg to the messages that wait for a preview to be rendered.
+ */
+static void appendWaiting(struct Connection* conn, struct OutMessage* msg)
+{
+    if (conn->previewsTail == NULL) {
+        conn->previewsHead = msg;
+    } else {
+        conn->previewsTail->next = msg;
+    }
+    conn->previewsTail = msg;
+}
+
+void connectionQueueImage(struct Connection* conn, struct Image* image,
+        const struct timespec* received)
+{
+    struct OutMessage* msg = newMessage(MESSAGE_IMAGE);
+    msg->image = imageRef(image);
+    if (received != NULL) {
+        msg->timed = TRUE;
+        msg->received = *received;
+    }
+    if (conn->previewsTail != NULL && conn->previewsTail->type == MESSAGE_PREVIEW
+            && conn->previewsTail->image == image) {
+        appendWaiting(conn, msg); // goes out after its preview
+        return;
+    }
+    appendMessage(conn, msg);
+}
+
+void connectionQueuePreview(struct Connection* conn, struct Image* image,
+        struct Rendition* rendition, const struct timespec* received)
+{
+    struct OutMessage* msg = newMessage(MESSAGE_PREVIEW);
+    msg->image = imageRef(image);
+    msg->rendition = rendition;
+    msg->standalone = conn->previewOnly;
+    if (received != NULL) {
+        msg->timed = TRUE;
+        msg->received = *received;
+    }
+    // Previews keep their order behind those that are still rendered.
+    if (rendition->state != RENDITION_PENDING && conn->previewsHead == NULL) {
+        appendMessage(conn, msg);
+        return;
+    }
+    appendWaiting(conn, msg);
+}
+
+void connectionEnablePreviews(void)
+{
+    supportedCapabilities |= CAP_PREVIEW;
+}
+
+void connectionEnableDedup(HashRequest hashImage)
+{
+    requestHash = hashImage;
+    supportedCapabilities |= CAP_DEDUP;
+}
+
+void connectionEnableResume(ImageLookup findImage)
+{
+    findResumable = findImage;
+    supportedCapabilities |= CAP_RESUME;
+}
+
+Boolean connectionOverloaded(const struct Connection* conn)
+{
+    const struct OutMessage* msg;
+    off_t bytes = 0;
+
+    if (conn->queueLength > MAX_QUEUED_MESSAGES) {
+        return TRUE;
+    }
+    for (msg = conn->queueHead; msg != NULL; msg = msg->next) {
+        if (msg->type == MESSAGE_IMAGE) {
+            bytes += msg->image->file.size - msg->bodySent;
+        }
+    }
+    return bytes > (off_t) MAX_QUEUED_MEGABYTES * 1024 * 1024 ? TRUE : FALSE;
+}
+
+size_t connectionDropStaleImages(struct Connection* conn)
+{
+    struct OutMessage** link = &conn->queueHead;
+    struct OutMessage* last = NULL;
+    size_t dropped = 0;
+
+    while (*link != NULL) {
+        struct OutMessage* msg = *link;
+        // A message with a header has been started (or offered), so the
+        // client already expects the rest of it.
+        if ((msg->type == MESSAGE_IMAGE || msg->type == MESSAGE_PREVIEW) && !msg->started) {
+            *link = msg->next;
+            conn->queueLength--;
+            if (msg->type == MESSAGE_IMAGE || msg->standalone) {
+                dropped++;
+            }
+            freeMessage(msg);
+        } else {
+            last = msg;
+            link = &msg->next;
+        }
+    }
+    conn->queueTail = last;
+
+    while (conn->previewsHead != NULL) {
+        struct OutMessage* msg = conn->previewsHead;
+        conn->previewsHead = msg->next;
+        if (msg->type == MESSAGE_IMAGE || msg->standalone) {
+            dropped++;
+        }
+        freeMessage(msg);
+    }
+    conn->previewsTail = NULL;
+    return dropped;
+}
+
+/**
+ * Add or remove EPOLLOUT depending on whether we wait for the socket.
+ */
+static void setWaitingForWritable(struct Connection* conn, Boolean waiting)
+{
+    if (conn->waitingForWritable == waiting) {
+        return;
+    }
+    conn->waitingForWritable = waiting;
+    modifyEventSource(conn->epollFd, &conn->source,
+            CONNECTION_EVENTS | (waiting ? EPOLLOUT : 0));
+}
+
+/**
+ * TRUE if the body of the current frame has not been sent completely.
+ */
+static Boolean hasPendingBody(const struct OutMessage* msg)
+{
+    return msg->image != NULL && !msg->offering && !msg->awaitingVerdict
+        && msg->bodySent < msg->frameEnd;
+}
+
+/**
+ * Update the lag between the arrival of the command and the moment
+ * the image reached the client.
+ */
+static void recordLag(const struct OutMessage* msg)
+{
+    if (!msg->timed) {
+        return;
+    }
+    statsSet(&stats.lagMs, timespecDiffMillis(monotonicNow(), msg->received));
+    histogramRecordSince(&stats.lag, &msg->received);
+}
+
+/**
+ * Remove a completely sent message from the head of the queue.
+ */
+static void completeMessage(struct Connection* conn)
+{
+    if (conn->queueHead->type == MESSAGE_PREVIEW) {
+        statsAdd(&stats.previewsSent, 1);
+    }
+    if (conn->queueHead->type == MESSAGE_IMAGE || conn->queueHead->standalone) {
+        statsAdd(&stats.imagesSent, 1);
+        histogramRecordSince(&stats.send, &conn->queueHead->sendStarted);
+        recordLag(conn->queueHead);
+    }
+    popMessage(conn);
+}
+
+/**
+ * The current frame of the message at the head of the queue has been sent.
+ * Either more chunks of its image follow or the message is complete.
+ */
+static void finishFrame(struct Connection* conn)
+{
+    struct OutMessage* msg = conn->queueHead;
+    if (msg->image != NULL && !msg->lastFrame) {
+        msg->headerLength = 0;
+        msg->headerSent = 0;
+        return;
+    }
+    completeMessage(conn);
+}
+
+/**
+ * Move the waiting image taken commands to the front of the send queue,
+ * unless a frame is partially sent. They may not overtake the hello.
+ */
+static void promoteControlMessages(struct Connection* conn)
+{
+    struct OutMessage** link = &conn->queueHead;
+
+    if (conn->controlHead == NULL) {
+        return;
+    }
+    while (*link != NULL && (*link)->type == MESSAGE_HELLO) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (*link)->headerSent > 0 && !(*link)->awaitingVerdict) {
+        return;
+    }
+    if (*link == NULL) {
+        conn->queueTail = conn->controlTail;
+    }
+    conn->controlTail->next = *link;
+    *link = conn->controlHead;
+    conn->controlHead = NULL;
+    conn->controlTail = NULL;
+}
+
+static void setCorked(struct Connection* conn, Boolean corked)
+{
+    if (conn->corked == corked || conn->type != CONNECTION_DATA) {
+        return;
+    }
+    if (setCork(conn->source.fd, corked) == -1) {
+        errMsg("setsockopt TCP_CORK");
+    }
+    conn->corked = corked;
+}
+
+static Boolean isWindowFull(const struct Connection* conn)
+{
+    return (conn->capabilities & CAP_ACK) && conn->numUnacked >= conn->window;
+}
+
+/**
+ * Append the header of the next chunk of the image to the header of msg.
+ * Of a growing image, only what has been written so far is sent.
+ */
+static void appendChunkFrame(struct OutMessage* msg)
+{
+    struct FrameHeader frame;
+    off_t length = msg->image->file.size - msg->bodySent;
+
+    if (length > CHUNK_SIZE) {
+        length = CHUNK_SIZE;
+    }
+    memset(&frame, 0, sizeof(frame));
+    frame.type = FRAME_IMAGE_CHUNK;
+    frame.id = msg->image->id;
+    frame.length = length;
+    if (!msg->image->growing && msg->bodySent + length == msg->image->file.size) {
+        frame.flags = FRAME_FLAG_LAST;
+        msg->lastFrame = TRUE;
+    }
+    encodeFrameHeader(&frame, msg->header + msg->headerLength);
+    msg->headerLength += FRAME_HEADER_LENGTH;
+    msg->frameEnd = msg->bodySent + length;
+}
+
+/**
+ * Append the first header of the image to the header of msg.
+ */
+static void encodeImageFrame(const struct Connection* conn, struct OutMessage* msg)
+{
+    struct FrameHeader frame;
+    char* header = msg->header + msg->headerLength;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.id = msg->image->id;
+    msg->headerSent = 0;
+    if (conn->capabilities & CAP_CHUNKED) {
+        Boolean growing = msg->image->growing;
+        frame.type = FRAME_IMAGE_START;
+        frame.flags = growing ? FRAME_FLAG_GROWING : 0;
+        frame.length = START_PAYLOAD_LENGTH;
+        encodeFrameHeader(&frame, header);
+        encodeUint64(growing ? 0 : msg->image->file.size, header + FRAME_HEADER_LENGTH);
+        msg->headerLength += FRAME_HEADER_LENGTH + START_PAYLOAD_LENGTH;
+        msg->frameEnd = 0;
+        if (!growing || msg->image->file.size > 0) {
+            appendChunkFrame(msg);
+        }
+        return;
+    }
+    frame.type = FRAME_IMAGE_DATA;
+    frame.length = msg->image->file.size;
+    encodeFrameHeader(&frame, header);
+    msg->headerLength += FRAME_HEADER_LENGTH;
+    msg->frameEnd = msg->image->file.size;
+    msg->lastFrame = TRUE;
+}
+
+/**
+ * Replace the image of msg by its rendition and encode the preview frame.
+ * A standalone preview enters the window in place of the image.
+ */
+static void encodePreviewFrame(struct Connection* conn, struct OutMessage* msg)
+{
+    struct FrameHeader frame;
+    // Take the rendition first, it is freed with the last reference to the image.
+    struct Image* preview = imageRef(msg->rendition->image);
+
+    imageUnref(msg->image);
+    msg->image = preview;
+    msg->rendition = NULL;
+    memset(&frame, 0, sizeof(frame));
+    frame.type = FRAME_IMAGE_PREVIEW;
+    frame.id = preview->id;
+    frame.length = preview->file.size;
+    encodeFrameHeader(&frame, msg->header);
+    msg->headerLength = FRAME_HEADER_LENGTH;
+    msg->headerSent = 0;
+    msg->frameEnd = preview->file.size;
+    msg->lastFrame = TRUE;
+    msg->started = TRUE;
+    msg->sendStarted = monotonicNow();
+    if (msg->standalone && (conn->capabilities & CAP_ACK)) {
+        conn->unacked[conn->numUnacked++] = preview->id;
+    }
+}
+
+/**
+ * Previews are only queued once they have been rendered. Standalone
+ * previews are counted in the window like the images they stand for.
+ */
+static Boolean isPreviewReady(const struct Connection* conn, const struct OutMessage* msg)
+{
+    return !msg->standalone || !isWindowFull(conn);
+}
+
+/**
+ * Move the previews that have been rendered, or failed to, from the
+ * waiting list to the send queue, each followed by the image it belongs
+ * to. They are admitted in the order they were queued. A failed preview
+ * is dropped unless it stands for its image, and so is one whose image
+ * has been taken for resuming.
+ */
+static void admitRenderedPreviews(struct Connection* conn)
+{
+    while (conn->previewsHead != NULL
+            && conn->previewsHead->rendition->state != RENDITION_PENDING) {
+        struct OutMessage* msg = conn->previewsHead;
+        struct OutMessage* image = msg->next;
+        Boolean paired = !msg->standalone && image != NULL
+                && image->type == MESSAGE_IMAGE && image->image == msg->image;
+
+        conn->previewsHead = paired ? image->next : msg->next;
+        if (conn->previewsHead == NULL) {
+            conn->previewsTail = NULL;
+        }
+        msg->next = NULL;
+        if (msg->standalone || (paired && msg->rendition->state == RENDITION_READY)) {
+            appendMessage(conn, msg);
+        } else {
+            freeMessage(msg);
+        }
+        if (paired) {
+            image->next = NULL;
+            appendMessage(conn, image);
+        }
+    }
+}
+
+/**
+ * A growing image can only be sent in chunks, and only as far as it
+ * has been written. Other clients get it once it is complete.
+ */
+static Boolean isImageReady(const struct Connection* conn, const struct OutMessage* msg)
+{
+    if (!msg->image->growing) {
+        return TRUE;
+    }
+    if (!(conn->capabilities & CAP_CHUNKED)) {
+        return FALSE;
+    }
+    return !msg->started || msg->bodySent < msg->image->file.size;
+}
+
+/**
+ * An image is only offered once its hash is known. It is computed by a
+ * worker, never here, and the message waits until the worker is done.
+ * Images that cannot be hashed are sent without offer.
+ */
+static Boolean isHashPending(const struct Connection* conn, const struct OutMessage* msg)
+{
+    uint64_t hash;
+
+    if (!(conn->capabilities & CAP_DEDUP) || msg->resumed || msg->image->growing
+            || imageGetHash(msg->image, &hash)) {
+        return FALSE;
+    }
+    if (msg->image->hashState == HASH_UNKNOWN) {
+        requestHash(msg->image);
+    }
+    return msg->image->hashState == HASH_PENDING;
+}
+
+/**
+ * Append an offer of the image to the header of msg. Returns FALSE if the
+ * hash of the image is not known, in that case it is sent right away.
+ */
+static Boolean encodeOfferFrame(struct OutMessage* msg)
+{
+    struct FrameHeader frame;
+    char* header = msg->header + msg->headerLength;
+    uint64_t hash;
+
+    if (!imageGetHash(msg->image, &hash)) {
+        return FALSE;
+    }
+    memset(&frame, 0, sizeof(frame));
+    frame.type = FRAME_IMAGE_OFFER;
+    frame.id = msg->image->id;
+    frame.length = OFFER_PAYLOAD_LENGTH;
+    encodeFrameHeader(&frame, header);
+    encodeUint64(hash, header + FRAME_HEADER_LENGTH);
+    encodeUint64(msg->image->file.size, header + FRAME_HEADER_LENGTH + 8);
+    msg->headerLength += FRAME_HEADER_LENGTH + OFFER_PAYLOAD_LENGTH;
+    msg->headerSent = 0;
+    msg->offering = TRUE;
+    return TRUE;
+}
+
+/**
+ * Encode the header that continues the transfer of a resumed image
+ * at bodySent, followed by the header of its next chunk.
+ */
+static void encodeResumeFrame(struct OutMessage* msg)
+{
+    struct FrameHeader frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.type = FRAME_IMAGE_RESUME;
+    frame.id = msg->image->id;
+    frame.length = RESUME_PAYLOAD_LENGTH;
+    encodeFrameHeader(&frame, msg->header);
+    encodeUint64(msg->image->file.size, msg->header + FRAME_HEADER_LENGTH);
+    encodeUint64(msg->bodySent, msg->header + FRAME_HEADER_LENGTH + 8);
+    msg->headerLength = FRAME_HEADER_LENGTH + RESUME_PAYLOAD_LENGTH;
+    msg->headerSent = 0;
+    appendChunkFrame(msg);
+}
+
+/**
+ * Append the metadata frame of a JPEG image to the header of msg.
+ */
+static void encodeMetadataFrame(struct OutMessage* msg)
+{
+    const struct ImageMetadata* metadata = imageGetMetadata(msg->image);
+    struct FrameHeader frame;
+
+    if (metadata == NULL) {
+        return;
+    }
+    memset(&frame, 0, sizeof(frame));
+    frame.type = FRAME_IMAGE_METADATA;
+    frame.id = msg->image->id;
+    frame.length = METADATA_PAYLOAD_LENGTH;
+    encodeFrameHeader(&frame, msg->header + msg->headerLength);
+    encodeMetadata(metadata, msg->header + msg->headerLength + FRAME_HEADER_LENGTH);
+    msg->headerLength += FRAME_HEADER_LENGTH + METADATA_PAYLOAD_LENGTH;
+}
+
+/**
+ * Encode the header of msg for the protocol version of the connection.
+ * Images are entered into the window of unacknowledged images.
+ *
+ * \return FALSE if the message cannot be expressed in this protocol
+ *         version and has to be skipped.
+ */
+static Boolean prepareHeader(struct Connection* conn, struct OutMessage* msg)
+{
+    struct FrameHeader frame;
+
+    if (conn->protocol == PROTOCOL_V1) {
+        conn->upgradable = FALSE; // the client has to read version 1 from now on
+        switch (msg->type) {
+        case MESSAGE_IMAGE_TAKEN:
+            msg->header[0] = COMMAND_IMAGE_TAKEN;
+            msg->headerLength = 1;
+            break;
+        case MESSAGE_HEARTBEAT:
+            msg->header[0] = COMMAND_HEARBEAT_PROBE;
+            msg->headerLength = 1;
+            break;
+        case MESSAGE_IMAGE:
+            if (msg->image->file.size > INT_MAX) {
+                LOG_WARN("File %s is too large for protocol version 1.\n", msg->image->path);
+                return FALSE;
+            }
+            msg->header[0] = COMMAND_IMAGE_DATA;
+            intToByteArray(msg->image->file.size, msg->header + 1);
+            msg->headerLength = 5;
+            msg->frameEnd = msg->image->file.size;
+            msg->lastFrame = TRUE;
+            msg->started = TRUE;
+            msg->sendStarted = monotonicNow();
+            break;
+        case MESSAGE_HELLO:
+        case MESSAGE_PREVIEW:
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    switch (msg->type) {
+    case MESSAGE_IMAGE_TAKEN:
+        memset(&frame, 0, sizeof(frame));
+        frame.type = FRAME_IMAGE_TAKEN;
+        encodeFrameHeader(&frame, msg->header);
+        msg->headerLength = FRAME_HEADER_LENGTH;
+        break;
+    case MESSAGE_PREVIEW:
+        if (msg->rendition->state == RENDITION_READY) {
+            encodePreviewFrame(conn, msg);
+            break;
+        }
+        if (!msg->standalone) {
+            return FALSE; // the image follows anyway
+        }
+        // There is no preview, send the image it stands for.
+        msg->type = MESSAGE_IMAGE;
+        msg->standalone = FALSE;
+        msg->rendition = NULL;
+        /* fall through */
+    case MESSAGE_IMAGE:
+        if (msg->started) {
+            appendChunkFrame(msg); // continue the transfer
+            break;
+        }
+        msg->started = TRUE;
+        msg->sendStarted = monotonicNow();
+        if (conn->capabilities & CAP_ACK) {
+            conn->unacked[conn->numUnacked++] = msg->image->id;
+        }
+        if (msg->resumed) {
+            encodeResumeFrame(msg); // the client has seen the metadata and wants the rest
+            break;
+        }
+        if (conn->capabilities & CAP_METADATA) {
+            encodeMetadataFrame(msg);
+        }
+        if (!(conn->capabilities & CAP_DEDUP) || !encodeOfferFrame(msg)) {
+            encodeImageFrame(conn, msg);
+        }
+        break;
+    case MESSAGE_HELLO:
+    case MESSAGE_HEARTBEAT:
+        return FALSE; // encoded on creation or not used on version 2 connections
+    }
+    return TRUE;
+}
+
+static Boolean hasMemoryBody(const struct OutMessage* msg)
+{
+    return hasPendingBody(msg) && msg->image->data != NULL;
+}
+
+/**
+ * Gather the outstanding headers and in-memory bodies of the queued
+ * messages, up to and including the first message whose body has to be
+ * sent from the file or that continues with another chunk,
+ * and send them in one call.
+ * Returns the result of sendVector(), or 0 if the window is full.
+ */
+static ssize_t sendGathered(struct Connection* conn)
+{
+    struct iovec iov[MAX_GATHER];
+    struct OutMessage* msg;
+    struct OutMessage* next;
+    int iovcnt = 0;
+    Boolean more = FALSE;
+    ssize_t sent;
+    size_t left;
+    size_t part;
+
+    for (msg = conn->queueHead; msg != NULL && iovcnt + 2 <= MAX_GATHER; msg = next) {
+        next = msg->next;
+        if (msg->headerLength == 0) {
+            if (msg->type == MESSAGE_IMAGE
+                    && ((!msg->started && (isWindowFull(conn) || isHashPending(conn, msg)))
+                        || !isImageReady(conn, msg))) {
+                break;
+            }
+            if (msg->type == MESSAGE_PREVIEW && !isPreviewReady(conn, msg)) {
+                break;
+            }
+            if (!prepareHeader(conn, msg)) {
+                // Only the head can be dropped here, all messages before it
+                // have been gathered and keep their place in the queue.
+                if (msg == conn->queueHead) {
+                    popMessage(conn);
+                    continue;
+                }
+                break;
+            }
+        }
+        if (msg->headerSent < msg->headerLength) {
+            iov[iovcnt].iov_base = msg->header + msg->headerSent;
+            iov[iovcnt].iov_len = msg->headerLength - msg->headerSent;
+            iovcnt++;
+        }
+        if (msg->offering) {
+            break; // nothing can follow until the client has answered
+        }
+        if (hasMemoryBody(msg)) {
+            iov[iovcnt].iov_base = (char*) msg->image->data + msg->bodySent;
+            iov[iovcnt].iov_len = msg->frameEnd - msg->bodySent;
+            iovcnt++;
+            if (msg->frameEnd < msg->image->file.size) {
+                break; // give control messages a chance before the next chunk
+            }
+        } else if (hasPendingBody(msg)) {
+            more = TRUE;
+            break;
+        }
+    }
+    if (iovcnt == 0) {
+        return 0;
+    }
+    if (more) {
+        setCorked(conn, TRUE);
+    }
+    sent = sendVector(conn->source.fd, iov, iovcnt, more);
+    if (sent <= 0) {
+        return sent;
+    }
+
+    // Account the bytes to the messages in the order they were gathered.
+    left = sent;
+    while (left > 0) {
+        msg = conn->queueHead;
+        part = msg->headerLength - msg->headerSent;
+        if (part > left) {
+            part = left;
+        }
+        msg->headerSent += part;
+        left -= part;
+        if (msg->headerSent < msg->headerLength) {
+            continue;
+        }
+        if (msg->offering) {
+            msg->offering = FALSE;
+            msg->awaitingVerdict = TRUE;
+            continue;
+        }
+        if (hasMemoryBody(msg)) {
+            part = msg->frameEnd - msg->bodySent;
+            if (part > left) {
+                part = left;
+            }
+            msg->bodySent += part;
+            left -= part;
+            statsAdd(&stats.bytesSent, part);
+        }
+        if (!hasPendingBody(msg)) {
+            finishFrame(conn);
+        }
+    }
+    return sent;
+}
+
+FlushResult connectionFlush(struct Connection* conn)
+{
+    int cfd = conn->source.fd;
+    Boolean socketFull = FALSE;
+    ssize_t n;
+
+    if (conn->protocol == PROTOCOL_NEGOTIATING) {
+        return conn->queueHead == NULL && conn->controlHead == NULL ? FLUSH_DONE : FLUSH_WAITING;
+    }
+
+    admitRenderedPreviews(conn);
+    for (;;) {
+        promoteControlMessages(conn);
+        if (conn->queueHead == NULL) {
+            break;
+        }
+        struct OutMessage* msg = conn->queueHead;
+        if (msg->awaitingVerdict) {
+            break;
+        }
+        if (msg->headerSent < msg->headerLength || msg->headerLength == 0 || hasMemoryBody(msg)) {
+            struct OutMessage* head = msg;
+            n = sendGathered(conn);
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    socketFull = TRUE;
+                    break;
+                }
+                errMsg("sendmsg");
+                return FLUSH_ERROR;
+            }
+            if (n == 0 && conn->queueHead == head) {
+                break; // window is full or the image is not ready
+            }
+        } else if (hasPendingBody(msg)) {
+            n = sendFileChunk(cfd, msg->image->file.fd, &msg->bodySent,
+                    msg->frameEnd - msg->bodySent);
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    socketFull = TRUE;
+                    break;
+                }
+                errMsg("sendfile");
+                return FLUSH_ERROR;
+            }
+            if (n == 0) {
+                // The frame announced more bytes than we can deliver.
+                LOG_WARN("File %s was truncated while sending.\n", msg->image->path);
+                return FLUSH_ERROR;
+            }
+            statsAdd(&stats.bytesSent, n);
+        } else {
+            finishFrame(conn);
+        }
+    }
+
+    if (!socketFull) {
+        // Push out the last partial segment.
+        setCorked(conn, FALSE);
+    }
+    setWaitingForWritable(conn, socketFull);
+    if (conn->queueHead == NULL) {
+        return FLUSH_DONE;
+    }
+    return socketFull ? FLUSH_BLOCKED : FLUSH_WAITING;
+}
+
+/**
+ * Handle the hello of the client and queue our answer in front of
+ * everything else. Returns FALSE if it is not a valid hello.
+ */
+static Boolean handleHello(struct Connection* conn, const char* buffer)
+{
+    struct Hello hello;
+    struct OutMessage* reply;
+
+    if (!decodeHello(buffer, &hello) || hello.version < PROTOCOL_VERSION) {
+        LOG_WARN("Invalid hello from %s.\n", conn->peerHost);
+        return FALSE;
+    }
+    rememberHello(conn->peerHost);
+    conn->protocol = PROTOCOL_V2;
+    conn->capabilities = hello.capabilities & supportedCapabilities;
+    if (!(conn->capabilities & CAP_CHUNKED)) {
+        conn->capabilities &= ~CAP_RESUME; // only chunks can start in the middle
+    }
+    conn->window = hello.window < MAX_WINDOW ? hello.window : MAX_WINDOW;
+    if (conn->window == 0) {
+        conn->window = 1;
+    }
+    if ((conn->capabilities & CAP_CHUNKED)
+            && setNotSentLowat(conn->source.fd, NOTSENT_LOWAT) == -1) {
+        errMsg("setsockopt TCP_NOTSENT_LOWAT");
+    }
+
+    hello.version = PROTOCOL_VERSION;
+    hello.capabilities = conn->capabilities;
+    hello.window = conn->window;
+    reply = newMessage(MESSAGE_HELLO);
+    encodeHello(&hello, reply->header);
+    reply->headerLength = HELLO_LENGTH;
+    prependMessage(conn, reply);
+
+    LOG_INFO("Client %s speaks protocol version %d (capabilities 0x%02x, window %u).\n",
+            conn->peerHost, PROTOCOL_VERSION, conn->capabilities, conn->window);
+    return TRUE;
+}
+
+static void handleAck(struct Connection* conn, uint32_t id)
+{
+    unsigned int i;
+    for (i = 0; i < conn->numUnacked; ++i) {
+        if (conn->unacked[i] == id) {
+            conn->unacked[i] = conn->unacked[--conn->numUnacked];
+            conn->imagesAcked++;
+            LOG_INFO("Client %s displayed image %u.\n", conn->peerHost, id);
+            return;
+        }
+    }
+}
+
+/**
+ * The client told the size of its screen. Sizes beyond
+ * MAX_PREVIEW_DIMENSION are clamped, 0 x 0 turns previews off.
+ */
+static void handlePreviewSize(struct Connection* conn, const struct FrameHeader* frame,
+        const char* payload)
+{
+    unsigned int width = decodeUint16(payload);
+    unsigned int height = decodeUint16(payload + 2);
+
+    if (!(conn->capabilities & CAP_PREVIEW)) {
+        LOG_WARN("Client %s did not negotiate previews.\n", conn->peerHost);
+        return;
+    }
+    if (width == 0 || height == 0) {
+        conn->previewWidth = 0;
+        conn->previewHeight = 0;
+        conn->previewOnly = FALSE;
+        LOG_INFO("Client %s does not want previews.\n", conn->peerHost);
+        return;
+    }
+    conn->previewWidth = width < MAX_PREVIEW_DIMENSION ? width : MAX_PREVIEW_DIMENSION;
+    conn->previewHeight = height < MAX_PREVIEW_DIMENSION ? height : MAX_PREVIEW_DIMENSION;
+    conn->previewOnly = (frame->flags & FRAME_FLAG_PREVIEW_ONLY) ? TRUE : FALSE;
+    LOG_INFO("Client %s wants previews of %ux%u%s.\n", conn->peerHost,
+            conn->previewWidth, conn->previewHeight, conn->previewOnly ? " only" : "");
+}
+
+/**
+ * The client answered the offer of the image at the head of the queue.
+ */
+static void handleVerdict(struct Connection* conn, uint32_t id, Boolean wanted)
+{
+    struct OutMessage* msg = conn->queueHead;
+
+    if (msg == NULL || !msg->awaitingVerdict || msg->image->id != id) {
+        LOG_WARN("Unexpected answer for image %u from %s.\n", id, conn->peerHost);
+        return;
+    }
+    msg->awaitingVerdict = FALSE;
+    if (wanted) {
+        msg->headerLength = 0;
+        encodeImageFrame(conn, msg);
+        return;
+    }
+    LOG_INFO("Client %s already has image %u.\n", conn->peerHost, id);
+    statsAdd(&stats.imagesDeduplicated, 1);
+    statsAdd(&stats.bytesSaved, msg->image->file.size);
+    recordLag(msg);
+    handleAck(conn, id);
+    popMessage(conn);
+}
+
+/**
+ * Remove the unstarted message of the image from the list.
+ */
+static struct OutMessage* unlinkImage(struct OutMessage** head, struct OutMessage** tail,
+        const struct Image* image)
+{
+    struct OutMessage** link = head;
+    struct OutMessage* last = NULL;
+
+    while (*link != NULL) {
+        struct OutMessage* msg = *link;
+        if (msg->type == MESSAGE_IMAGE && msg->image == image && !msg->started) {
+            *link = msg->next;
+            if (*tail == msg) {
+                *tail = last;
+            }
+            msg->next = NULL;
+            return msg;
+        }
+        last = msg;
+        link = &msg->next;
+    }
+    return NULL;
+}
+
+/**
+ * Remove the message of the image from the queue, or from the messages
+ * waiting for previews, if its transfer has not been started yet.
+ */
+static struct OutMessage* takeQueuedImage(struct Connection* conn, const struct Image* image)
+{
+    struct OutMessage* msg = unlinkImage(&conn->queueHead, &conn->queueTail, image);
+
+    if (msg != NULL) {
+        conn->queueLength--;
+        return msg;
+    }
+    return unlinkImage(&conn->previewsHead, &conn->previewsTail, image);
+}
+
+/**
+ * Queue msg in front of all messages whose transmission has not started.
+ */
+static void insertBeforeUnstarted(struct Connection* conn, struct OutMessage* msg)
+{
+    struct OutMessage** link = &conn->queueHead;
+    struct OutMessage* last = NULL;
+
+    while (*link != NULL && ((*link)->type == MESSAGE_HELLO || (*link)->headerLength > 0
+                || (*link)->started)) {
+        last = *link;
+        link = &(*link)->next;
+    }
+    msg->next = *link;
+    *link = msg;
+    if (conn->queueTail == last) {
+        conn->queueTail = msg;
+    }
+    conn->queueLength++;
+}
+
+/**
+ * The client asks to continue the transfer of an image where its previous
+ * connection broke. The image is sent before all others, in place of the
+ * replay of it if that is queued. Requests that cannot be served are ignored.
+ */
+static void handleResume(struct Connection* conn, uint32_t id, const char* payload)
+{
+    uint64_t offset = decodeUint64(payload);
+    uint64_t size = decodeUint64(payload + 8);
+    struct Image* image;
+    struct OutMessage* msg;
+
+    if (!(conn->capabilities & CAP_RESUME)) {
+        LOG_WARN("Client %s did not negotiate resuming.\n", conn->peerHost);
+        return;
+    }
+    image = findResumable(id);
+    if (image == NULL || image->growing || (uint64_t) image->file.size != size
+            || offset == 0 || offset >= size) {
+        LOG_INFO("Cannot resume image %u at byte %llu for %s.\n", id,
+                (unsigned long long) offset, conn->peerHost);
+        return;
+    }
+    msg = takeQueuedImage(conn, image);
+    if (msg == NULL) {
+        msg = newMessage(MESSAGE_IMAGE);
+        msg->image = imageRef(image);
+    }
+    msg->resumed = TRUE;
+    msg->bodySent = offset;
+    msg->frameEnd = offset;
+    insertBeforeUnstarted(conn, msg);
+    statsAdd(&stats.transfersResumed, 1);
+    statsAdd(&stats.bytesResumed, offset);
+    LOG_INFO("Resuming image %u for %s at byte %llu of %llu.\n", id, conn->peerHost,
+            (unsigned long long) offset, (unsigned long long) size);
+}
+
+/**
+ * TRUE if the HELLO_LENGTH bytes at buffer start with the magic of a hello.
+ */
+static Boolean isHello(const char* buffer)
+{
+    return memcmp(buffer, PROTOCOL_MAGIC, strlen(PROTOCOL_MAGIC)) == 0 ? TRUE : FALSE;
+}
+
+/**
+ * Process the complete hello and frames in the input buffer.
+ * Returns FALSE on a protocol violation.
+ */
+static Boolean processInput(struct Connection* conn)
+{
+    size_t consumed = 0;
+    struct FrameHeader frame;
+
+    if (conn->protocol == PROTOCOL_V1 && conn->upgradable) {
+        if (conn->inputLength < HELLO_LENGTH) {
+            return TRUE;
+        }
+        conn->upgradable = FALSE;
+        if (isHello(conn->input)) {
+            conn->protocol = PROTOCOL_NEGOTIATING; // the client spoke first
+        }
+    }
+    if (conn->protocol == PROTOCOL_V1) {
+        if (conn->inputLength >= HELLO_LENGTH && isHello(conn->input)) {
+            LOG_INFO("Hello of %s came too late, keeping protocol version 1.\n", conn->peerHost);
+            rememberHello(conn->peerHost);
+        }
+        conn->inputLength = 0; // version 1 clients do not send anything meaningful
+        return TRUE;
+    }
+    if (conn->protocol == PROTOCOL_NEGOTIATING) {
+        if (conn->inputLength < HELLO_LENGTH) {
+            return TRUE;
+        }
+        if (!handleHello(conn, conn->input)) {
+            return FALSE;
+        }
+        consumed = HELLO_LENGTH;
+    }
+    while (conn->inputLength - consumed >= FRAME_HEADER_LENGTH) {
+        decodeFrameHeader(conn->input + consumed, &frame);
+        if (frame.length > INPUT_BUFFER_SIZE - FRAME_HEADER_LENGTH) {
+            LOG_WARN("Frame of %s is too long.\n", conn->peerHost);
+            return FALSE;
+        }
+        if (conn->inputLength - consumed < FRAME_HEADER_LENGTH + frame.length) {
+            break;
+        }
+        switch (frame.type) {
+        case FRAME_ACK:
+            handleAck(conn, frame.id);
+            break;
+        case FRAME_HAVE:
+        case FRAME_WANT:
+            handleVerdict(conn, frame.id, frame.type == FRAME_WANT);
+            break;
+        case FRAME_PREVIEW_SIZE:
+            if (frame.length < PREVIEW_SIZE_PAYLOAD_LENGTH) {
+                LOG_WARN("Invalid preview size from %s.\n", conn->peerHost);
+                return FALSE;
+            }
+            handlePreviewSize(conn, &frame, conn->input + consumed + FRAME_HEADER_LENGTH);
+            break;
+        case FRAME_RESUME:
+            if (frame.length < RESUME_PAYLOAD_LENGTH) {
+                LOG_WARN("Invalid resume request from %s.\n", conn->peerHost);
+                return FALSE;
+            }
+            handleResume(conn, frame.id, conn->input + consumed + FRAME_HEADER_LENGTH);
+            break;
+        default:
+            LOG_WARN("Ignoring frame of unknown type %d from %s.\n", frame.type, conn->peerHost);
+            break;
+        }
+        consumed += FRAME_HEADER_LENGTH + frame.length;
+    }
+    memmove(conn->input, conn->input + consumed, conn->inputLength - consumed);
+    conn->inputLength -= consumed;
+    return TRUE;
+}
+
+Boolean connectionReceive(struct Connection* conn)
+{
+    ssize_t n;
+
+    for (;;) {
+        n = read(conn->source.fd, conn->input + conn->inputLength,
+                sizeof(conn->input) - conn->inputLength);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN;
+        }
+        if (n == 0) {
+            return FALSE;
+        }
+        conn->inputLength += n;
+        if (!processInput(conn)) {
+            return FALSE;
+        }
+    }
+}
+
+Boolean connectionWaitsForClient(const struct Connection* conn)
+{
+    const struct OutMessage* msg = conn->queueHead;
+
+    if (msg != NULL && msg->awaitingVerdict) {
+        return TRUE;
+    }
+    if (msg != NULL && msg->started) {
+        return FALSE; // an image is being transferred, it is acknowledged later
+    }
+    return (conn->capabilities & CAP_ACK) && conn->numUnacked > 0;
+}
+
+void connectionCheckNegotiation(struct Connection* conn, struct timespec now)
+{
+    if (conn->protocol == PROTOCOL_NEGOTIATING
+            && timespecDiffMillis(conn->negotiationDeadline, now) <= 0) {
+        conn->protocol = PROTOCOL_V1;
+        LOG_INFO("Client %s speaks protocol version 1.\n", conn->peerHost);
+    }
+}
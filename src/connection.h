@@ -0,0 +1,308 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONNECTION_H_
+#define CONNECTION_H_
+
+#include "boolean_util.h"
+#include "client_state.h"
+#include "event_util.h"
+#include "image.h"
+#include "protocol.h"
+#include "timer_wheel.h"
+
+#include <netdb.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+// The longest header is a FRAME_IMAGE_METADATA and a FRAME_IMAGE_START
+// followed by the header of the first chunk.
+#define MAX_HEADER_LENGTH (3 * FRAME_HEADER_LENGTH + METADATA_PAYLOAD_LENGTH + START_PAYLOAD_LENGTH)
+#define INPUT_BUFFER_SIZE 256
+// A client whose send queue grows beyond this is too slow and dropped.
+#define MAX_QUEUED_MESSAGES 1024
+#define MAX_QUEUED_MEGABYTES 512
+
+typedef enum { CONNECTION_DATA, CONNECTION_HEARTBEAT } ConnectionType;
+
+typedef enum {
+    PROTOCOL_NEGOTIATING, // waiting for the hello of a client that sent one before
+    PROTOCOL_V1,
+    PROTOCOL_V2
+} ProtocolState;
+
+typedef enum {
+    MESSAGE_HELLO,
+    MESSAGE_IMAGE_TAKEN,
+    MESSAGE_IMAGE,
+    MESSAGE_PREVIEW,
+    MESSAGE_HEARTBEAT
+} MessageType;
+
+typedef enum {
+    FLUSH_DONE,    // the send queue is empty
+    FLUSH_BLOCKED, // the socket is full, continue when it becomes writable
+    FLUSH_WAITING, // waiting for the client, e.g. for its hello or an ack
+    FLUSH_ERROR    // the connection is broken and has to be closed
+} FlushResult;
+
+/**
+ * A message waiting in the send queue of a connection.
+ * It consists of a small header and an optional image as body.
+ * The header is encoded when the message is about to be sent,
+ * so that it matches the protocol version of the connection.
+ *
+ * If the client deduplicates images, the header of an image message is
+ * first an offer. The offer waits until a worker has hashed the image.
+ * Once it is sent, the message waits at the head of the queue until the
+ * client tells whether it wants the body.
+ *
+ * If the client accepts chunks, the body is split into several frames.
+ * frameEnd is the offset in the body where the current frame ends. Once it
+ * is reached, the header of the next chunk is encoded when it is its turn,
+ * or, for a growing image, when more of it has been written.
+ *
+ * A preview message waits for its rendition to be rendered. Once it is
+ * ready, image is replaced by the rendition and sent in a single frame.
+ * A standalone preview stands for the image itself, it falls back to
+ * the image if no preview can be rendered.
+ *
+ * A resumed image continues a transfer that an earlier connection of the
+ * client did not complete. Its body starts at the offset the client asked for.
+ */
+struct OutMessage {
+    struct OutMessage* next;
+    MessageType type;
+    char header[MAX_HEADER_LENGTH];
+    size_t headerLength;
+    size_t headerSent;
+    struct Image* image;
+    struct Rendition* rendition; // of image, while a preview waits for it
+    Boolean standalone;
+    off_t bodySent;
+    off_t frameEnd;
+    Boolean started;   // the first header of the image has been encoded
+    Boolean resumed;   // bodySent was received by an earlier connection
+    Boolean lastFrame; // the current frame is the last one of the image
+    Boolean offering;
+    Boolean awaitingVerdict;
+    Boolean timed;               // received is known, the lag is measured on delivery
+    struct timespec received;    // when the command arrived (CLOCK_MONOTONIC)
+    struct timespec sendStarted; // when the first header of the image was encoded
+};
+
+/**
+ * A non-blocking client connection with its own send queue.
+ * Each connection progresses independently, so a slow client
+ * does not delay the others.
+ *
+ * Image taken commands wait in a separate control queue. They are moved
+ * to the front of the send queue as soon as no frame is partially sent,
+ * so they overtake the queued images and, if the client accepts chunks,
+ * an image that is being transferred.
+ *
+ * Previews wait in their own list until they have been rendered, together
+ * with the images that follow them, so a slow rendition does not hold up
+ * the other messages queued after it.
+ */
+struct Connection {
+    struct EventSource source; // has to be the first member
+    int epollFd;
+    ConnectionType type;
+    char peerHost[NI_MAXHOST];
+    struct Connection* peer; // the other connection of the same screen, set up by the event loop
+    struct OutMessage* queueHead;
+    struct OutMessage* queueTail;
+    struct OutMessage* controlHead;
+    struct OutMessage* controlTail;
+    struct OutMessage* previewsHead; // previews still being rendered, and their images
+    struct OutMessage* previewsTail;
+    size_t queueLength;
+    Boolean waitingForWritable;
+    Boolean corked;
+    _Atomic ClientState state; // written by the event loop, which destroys dead connections
+    struct Timer timer; // heartbeat probes, or the end of the negotiation, set up by the event loop
+    struct Timer ackTimer; // the client owes an acknowledgement, set up by the event loop
+    unsigned int missedHeartbeats; // probes not sent because the previous one is still queued
+
+    ProtocolState protocol;
+    Boolean upgradable; // version 1 so far, but nothing has been sent yet
+    struct timespec negotiationDeadline;
+    uint8_t capabilities;
+    unsigned int window;
+    uint32_t unacked[MAX_WINDOW]; // ids of images sent but not acknowledged yet
+    unsigned int numUnacked;
+    unsigned long imagesAcked;
+    unsigned int previewWidth;  // the screen of a client that wants previews, else 0
+    unsigned int previewHeight;
+    Boolean previewOnly;        // the previews stand for the images
+
+    char input[INPUT_BUFFER_SIZE];
+    size_t inputLength;
+
+    struct Connection* next;
+};
+
+/**
+ * \return TRUE until the event loop has closed the connection.
+ * May be called from any thread.
+ */
+static inline Boolean connectionAlive(struct Connection* conn)
+{
+    return atomic_load_explicit(&conn->state, memory_order_acquire) == CLIENT_ALIVE ? TRUE : FALSE;
+}
+
+/**
+ * Wrap the accepted socket cfd into a connection and register it
+ * with the event loop epollFd. cfd has to be non-blocking.
+ * Data connections of hosts that have sent a hello before start
+ * negotiating the protocol version, the others start with version 1
+ * until a hello arrives.
+ *
+ * \return the connection or NULL if it could not be created.
+ */
+struct Connection* connectionCreate(int epollFd, int cfd, ConnectionType type,
+        const struct sockaddr* addr, socklen_t addrlen);
+
+/**
+ * Close the socket and release all queued messages.
+ */
+void connectionDestroy(struct Connection* conn);
+
+/**
+ * Queue a message without body.
+ * Image taken commands are sent before all images that are still queued.
+ */
+void connectionQueueCommand(struct Connection* conn, MessageType type);
+
+/**
+ * Queue the contents of the image.
+ * The connection holds a reference to the image until it has been sent.
+ *
+ * \param received
+ * When the command for the image arrived, used to measure the end-to-end lag.
+ * NULL if the image is not sent in response to a command, e.g. a replay.
+ */
+void connectionQueueImage(struct Connection* conn, struct Image* image,
+        const struct timespec* received);
+
+/**
+ * Queue a preview of the image, to be sent once rendition is ready.
+ * Unless the client only wants previews, the image itself has to be
+ * queued right after it. Both wait until the preview has been rendered,
+ * without holding up the other messages of the connection.
+ *
+ * \param received See connectionQueueImage().
+ */
+void connectionQueuePreview(struct Connection* conn, struct Image* image,
+        struct Rendition* rendition, const struct timespec* received);
+
+/**
+ * \return TRUE if the client has asked for previews of its screen size.
+ */
+static inline Boolean connectionWantsPreview(const struct Connection* conn)
+{
+    return (conn->capabilities & CAP_PREVIEW) && conn->previewWidth > 0 ? TRUE : FALSE;
+}
+
+/**
+ * Announce CAP_PREVIEW to the clients that connect from now on.
+ */
+void connectionEnablePreviews(void);
+
+/**
+ * Starts to compute the hash of an image on a worker.
+ */
+typedef void (*HashRequest)(struct Image* image);
+
+/**
+ * Announce CAP_DEDUP to the clients that connect from now on.
+ * Images whose hash is not known yet are hashed with requestHash
+ * before they are offered.
+ */
+void connectionEnableDedup(HashRequest requestHash);
+
+/**
+ * Looks up an image that may be resumed by its id.
+ * \return the image or NULL. No reference is acquired.
+ */
+typedef struct Image* (*ImageLookup)(uint32_t id);
+
+/**
+ * Announce CAP_RESUME to the clients that connect from now on.
+ * The images they ask to resume are looked up with findImage.
+ */
+void connectionEnableResume(ImageLookup findImage);
+
+/**
+ * \return TRUE if more than MAX_QUEUED_MESSAGES messages or
+ * MAX_QUEUED_MEGABYTES of images are waiting for the client.
+ */
+Boolean connectionOverloaded(const struct Connection* conn);
+
+/**
+ * Remove all queued images and previews whose transmission has not
+ * started yet. Commands without body are kept. Used to let a newer image supersede
+ * older ones if the client cannot keep up.
+ *
+ * \return the number of images that have been removed, counting
+ *         standalone previews as images.
+ */
+size_t connectionDropStaleImages(struct Connection* conn);
+
+/**
+ * Send as much of the queue as the socket accepts without blocking.
+ * Registers for writability with the event loop if the socket is full.
+ *
+ * The headers of all queued messages up to the next image body are
+ * gathered into one sendmsg() call, together with the bodies of images
+ * that are held in memory. Bodies of other images are sent with sendfile()
+ * while the socket is corked, so a header and its body share segments.
+ */
+FlushResult connectionFlush(struct Connection* conn);
+
+/**
+ * Read and process everything the client has sent: the hello of
+ * a version 2 client, its acknowledgements, its answers to offers
+ * and its requests to resume transfers.
+ *
+ * \return FALSE if the connection was closed by the client
+ *         or the client violated the protocol.
+ */
+Boolean connectionReceive(struct Connection* conn);
+
+/**
+ * \return TRUE if the client has to answer before the transfer can go on:
+ *         it has to acknowledge images that have been sent completely,
+ *         or to answer an offer.
+ */
+Boolean connectionWaitsForClient(const struct Connection* conn);
+
+/**
+ * Fall back to protocol version 1 if the client has not sent
+ * a hello until the negotiation deadline.
+ */
+void connectionCheckNegotiation(struct Connection* conn, struct timespec now);
+
+#endif
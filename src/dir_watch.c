@@ -0,0 +1,268 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "dir_watch.h"
+#include "err_util.h"
+#include "log_util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+// Large enough for DIR_WATCH_BATCH events without name.
+#define EVENT_BUFFER_SIZE (DIR_WATCH_BATCH * sizeof(struct inotify_event))
+
+void dirWatchInit(struct DirWatch* watch, int epollFd, const char* extensions)
+{
+    const char* start = extensions;
+    const char* end;
+    size_t length;
+
+    memset(watch, 0, sizeof(*watch));
+    while (*start != '\0' && watch->numExtensions < MAX_EXTENSIONS) {
+        end = strchrnul(start, ',');
+        length = end - start;
+        if (length > 0 && length < MAX_EXTENSION_LENGTH) {
+            memcpy(watch->extensions[watch->numExtensions], start, length);
+            watch->extensions[watch->numExtensions][length] = '\0';
+            watch->numExtensions++;
+        }
+        start = *end == ',' ? end + 1 : end;
+    }
+
+    watch->source.type = SOURCE_DIR_WATCH;
+    watch->source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->source.fd == -1) {
+        errExit("inotify_init1");
+    }
+    addEventSource(epollFd, &watch->source, EPOLLIN);
+}
+
+int dirWatchAdd(struct DirWatch* watch, const char* path)
+{
+    struct WatchedDir* dir;
+
+    if (watch->numDirs == MAX_WATCHED_DIRS) {
+        LOG_WARN("Cannot watch more than %d directories.\n", MAX_WATCHED_DIRS);
+        return -1;
+    }
+    dir = &watch->dirs[watch->numDirs];
+    dir->wd = inotify_add_watch(watch->source.fd, path, DIR_EVENTS | IN_ONLYDIR);
+    if (dir->wd == -1) {
+        errMsg("inotify_add_watch");
+        return -1;
+    }
+    strncpy(dir->path, path, sizeof(dir->path) - 1);
+    dir->path[sizeof(dir->path) - 1] = '\0';
+    watch->numDirs++;
+    return 0;
+}
+
+/**
+ * Hidden files are usually temporary files of the writer.
+ */
+static Boolean isWantedFile(const struct DirWatch* watch, const char* name)
+{
+    const char* extension = strrchr(name, '.');
+    size_t i;
+
+    if (name[0] == '.' || extension == NULL) {
+        return FALSE;
+    }
+    for (i = 0; i < watch->numExtensions; ++i) {
+        if (strcasecmp(extension + 1, watch->extensions[i]) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Store the path of name in dir into command.
+ * Returns FALSE if it does not fit into a command.
+ */
+static Boolean makeCommand(const struct WatchedDir* dir, const char* name, struct Command* command)
+{
+    int length = snprintf(command->line, sizeof(command->line), "%s/%s", dir->path, name);
+    if (length < 0 || (size_t) length >= sizeof(command->line)) {
+        LOG_WARN("Path of %s/%s is too long, ignoring it.\n", dir->path, name);
+        return FALSE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &command->received);
+    command->fd = -1;
+    return TRUE;
+}
+
+static const struct WatchedDir* findDir(const struct DirWatch* watch, int wd)
+{
+    size_t i;
+    for (i = 0; i < watch->numDirs; ++i) {
+        if (watch->dirs[i].wd == wd) {
+            return &watch->dirs[i];
+        }
+    }
+    return NULL;
+}
+
+static Boolean containsCommand(const struct Command* commands, size_t count, const char* line)
+{
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        if (strcmp(commands[i].line, line) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+size_t dirWatchProcess(struct DirWatch* watch, struct Command* commands)
+{
+    char buffer[EVENT_BUFFER_SIZE]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    const struct WatchedDir* dir;
+    size_t count = 0;
+    size_t i;
+    ssize_t n;
+
+    // Every event takes at least sizeof(struct inotify_event) bytes, so one
+    // buffer never holds more events than there are commands. Further events
+    // stay queued and are read when the event loop calls again.
+    do {
+        n = read(watch->source.fd, buffer, sizeof(buffer));
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno != EAGAIN) {
+            errMsg("read inotify");
+        }
+        return 0;
+    }
+    for (i = 0; i < (size_t) n; i += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event*) (buffer + i);
+        if (event->mask & IN_Q_OVERFLOW) {
+            LOG_WARN("Too many files at once, some of them are not forwarded.\n");
+            continue;
+        }
+        dir = findDir(watch, event->wd);
+        if (dir == NULL || event->len == 0 || (event->mask & IN_ISDIR)
+                || !isWantedFile(watch, event->name)) {
+            continue;
+        }
+        if (makeCommand(dir, event->name, &commands[count])
+                && !containsCommand(commands, count, commands[count].line)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+struct ScannedFile {
+    const struct WatchedDir* dir;
+    char name[NAME_MAX + 1];
+    struct timespec modified;
+};
+
+static Boolean isOlder(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * Insert the file into files, which holds the newest files found so far
+ * ordered from oldest to newest, if it is new enough.
+ */
+static void keepNewest(struct ScannedFile* files, size_t* count, size_t max,
+        const struct ScannedFile* file)
+{
+    size_t pos;
+
+    if (*count == max) {
+        if (!isOlder(&files[0].modified, &file->modified)) {
+            return;
+        }
+        memmove(files, files + 1, (max - 1) * sizeof(struct ScannedFile));
+        (*count)--;
+    }
+    pos = *count;
+    while (pos > 0 && isOlder(&file->modified, &files[pos - 1].modified)) {
+        files[pos] = files[pos - 1];
+        pos--;
+    }
+    files[pos] = *file;
+    (*count)++;
+}
+
+size_t dirWatchScan(struct DirWatch* watch, struct Command* commands, size_t maxCommands)
+{
+    struct ScannedFile* files;
+    struct ScannedFile file;
+    struct dirent* entry;
+    struct stat st;
+    size_t numFiles = 0;
+    size_t count = 0;
+    size_t i;
+    DIR* d;
+
+    if (maxCommands == 0) {
+        return 0;
+    }
+    files = calloc(maxCommands, sizeof(struct ScannedFile));
+    if (files == NULL) {
+        errMsg("calloc scanned files");
+        return 0;
+    }
+    for (i = 0; i < watch->numDirs; ++i) {
+        d = opendir(watch->dirs[i].path);
+        if (d == NULL) {
+            errMsg("opendir");
+            continue;
+        }
+        while ((entry = readdir(d)) != NULL) {
+            if (!isWantedFile(watch, entry->d_name)
+                    || fstatat(dirfd(d), entry->d_name, &st, 0) == -1
+                    || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            file.dir = &watch->dirs[i];
+            strcpy(file.name, entry->d_name);
+            file.modified = st.st_mtim;
+            keepNewest(files, &numFiles, maxCommands, &file);
+        }
+        closedir(d);
+    }
+    for (i = 0; i < numFiles; ++i) {
+        if (makeCommand(files[i].dir, files[i].name, &commands[count])) {
+            count++;
+        }
+    }
+    free(files);
+    return count;
+}
@@ -0,0 +1,93 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DIR_WATCH_H_
+#define DIR_WATCH_H_
+
+#include "command_queue.h"
+#include "event_util.h"
+
+#include <limits.h>
+#include <stddef.h>
+
+#define MAX_WATCHED_DIRS 8
+#define MAX_EXTENSIONS 8
+#define MAX_EXTENSION_LENGTH 16
+// Maximal number of commands produced by one call of dirWatchProcess().
+#define DIR_WATCH_BATCH 256
+
+struct WatchedDir {
+    int wd;
+    char path[PATH_MAX];
+};
+
+/**
+ * Watches capture directories with inotify as an alternative to the FIFO.
+ * Every file that is written to or moved into one of the directories,
+ * and whose name has one of the extensions, becomes a command just
+ * as if its path had been written to the FIFO.
+ * The inotify descriptor is registered with the event loop.
+ */
+struct DirWatch {
+    struct EventSource source; // has to be the first member
+    struct WatchedDir dirs[MAX_WATCHED_DIRS];
+    size_t numDirs;
+    char extensions[MAX_EXTENSIONS][MAX_EXTENSION_LENGTH];
+    size_t numExtensions;
+};
+
+/**
+ * Create the inotify instance and register it with the event loop.
+ * Terminates the process on error.
+ *
+ * \param extensions
+ * Comma separated list of file name extensions, compared case-insensitively.
+ */
+void dirWatchInit(struct DirWatch* watch, int epollFd, const char* extensions);
+
+/**
+ * Start watching the directory at path.
+ * \return 0 on success, -1 on error.
+ */
+int dirWatchAdd(struct DirWatch* watch, const char* path);
+
+/**
+ * Read the pending inotify events and turn the files that are complete
+ * into commands. A file that appears several times is reported once.
+ *
+ * \param commands
+ * Has to provide room for DIR_WATCH_BATCH commands.
+ * \return the number of commands stored.
+ */
+size_t dirWatchProcess(struct DirWatch* watch, struct Command* commands);
+
+/**
+ * Look for files that were written while nobody was watching.
+ * The newest files of all watched directories are turned into commands,
+ * oldest first.
+ *
+ * \param maxCommands
+ * Maximal number of files to report.
+ * \return the number of commands stored.
+ */
+size_t dirWatchScan(struct DirWatch* watch, struct Command* commands, size_t maxCommands);
+
+#endif
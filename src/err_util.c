@@ -22,19 +22,19 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 
 #include "ename.c.inc"
 #include "err_util.h"
+#include "log_util.h"
 
-#include <stdio.h>
 #include <stdlib.h>
 
 void errExit(const char* msg)
 {
-    fprintf(stderr, "[%s %s] %s\n", (errno > 0) ? ename[errno] : "?UNKNOWN?", strerror(errno), msg);
+    logWriteNow(LOG_LEVEL_ERROR, "[%s %s] %s\n", (errno > 0) ? ename[errno] : "?UNKNOWN?", strerror(errno), msg);
     exit(1);
 }
 
 void errExitEN(int en, const char* msg)
 {
-    fprintf(stderr, "[%s %s] %s\n", (en > 0) ? ename[en] : "?UNKNOWN?", strerror(en), msg);
+    logWriteNow(LOG_LEVEL_ERROR, "[%s %s] %s\n", (en > 0) ? ename[en] : "?UNKNOWN?", strerror(en), msg);
     exit(1);
 }
 
@@ -42,7 +42,7 @@ void errMsg(const char* msg)
 {
     int savedErrno;
     savedErrno = errno;
-    fprintf(stderr, "[%s %s] %s\n", (errno > 0) ? ename[errno] : "?UNKNOWN?", strerror(errno), msg);
+    logWrite(LOG_LEVEL_ERROR, "[%s %s] %s\n", (errno > 0) ? ename[errno] : "?UNKNOWN?", strerror(errno), msg);
     errno = savedErrno;
 }
 
@@ -0,0 +1,64 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "err_util.h"
+#include "event_util.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+int createEventLoop()
+{
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+        errExit("epoll_create1");
+    }
+    return epollFd;
+}
+
+static void controlEventSource(int epollFd, int op, struct EventSource* source, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = source;
+    if (epoll_ctl(epollFd, op, source->fd, &ev) == -1) {
+        errExit("epoll_ctl");
+    }
+}
+
+void addEventSource(int epollFd, struct EventSource* source, uint32_t events)
+{
+    controlEventSource(epollFd, EPOLL_CTL_ADD, source, events);
+}
+
+void modifyEventSource(int epollFd, struct EventSource* source, uint32_t events)
+{
+    controlEventSource(epollFd, EPOLL_CTL_MOD, source, events);
+}
+
+int setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
@@ -0,0 +1,78 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVENT_UTIL_H_
+#define EVENT_UTIL_H_
+
+#include <stdint.h>
+
+/**
+ * Every file descriptor that is registered with the event loop
+ * is described by an EventSource. The epoll user data points to it,
+ * so the loop can find out which kind of descriptor became ready.
+ * Structures that are registered embed an EventSource as their first member.
+ */
+typedef enum {
+    SOURCE_DATA_LISTENER,
+    SOURCE_HEARTBEAT_LISTENER,
+    SOURCE_COMMAND_QUEUE,
+    SOURCE_CONNECTION,
+    SOURCE_TAIL_WATCH,
+    SOURCE_DIR_WATCH,
+    SOURCE_COMMAND_LISTENER,
+    SOURCE_PRODUCER,
+    SOURCE_IMAGE_LOADER,
+    SOURCE_STATS_LISTENER,
+    SOURCE_STATS_CLIENT,
+    SOURCE_TIMER,
+    SOURCE_WORKER_POOL
+} EventSourceType;
+
+struct EventSource {
+    EventSourceType type;
+    int fd;
+};
+
+/**
+ * Create the epoll instance of the event loop.
+ * Terminates the process on error.
+ */
+int createEventLoop();
+
+/**
+ * Register source->fd with the event loop for the given epoll events.
+ * Terminates the process on error.
+ */
+void addEventSource(int epollFd, struct EventSource* source, uint32_t events);
+
+/**
+ * Change the epoll events that source->fd is registered for.
+ * Terminates the process on error.
+ */
+void modifyEventSource(int epollFd, struct EventSource* source, uint32_t events);
+
+/**
+ * Put fd into non-blocking mode.
+ * \return 0 on success, -1 on error.
+ */
+int setNonBlocking(int fd);
+
+#endif
@@ -83,27 +83,154 @@ ssize_t readLine(int fd, void* buffer, size_t bufSize)
     return totRead;
 }
 
+void lineReaderInit(struct LineReader* reader, int fd, size_t maxLineLength)
+{
+    reader->fd = fd;
+    reader->maxLineLength = maxLineLength;
+    reader->start = 0;
+    reader->scanned = 0;
+    reader->end = 0;
+    reader->discarding = FALSE;
+    reader->lastRead.tv_sec = 0;
+    reader->lastRead.tv_nsec = 0;
+}
+
+/**
+ * Hand out the line in [start, lineEnd) and continue after next.
+ */
+static ssize_t takeLine(struct LineReader* reader, size_t lineEnd, size_t next, const char** line)
+{
+    size_t length = lineEnd - reader->start;
+    reader->buffer[lineEnd] = '\0';
+    *line = reader->buffer + reader->start;
+    reader->start = next;
+    reader->scanned = next;
+    reader->discarding = FALSE;
+    return length;
+}
+
+ssize_t lineReaderNext(struct LineReader* reader, const char** line)
+{
+    char* buf = reader->buffer;
+    ssize_t numRead;
+
+    for (;;) {
+        char* newline = memchr(buf + reader->scanned, '\n', reader->end - reader->scanned);
+        if (newline != NULL) {
+            size_t pos = newline - buf;
+            size_t lineEnd = pos;
+            if (reader->discarding || pos - reader->start > reader->maxLineLength) {
+                lineEnd = reader->start + reader->maxLineLength;
+            }
+            return takeLine(reader, lineEnd, pos + 1, line);
+        }
+        if (reader->end - reader->start >= reader->maxLineLength) {
+            // Keep the first maxLineLength characters, discard the rest
+            // until the newline shows up.
+            reader->discarding = TRUE;
+            reader->end = reader->start + reader->maxLineLength;
+        }
+        reader->scanned = reader->end;
+
+        // Make room for the next read. One byte is reserved for the terminator.
+        if (reader->start > 0 && reader->end + 1 >= sizeof(reader->buffer)) {
+            memmove(buf, buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->scanned = reader->end;
+            reader->start = 0;
+        }
+
+        numRead = read(reader->fd, buf + reader->end, sizeof(reader->buffer) - 1 - reader->end);
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            else
+                return -2;
+        } else if (numRead == 0) { // EOF
+            if (reader->end == reader->start)
+                return -1;
+            return takeLine(reader, reader->end, reader->end, line);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &reader->lastRead);
+        reader->end += numRead;
+    }
+}
+
 int readFileData(const char* filename, struct File* file)
 {
-    int inputFd;
-    struct stat st;
+    if (openFileData(filename, file) == -1) {
+        return -1;
+    }
+    // Allocate at least one byte, malloc(0) may return NULL.
+    file->data = malloc(file->size > 0 ? file->size : 1);
+    if (file->data == NULL) {
+        errMsg("malloc file data");
+    } else if (!readFully(file->fd, file->data, file->size, 0)) {
+        LOG_WARN("Error while reading file data of %s.\n", filename);
+        free(file->data);
+        file->data = NULL;
+    }
+    close(file->fd);
+    file->fd = -1;
+    return file->data != NULL ? 0 : -1;
+}
+
+Boolean readFully(int fd, char* buffer, size_t length, off_t offset)
+{
+    ssize_t n;
 
-    inputFd = open(filename, O_RDONLY);
-    if (inputFd == -1) {
+    while (length > 0) {
+        n = pread(fd, buffer, length, offset);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            errMsg("pread");
+            return FALSE;
+        }
+        if (n == 0) {
+            return FALSE;
+        }
+        buffer += n;
+        length -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+int openFileData(const char* filename, struct File* file)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
         errMsg("open file\n");
         return -1;
     }
+    if (statFileData(fd, file) == -1) {
+        close(fd);
+        file->fd = -1;
+        return -1;
+    }
+    return 0;
+}
 
-    fstat(inputFd, &st);
-    file->size = st.st_size;
-    printf("File size: %d.\n", file->size);
+int statFileData(int fd, struct File* file)
+{
+    struct stat st;
 
-    file->data = (char*)malloc(file->size);
-    int numRead = read(inputFd, file->data, file->size);
-    if (numRead != file->size) {
-        fprintf(stderr, "Error while reading file data: read only %d bytes.\n", numRead);
+    file->data = NULL;
+    file->fd = fd;
+    if (fstat(fd, &st) == -1) {
+        errMsg("fstat\n");
         return -1;
     }
+    if (!S_ISREG(st.st_mode)) {
+        LOG_WARN("Not a regular file.\n");
+        return -1;
+    }
+    file->size = st.st_size;
+    file->device = st.st_dev;
+    file->inode = st.st_ino;
+    file->modified = st.st_mtim;
+    LOG_DEBUG("File size: %lld.\n", (long long) file->size);
     return 0;
 }
 
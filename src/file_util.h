@@ -22,11 +22,20 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 #ifndef FILE_UTIL_H_
 #define FILE_UTIL_H_
 
+#include "boolean_util.h"
+
 #include <sys/types.h>
+#include <time.h>
+
+#define LINE_READER_BUFFER_SIZE 4096
 
 struct File {
     char* data;
-    int   size;
+    off_t size;
+    int   fd;
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
 };
 
 void createFifo(const char* fifo_name);
@@ -47,12 +56,79 @@ int openFifo(const char* fifo_name);
   */
 ssize_t readLine(int fd, void* buffer, size_t bufSize);
 
+/**
+ * Buffered replacement for readLine().
+ * The reader fetches as many bytes as are available with a single read()
+ * and hands out all complete lines contained in them before it reads again.
+ * Newlines are located with memchr(), which is vectorized by the C library.
+ * Incomplete lines are kept in the buffer until the rest arrives.
+ */
+struct LineReader {
+    int fd;
+    size_t maxLineLength; // longer lines are truncated like in readLine()
+    size_t start;         // first byte of the next line
+    size_t scanned;       // bytes before this offset contain no newline
+    size_t end;           // end of the valid data
+    Boolean discarding;   // skipping the rest of an overlong line
+    struct timespec lastRead; // when read() last returned data (CLOCK_MONOTONIC)
+    char buffer[LINE_READER_BUFFER_SIZE];
+};
+
+/**
+ * Prepare reader for reading lines from fd.
+ * Lines are truncated to maxLineLength characters.
+ * maxLineLength has to be smaller than LINE_READER_BUFFER_SIZE.
+ */
+void lineReaderInit(struct LineReader* reader, int fd, size_t maxLineLength);
+
+/**
+ * Return the next line without copying it.
+ * *line points into the buffer of the reader and stays valid until
+ * the next call. The line is null terminated, the newline character
+ * is not part of it.
+ *
+ * \return -2 if an unknown error occurred while reading from the fd.
+ *         -1 if EOF is encountered and we have not read any data
+ *          0 if we have read only a newline character
+ *         >0 if we have received a valid string, return its length.
+ */
+ssize_t lineReaderNext(struct LineReader* reader, const char** line);
+
 /**
  * The caller has to provide a constructed File struct.
  * This function creates memory for File.data using malloc.
- * The caller has to free this memory.
+ * The caller has to free this memory. On error, nothing has to be freed.
+ *
+ * \return 0 on success, -1 if the file could not be read completely.
  */
 int readFileData(const char* filename, struct File* file);
 
+/**
+ * Read length bytes at offset from fd into buffer,
+ * continuing after short reads.
+ *
+ * \return TRUE on success, FALSE on error or if the file is shorter.
+ */
+Boolean readFully(int fd, char* buffer, size_t length, off_t offset);
+
+/**
+ * Open a file for sending without reading its contents.
+ * The caller has to provide a constructed File struct.
+ * File.fd, File.size and the identity of the file (device, inode and
+ * modification time) are filled in, File.data is set to NULL.
+ * The caller has to close File.fd.
+ *
+ * \return 0 on success, -1 if the file could not be opened.
+ */
+int openFileData(const char* filename, struct File* file);
+
+/**
+ * Like openFileData() for a file that is open already.
+ * Only regular files are accepted. File.fd is set to fd.
+ *
+ * \return 0 on success, -1 if fd does not refer to a regular file.
+ */
+int statFileData(int fd, struct File* file);
+
 
 #endif
@@ -0,0 +1,37 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HASH_UTIL_H_
+#define HASH_UTIL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the 64-bit xxHash (XXH64) of length bytes at data.
+ *
+ * The input is processed in four independent 64-bit lanes,
+ * which keeps the multipliers of a superscalar CPU busy.
+ * The result is compatible with the reference implementation.
+ */
+uint64_t hashData(const void* data, size_t length, uint64_t seed);
+
+#endif
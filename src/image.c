@@ -0,0 +1,345 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "err_util.h"
+#include "hash_util.h"
+#include "image.h"
+#include "log_util.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HASH_CACHE_SIZE 256
+
+/**
+ * Content hashes of recently sent files. The cache is direct mapped,
+ * a newer file simply replaces the entry it collides with.
+ */
+struct HashCacheEntry {
+    Boolean used;
+    uint64_t pathHash;
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    off_t size;
+    uint64_t hash;
+};
+
+// Images are also created on worker threads.
+static _Atomic uint32_t nextImageId = 1;
+static struct HashCacheEntry hashCache[HASH_CACHE_SIZE];
+
+static void initImage(struct Image* image, const char* path)
+{
+    image->refCount = 1;
+    image->id = atomic_fetch_add_explicit(&nextImageId, 1, memory_order_relaxed);
+    image->buffer = NULL;
+    image->data = NULL;
+    image->growing = FALSE;
+    image->hashState = HASH_UNKNOWN;
+    image->metadataScanned = FALSE;
+    image->hasMetadata = FALSE;
+    image->renditions = NULL;
+    strncpy(image->path, path, sizeof(image->path) - 1);
+    image->path[sizeof(image->path) - 1] = '\0';
+}
+
+void imageSeedIds(uint32_t first)
+{
+    atomic_store_explicit(&nextImageId, first, memory_order_relaxed);
+}
+
+struct Image* imageOpen(const char* path)
+{
+    struct Image* image = malloc(sizeof(struct Image));
+    if (image == NULL) {
+        errMsg("malloc image");
+        return NULL;
+    }
+    if (openFileData(path, &image->file) == -1) {
+        free(image);
+        return NULL;
+    }
+    initImage(image, path);
+    return image;
+}
+
+struct Image* imageFromFd(int fd, const char* name)
+{
+    struct Image* image = malloc(sizeof(struct Image));
+    if (image == NULL) {
+        errMsg("malloc image");
+        close(fd);
+        return NULL;
+    }
+    if (statFileData(fd, &image->file) == -1) {
+        close(fd);
+        free(image);
+        return NULL;
+    }
+    initImage(image, name);
+    return image;
+}
+
+struct Image* imageFromFile(const struct File* file, const char* name)
+{
+    struct Image* image = malloc(sizeof(struct Image));
+    if (image == NULL) {
+        errMsg("malloc image");
+        close(file->fd);
+        return NULL;
+    }
+    image->file = *file;
+    initImage(image, name);
+    return image;
+}
+
+struct Image* imageFromBuffer(struct Buffer* buffer, size_t size, const char* name)
+{
+    struct Image* image = malloc(sizeof(struct Image));
+    if (image == NULL) {
+        errMsg("malloc image");
+        bufferUnref(buffer);
+        return NULL;
+    }
+    memset(&image->file, 0, sizeof(image->file));
+    image->file.fd = -1;
+    image->file.size = size;
+    initImage(image, name);
+    image->buffer = buffer;
+    image->data = buffer->data;
+    return image;
+}
+
+Boolean imageLoadData(struct Image* image)
+{
+    struct Buffer* buffer;
+
+    if (image->data != NULL) {
+        return TRUE;
+    }
+    if (image->file.size == 0) {
+        image->data = "";
+        return TRUE;
+    }
+    buffer = bufferAcquire(image->file.size);
+    if (buffer == NULL) {
+        return FALSE;
+    }
+    if (!readFully(image->file.fd, buffer->data, image->file.size, 0)) {
+        LOG_WARN("Could not read %s into memory.\n", image->path);
+        bufferUnref(buffer);
+        return FALSE;
+    }
+    image->buffer = buffer;
+    image->data = buffer->data;
+    return TRUE;
+}
+
+Boolean imageRefresh(struct Image* image)
+{
+    struct stat st;
+
+    if (fstat(image->file.fd, &st) == -1) {
+        errMsg("fstat");
+        return FALSE;
+    }
+    image->file.size = st.st_size;
+    image->file.modified = st.st_mtim;
+    return TRUE;
+}
+
+Boolean imageFileUnchanged(const struct Image* image)
+{
+    struct stat st;
+
+    if (fstat(image->file.fd, &st) == -1) {
+        errMsg("fstat");
+        return FALSE;
+    }
+    return st.st_size == image->file.size
+        && st.st_mtim.tv_sec == image->file.modified.tv_sec
+        && st.st_mtim.tv_nsec == image->file.modified.tv_nsec;
+}
+
+Boolean imageMatchesFile(const struct Image* image, const char* path)
+{
+    struct stat st;
+
+    if (strcmp(image->path, path) != 0 || stat(path, &st) == -1) {
+        return FALSE;
+    }
+    return st.st_dev == image->file.device
+        && st.st_ino == image->file.inode
+        && st.st_size == image->file.size
+        && st.st_mtim.tv_sec == image->file.modified.tv_sec
+        && st.st_mtim.tv_nsec == image->file.modified.tv_nsec;
+}
+
+static Boolean isCachedFile(const struct HashCacheEntry* entry, uint64_t pathHash, const struct File* file)
+{
+    return entry->used
+        && entry->pathHash == pathHash
+        && entry->device == file->device
+        && entry->inode == file->inode
+        && entry->modified.tv_sec == file->modified.tv_sec
+        && entry->modified.tv_nsec == file->modified.tv_nsec
+        && entry->size == file->size;
+}
+
+Boolean hashContents(const char* data, const struct File* file, uint64_t* hash)
+{
+    void* mapped;
+
+    if (data != NULL) {
+        *hash = hashData(data, file->size, 0);
+        return TRUE;
+    }
+    if (file->size == 0) {
+        *hash = hashData("", 0, 0);
+        return TRUE;
+    }
+    // The file is mapped rather than read, so the pages stay
+    // in the page cache for the sendfile() that follows.
+    mapped = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (mapped == MAP_FAILED) {
+        errMsg("mmap");
+        return FALSE;
+    }
+    madvise(mapped, file->size, MADV_SEQUENTIAL);
+    *hash = hashData(mapped, file->size, 0);
+    if (munmap(mapped, file->size) == -1) {
+        errMsg("munmap");
+    }
+    return TRUE;
+}
+
+static struct HashCacheEntry* cacheEntry(const struct Image* image, uint64_t* pathHash)
+{
+    *pathHash = hashData(image->path, strlen(image->path), 0);
+    return &hashCache[(*pathHash ^ image->file.inode) % HASH_CACHE_SIZE];
+}
+
+Boolean imageGetHash(struct Image* image, uint64_t* hash)
+{
+    struct HashCacheEntry* entry;
+    uint64_t pathHash;
+
+    if (image->growing) {
+        return FALSE;
+    }
+    if (image->hashState == HASH_UNKNOWN) {
+        entry = cacheEntry(image, &pathHash);
+        if (isCachedFile(entry, pathHash, &image->file)) {
+            image->hash = entry->hash;
+            image->hashState = HASH_VALID;
+        }
+    }
+    if (image->hashState != HASH_VALID) {
+        return FALSE;
+    }
+    *hash = image->hash;
+    return TRUE;
+}
+
+void imageSetHash(struct Image* image, uint64_t hash)
+{
+    uint64_t pathHash;
+    struct HashCacheEntry* entry = cacheEntry(image, &pathHash);
+
+    image->hash = hash;
+    image->hashState = HASH_VALID;
+    entry->used = TRUE;
+    entry->pathHash = pathHash;
+    entry->device = image->file.device;
+    entry->inode = image->file.inode;
+    entry->modified = image->file.modified;
+    entry->size = image->file.size;
+    entry->hash = hash;
+}
+
+void imageHashData(struct Image* image)
+{
+    if (image->data == NULL || image->growing) {
+        return;
+    }
+    image->hash = hashData(image->data, image->file.size, 0);
+    image->hashState = HASH_VALID;
+}
+
+const struct ImageMetadata* imageGetMetadata(struct Image* image)
+{
+    void* data;
+
+    if (image->growing) {
+        return NULL;
+    }
+    if (!image->metadataScanned) {
+        image->metadataScanned = TRUE;
+        if (image->data != NULL) {
+            image->hasMetadata = jpegScanMetadata((const unsigned char*) image->data,
+                    image->file.size, &image->metadata);
+        } else if (image->file.size > 0) {
+            data = mmap(NULL, image->file.size, PROT_READ, MAP_PRIVATE, image->file.fd, 0);
+            if (data == MAP_FAILED) {
+                errMsg("mmap");
+                return NULL;
+            }
+            image->hasMetadata = jpegScanMetadata(data, image->file.size, &image->metadata);
+            if (munmap(data, image->file.size) == -1) {
+                errMsg("munmap");
+            }
+        }
+    }
+    return image->hasMetadata ? &image->metadata : NULL;
+}
+
+struct Image* imageRef(struct Image* image)
+{
+    image->refCount++;
+    return image;
+}
+
+void imageUnref(struct Image* image)
+{
+    if (--image->refCount > 0) {
+        return;
+    }
+    while (image->renditions != NULL) {
+        struct Rendition* rendition = image->renditions;
+        image->renditions = rendition->next;
+        if (rendition->image != NULL) {
+            imageUnref(rendition->image);
+        }
+        free(rendition);
+    }
+    if (image->buffer != NULL) {
+        bufferUnref(image->buffer);
+    }
+    if (image->file.fd >= 0 && close(image->file.fd) == -1) {
+        errMsg("close image");
+    }
+    free(image);
+}
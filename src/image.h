@@ -0,0 +1,219 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include "boolean_util.h"
+#include "buffer_pool.h"
+#include "file_util.h"
+#include "jpeg_meta.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+typedef enum {
+    RENDITION_PENDING, // being rendered by a worker
+    RENDITION_READY,
+    RENDITION_FAILED   // e.g. not a JPEG or not larger than requested
+} RenditionState;
+
+typedef enum {
+    HASH_UNKNOWN,
+    HASH_PENDING, // being hashed by a worker
+    HASH_VALID,
+    HASH_FAILED   // the file could not be read
+} HashState;
+
+/**
+ * A smaller version of an image, e.g. a preview that fits the screen of
+ * a client. Renditions belong to their image and are freed with it.
+ */
+struct Rendition {
+    unsigned int maxWidth;  // the rendition fits into maxWidth x maxHeight
+    unsigned int maxHeight;
+    RenditionState state;
+    struct Image* image;    // the encoded rendition in memory once READY
+    struct Rendition* next;
+};
+
+/**
+ * An image file that is being forwarded to one or more clients.
+ *
+ * Images are reference counted. Every send queue that holds the image
+ * owns a reference, so the file is opened only once no matter how many
+ * clients receive it. The file is closed when the last reference is dropped.
+ * Reference counting is not thread-safe; images belong to the event loop.
+ *
+ * An image may additionally hold its contents in memory (data), which is
+ * a pooled buffer. It is then sent from memory and the file is never read
+ * again.
+ *
+ * A growing image is still being written. file.size is the size seen at the
+ * last imageRefresh(), the final size is known once growing is reset.
+ */
+struct Image {
+    int refCount;
+    uint32_t id; // the message id of its frames
+    char path[PATH_MAX];
+    struct File file;
+    struct Buffer* buffer;
+    const char* data; // contents of the buffer, or NULL if not loaded
+    Boolean growing;
+    HashState hashState;
+    uint64_t hash;
+    Boolean metadataScanned;
+    Boolean hasMetadata;
+    struct ImageMetadata metadata;
+    struct Rendition* renditions;
+};
+
+/**
+ * Let the image ids continue at first. The server starts them at a random
+ * value, so that a client does not confuse the images of an earlier run
+ * with the current ones.
+ */
+void imageSeedIds(uint32_t first);
+
+/**
+ * Open the image file at path.
+ *
+ * \return
+ * The image with a reference count of one, or NULL if the file
+ * could not be opened.
+ */
+struct Image* imageOpen(const char* path);
+
+/**
+ * Create an image from a file that the caller has opened already,
+ * e.g. a descriptor passed by a producer. The image takes over fd,
+ * also if it cannot be created. name identifies the image, it is
+ * usually its path.
+ *
+ * \return
+ * The image with a reference count of one, or NULL if fd does not
+ * refer to a regular file.
+ */
+struct Image* imageFromFd(int fd, const char* name);
+
+/**
+ * Create an image from a file that has been opened and examined already,
+ * e.g. asynchronously. The image takes over file->fd, also if it cannot
+ * be created.
+ *
+ * \return
+ * The image with a reference count of one, or NULL on error.
+ */
+struct Image* imageFromFile(const struct File* file, const char* name);
+
+/**
+ * Create an image that only exists in memory, e.g. a rendition.
+ * The image takes over the reference to buffer. It has no file,
+ * file.fd is -1 and file.size is size.
+ *
+ * \return
+ * The image with a reference count of one, or NULL on error.
+ */
+struct Image* imageFromBuffer(struct Buffer* buffer, size_t size, const char* name);
+
+/**
+ * Read the contents of the image into a buffer of the pool,
+ * so that later sends do not touch the disk.
+ *
+ * \return TRUE on success or if the image already is in memory.
+ */
+Boolean imageLoadData(struct Image* image);
+
+/**
+ * Update the size and modification time of the image from its file.
+ *
+ * \return TRUE on success, FALSE if the file could not be examined.
+ */
+Boolean imageRefresh(struct Image* image);
+
+/**
+ * Check whether the open file of the image has kept its size and
+ * modification time, so that it can still be sent from the file.
+ */
+Boolean imageFileUnchanged(const struct Image* image);
+
+/**
+ * Check whether path still names the file the image was opened from,
+ * unchanged since then.
+ */
+Boolean imageMatchesFile(const struct Image* image, const char* path);
+
+/**
+ * Get the content hash of the image if it is known, because the image has
+ * been hashed when it was prepared or by hashContents() on a worker, or
+ * because the file is in a cache keyed by path, inode and modification
+ * time of recently sent files. The file is never read here, so this may be
+ * called on the event loop.
+ *
+ * \return TRUE if the hash is known, FALSE otherwise or if the image
+ *         is still growing.
+ */
+Boolean imageGetHash(struct Image* image, uint64_t* hash);
+
+/**
+ * Remember the hash that a worker has computed for the image
+ * and enter it into the cache.
+ */
+void imageSetHash(struct Image* image, uint64_t hash);
+
+/**
+ * Compute the content hash of an image that is held in memory, bypassing
+ * the cache of imageGetHash(). Images that nobody else holds yet may be
+ * opened, loaded and hashed this way on a worker thread. The event loop
+ * enters the hash into the cache with imageSetHash() afterwards.
+ */
+void imageHashData(struct Image* image);
+
+/**
+ * Hash the contents of a file, from data if it is held in memory or else
+ * through a mapping of file. It does not touch any image, so it may be
+ * called on a worker for an image that is in use.
+ *
+ * \return TRUE on success, FALSE if the file could not be mapped.
+ */
+Boolean hashContents(const char* data, const struct File* file, uint64_t* hash);
+
+/**
+ * Get the size, orientation and capture time of a JPEG image. The file is
+ * scanned on first use, from memory or else through a mapping, of which
+ * only the headers are touched. Like imageHashData(), this may be called
+ * on a worker for an image that nobody else holds yet.
+ *
+ * \return the metadata, or NULL if the image is no JPEG or still growing.
+ */
+const struct ImageMetadata* imageGetMetadata(struct Image* image);
+
+/**
+ * Acquire another reference to the image.
+ */
+struct Image* imageRef(struct Image* image);
+
+/**
+ * Drop a reference. The image is freed when no reference is left.
+ */
+void imageUnref(struct Image* image);
+
+#endif
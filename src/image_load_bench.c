@@ -0,0 +1,220 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Benchmark that compares reading image files with blocking calls,
+ * one file after the other, to the io_uring based ImageLoader, which
+ * keeps many files in flight. Every file is evicted from the page cache
+ * before the cold runs, so that the disk is actually read.
+ */
+
+#define _GNU_SOURCE
+
+#include "buffer_pool.h"
+#include "command_queue.h"
+#include "err_util.h"
+#include "event_util.h"
+#include "image.h"
+#include "image_loader.h"
+#include "net_util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_NUM_FILES 64
+#define DEFAULT_FILE_KB 4096
+#define MAX_FILES 4096
+
+static char paths[MAX_FILES][MAX_COMMAND_LENGTH];
+// The file helpers log every file they open, stdout is discarded.
+static FILE* results;
+
+static double secondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void createFiles(const char* dir, long numFiles, size_t size)
+{
+    char* data = malloc(size);
+    size_t i;
+    long f;
+
+    if (data == NULL) {
+        errExit("malloc");
+    }
+    for (i = 0; i < size; ++i) {
+        data[i] = (char) (i * 131 + 7);
+    }
+    for (f = 0; f < numFiles; ++f) {
+        snprintf(paths[f], MAX_COMMAND_LENGTH, "%s/IMG_%04ld.JPG", dir, f);
+        int fd = open(paths[f], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            errExit("open");
+        }
+        data[0] = (char) f;
+        if (!writeFully(fd, data, size) || fsync(fd) == -1) {
+            errExit("write");
+        }
+        close(fd);
+    }
+    free(data);
+}
+
+/**
+ * Drop the clean pages of the files from the page cache.
+ */
+static void evictFiles(long numFiles)
+{
+    long f;
+    for (f = 0; f < numFiles; ++f) {
+        int fd = open(paths[f], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            errExit("open");
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static unsigned long checkImage(struct Image* image)
+{
+    unsigned long sum = (unsigned char) image->data[0];
+    imageUnref(image);
+    return sum;
+}
+
+static void printResult(const char* name, long numFiles, size_t size, double elapsed, unsigned long checksum)
+{
+    fprintf(results, "%-18s %6ld files  %9.3f ms  %9.1f MB/s  (checksum %lu)\n", name, numFiles,
+            elapsed * 1e3, numFiles * (double) size / (1024.0 * 1024.0) / elapsed, checksum);
+}
+
+static void runBlocking(const char* name, long numFiles, size_t size)
+{
+    struct timespec start;
+    unsigned long checksum = 0;
+    long f;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (f = 0; f < numFiles; ++f) {
+        struct Image* image = imageOpen(paths[f]);
+        if (image == NULL || !imageLoadData(image)) {
+            fprintf(stderr, "Cannot load %s.\n", paths[f]);
+            exit(EXIT_FAILURE);
+        }
+        checksum += checkImage(image);
+    }
+    printResult(name, numFiles, size, secondsSince(&start), checksum);
+}
+
+static void runUring(const char* name, long numFiles, size_t size)
+{
+    struct ImageLoader loader;
+    struct epoll_event event;
+    struct Command command;
+    struct Image* image;
+    struct timespec start;
+    unsigned long checksum = 0;
+    Boolean loaded;
+    long done = 0;
+    long f;
+    int epollFd = createEventLoop();
+
+    if (imageLoaderInit(&loader, epollFd) == -1) {
+        fprintf(results, "%-18s io_uring is not available: %s\n", name, strerror(errno));
+        close(epollFd);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&command, 0, sizeof(command));
+    command.fd = -1;
+    for (f = 0; f < numFiles; ++f) {
+        strcpy(command.line, paths[f]);
+        imageLoaderSubmit(&loader, &command, NULL);
+    }
+    while (done < numFiles) {
+        if (epoll_wait(epollFd, &event, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+        imageLoaderProcess(&loader);
+        while (imageLoaderNext(&loader, &command, &image, &loaded)) {
+            if (image == NULL) {
+                fprintf(stderr, "Cannot load %s.\n", command.line);
+                exit(EXIT_FAILURE);
+            }
+            checksum += checkImage(image);
+            ++done;
+        }
+    }
+    printResult(name, numFiles, size, secondsSince(&start), checksum);
+    imageLoaderDestroy(&loader);
+    close(epollFd);
+}
+
+int main(int argc, char* argv[])
+{
+    char dir[] = "/tmp/image-load-bench-XXXXXX";
+    long numFiles = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_FILES;
+    long fileKb = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_FILE_KB;
+    size_t size;
+    long f;
+
+    if (numFiles <= 0 || numFiles > MAX_FILES || fileKb <= 0) {
+        fprintf(stderr, "Usage: %s [num_files] [file_kb]\n", argv[0]);
+        return 1;
+    }
+    size = (size_t) fileKb * 1024;
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        errExit("redirect stdout");
+    }
+    setvbuf(results, NULL, _IOLBF, 0);
+    if (mkdtemp(dir) == NULL) {
+        errExit("mkdtemp");
+    }
+    // The same cache as the server, so that buffer reuse is measured as it is.
+    bufferPoolInit((size_t) POOL_CACHE_MEGABYTES * 1024 * 1024, FALSE);
+    createFiles(dir, numFiles, size);
+
+    evictFiles(numFiles);
+    runBlocking("blocking cold", numFiles, size);
+    evictFiles(numFiles);
+    runUring("io_uring cold", numFiles, size);
+    runBlocking("blocking warm", numFiles, size);
+    runUring("io_uring warm", numFiles, size);
+
+    for (f = 0; f < numFiles; ++f) {
+        unlink(paths[f]);
+    }
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,412 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include "err_util.h"
+#include "image_loader.h"
+#include "log_util.h"
+#include "stats.h"
+#include "time_util.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// The operation of a completion is kept in the low bits of its user data,
+// the other bits are the address of the request.
+#define OP_OPEN 0
+#define OP_STAT 1
+#define OP_READ 2
+#define OP_MASK ((uint64_t) 3)
+
+// Largest read that is submitted at once.
+#define MAX_READ_CHUNK (1U << 30)
+
+typedef enum {
+    LOAD_QUEUED,  // waiting until fewer files are in flight
+    LOAD_OPENING, // openat and statx submitted
+    LOAD_READING, // read into the buffer submitted
+    LOAD_DONE     // image is set, or NULL if the file could not be read
+} LoadState;
+
+struct LoadRequest {
+    struct Command command;
+    LoadState state;
+    struct Image* image;
+    Boolean loaded;     // read by the loader rather than passed in
+    int pendingOps;     // completions still expected for openat and statx
+    int fd;             // result of openat
+    int statResult;
+    struct statx stx;
+    struct Buffer* buffer;
+    size_t size;
+    size_t bytesRead;
+    struct timespec started;
+    struct LoadRequest* next;
+};
+
+int imageLoaderInit(struct ImageLoader* loader, int epollFd)
+{
+    int savedErrno;
+
+    memset(loader, 0, sizeof(*loader));
+    if (uringInit(&loader->ring, LOADER_RING_ENTRIES) == -1) {
+        return -1;
+    }
+    loader->source.type = SOURCE_IMAGE_LOADER;
+    loader->source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loader->source.fd == -1) {
+        errExit("eventfd");
+    }
+    if (uringRegisterEventFd(&loader->ring, loader->source.fd) == -1) {
+        savedErrno = errno;
+        close(loader->source.fd);
+        uringDestroy(&loader->ring);
+        errno = savedErrno;
+        return -1;
+    }
+    addEventSource(epollFd, &loader->source, EPOLLIN);
+    return 0;
+}
+
+static uint64_t userData(struct LoadRequest* req, uint64_t op)
+{
+    return (uint64_t) (uintptr_t) req | op;
+}
+
+static void finishRequest(struct ImageLoader* loader, struct LoadRequest* req, struct Image* image)
+{
+    req->image = image;
+    req->state = LOAD_DONE;
+    loader->inFlight--;
+}
+
+static void failRequest(struct ImageLoader* loader, struct LoadRequest* req, const char* reason)
+{
+    LOG_WARN("Cannot read file %s: %s.\n", req->command.line, reason);
+    if (req->fd >= 0) {
+        close(req->fd);
+        req->fd = -1;
+    }
+    if (req->buffer != NULL) {
+        bufferUnref(req->buffer);
+        req->buffer = NULL;
+    }
+    finishRequest(loader, req, NULL);
+}
+
+/**
+ * Submit the openat of the file together with a statx of its path.
+ * The statx is linked, so it only runs once the file has been opened.
+ */
+static void submitOpen(struct ImageLoader* loader, struct LoadRequest* req)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(&loader->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) req->command.line;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = userData(req, OP_OPEN);
+
+    sqe = uringGetSqe(&loader->ring);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) req->command.line;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uint64_t) (uintptr_t) &req->stx;
+    sqe->user_data = userData(req, OP_STAT);
+
+    req->pendingOps = 2;
+    req->state = LOAD_OPENING;
+    req->started = monotonicNow();
+    loader->inFlight++;
+}
+
+/**
+ * Submit a read of the rest of the file into the buffer.
+ */
+static void submitRead(struct ImageLoader* loader, struct LoadRequest* req)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(&loader->ring);
+    size_t remaining = req->size - req->bytesRead;
+
+    if (sqe == NULL) {
+        // Make room by handing what has been filled in to the kernel.
+        if (uringSubmit(&loader->ring) == -1) {
+            errMsg("io_uring_enter");
+        }
+        sqe = uringGetSqe(&loader->ring);
+        if (sqe == NULL) {
+            failRequest(loader, req, "submission queue is full");
+            return;
+        }
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (req->buffer->data + req->bytesRead);
+    sqe->len = remaining > MAX_READ_CHUNK ? MAX_READ_CHUNK : remaining;
+    sqe->off = req->bytesRead;
+    sqe->user_data = userData(req, OP_READ);
+    req->state = LOAD_READING;
+}
+
+/**
+ * The file has been read completely, create its image.
+ */
+static void completeFile(struct ImageLoader* loader, struct LoadRequest* req)
+{
+    struct File file;
+    struct Image* image;
+
+    file.data = NULL;
+    file.fd = req->fd;
+    file.size = req->size;
+    file.device = makedev(req->stx.stx_dev_major, req->stx.stx_dev_minor);
+    file.inode = req->stx.stx_ino;
+    file.modified.tv_sec = req->stx.stx_mtime.tv_sec;
+    file.modified.tv_nsec = req->stx.stx_mtime.tv_nsec;
+    req->fd = -1;
+
+    image = imageFromFile(&file, req->command.line);
+    if (image == NULL) {
+        failRequest(loader, req, "out of memory");
+        return;
+    }
+    image->buffer = req->buffer;
+    image->data = req->buffer != NULL ? req->buffer->data : "";
+    req->buffer = NULL;
+    histogramRecordSince(&stats.fileRead, &req->started);
+    finishRequest(loader, req, image);
+}
+
+/**
+ * Both openat and statx have completed.
+ */
+static void handleOpened(struct ImageLoader* loader, struct LoadRequest* req)
+{
+    if (req->fd < 0) {
+        failRequest(loader, req, strerror(-req->fd));
+        return;
+    }
+    if (req->statResult < 0) {
+        failRequest(loader, req, strerror(-req->statResult));
+        return;
+    }
+    if (!S_ISREG(req->stx.stx_mode)) {
+        failRequest(loader, req, "not a regular file");
+        return;
+    }
+    req->size = req->stx.stx_size;
+    if (req->size == 0) {
+        completeFile(loader, req);
+        return;
+    }
+    req->buffer = bufferAcquire(req->size);
+    if (req->buffer == NULL) {
+        failRequest(loader, req, "out of memory");
+        return;
+    }
+    submitRead(loader, req);
+}
+
+static void handleCompletion(struct ImageLoader* loader, uint64_t data, int res)
+{
+    struct LoadRequest* req = (struct LoadRequest*) (uintptr_t) (data & ~OP_MASK);
+
+    switch (data & OP_MASK) {
+    case OP_OPEN:
+        req->fd = res;
+        if (--req->pendingOps == 0) {
+            handleOpened(loader, req);
+        }
+        break;
+    case OP_STAT:
+        req->statResult = res;
+        if (--req->pendingOps == 0) {
+            handleOpened(loader, req);
+        }
+        break;
+    case OP_READ:
+        if (res < 0) {
+            failRequest(loader, req, strerror(-res));
+        } else if (res == 0) {
+            failRequest(loader, req, "file was truncated");
+        } else {
+            req->bytesRead += res;
+            if (req->bytesRead < req->size) {
+                submitRead(loader, req);
+            } else {
+                completeFile(loader, req);
+            }
+        }
+        break;
+    }
+}
+
+/**
+ * Open the queued files while fewer than MAX_LOADS_IN_FLIGHT are in flight.
+ */
+static void startQueued(struct ImageLoader* loader)
+{
+    struct LoadRequest* req;
+
+    for (req = loader->head; req != NULL && loader->inFlight < MAX_LOADS_IN_FLIGHT; req = req->next) {
+        if (req->state != LOAD_QUEUED) {
+            continue;
+        }
+        if (uringSpaceLeft(&loader->ring) < 2) {
+            if (uringSubmit(&loader->ring) == -1) {
+                errMsg("io_uring_enter");
+            }
+            if (uringSpaceLeft(&loader->ring) < 2) {
+                break;
+            }
+        }
+        submitOpen(loader, req);
+    }
+    if (uringSubmit(&loader->ring) == -1) {
+        errMsg("io_uring_enter");
+    }
+}
+
+void imageLoaderSubmit(struct ImageLoader* loader, const struct Command* command, struct Image* image)
+{
+    struct LoadRequest* req = calloc(1, sizeof(struct LoadRequest));
+    if (req == NULL) {
+        errMsg("calloc load request");
+        if (image != NULL) {
+            imageUnref(image);
+        }
+        return;
+    }
+    memcpy(&req->command, command, sizeof(struct Command));
+    req->command.fd = -1;
+    req->fd = -1;
+    req->image = image;
+    req->loaded = image == NULL;
+    req->state = image == NULL ? LOAD_QUEUED : LOAD_DONE;
+
+    if (loader->tail == NULL) {
+        loader->head = req;
+    } else {
+        loader->tail->next = req;
+    }
+    loader->tail = req;
+
+    if (image == NULL) {
+        startQueued(loader);
+    }
+}
+
+void imageLoaderSubmitCommand(struct ImageLoader* loader, const struct Command* command)
+{
+    struct LoadRequest* req = calloc(1, sizeof(struct LoadRequest));
+    if (req == NULL) {
+        errMsg("calloc load request");
+        return;
+    }
+    memcpy(&req->command, command, sizeof(struct Command));
+    req->command.fd = -1;
+    req->fd = -1;
+    req->state = LOAD_DONE;
+
+    if (loader->tail == NULL) {
+        loader->head = req;
+    } else {
+        loader->tail->next = req;
+    }
+    loader->tail = req;
+}
+
+Boolean imageLoaderHasPending(const struct ImageLoader* loader)
+{
+    return loader->head != NULL;
+}
+
+void imageLoaderProcess(struct ImageLoader* loader)
+{
+    struct io_uring_cqe* cqe;
+    uint64_t value;
+
+    // Reset the eventfd first so that no completion posted meanwhile gets lost.
+    if (read(loader->source.fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        errExit("eventfd read");
+    }
+    while ((cqe = uringPeekCqe(&loader->ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        uringCqeSeen(&loader->ring);
+        handleCompletion(loader, data, res);
+    }
+    startQueued(loader);
+}
+
+Boolean imageLoaderNext(struct ImageLoader* loader, struct Command* command,
+        struct Image** image, Boolean* loaded)
+{
+    struct LoadRequest* req = loader->head;
+
+    if (req == NULL || req->state != LOAD_DONE) {
+        return FALSE;
+    }
+    loader->head = req->next;
+    if (loader->head == NULL) {
+        loader->tail = NULL;
+    }
+    memcpy(command, &req->command, sizeof(struct Command));
+    *image = req->image;
+    *loaded = req->loaded;
+    free(req);
+    return TRUE;
+}
+
+void imageLoaderDestroy(struct ImageLoader* loader)
+{
+    struct LoadRequest* req;
+
+    // The kernel may still write into the buffers of the requests in flight.
+    while (loader->inFlight > 0) {
+        if (uringWait(&loader->ring) == -1) {
+            errExit("io_uring_enter");
+        }
+        imageLoaderProcess(loader);
+    }
+    while ((req = loader->head) != NULL) {
+        loader->head = req->next;
+        if (req->image != NULL) {
+            imageUnref(req->image);
+        }
+        free(req);
+    }
+    loader->tail = NULL;
+    close(loader->source.fd);
+    uringDestroy(&loader->ring);
+}
@@ -0,0 +1,115 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_LOADER_H_
+#define IMAGE_LOADER_H_
+
+#include "boolean_util.h"
+#include "command_queue.h"
+#include "event_util.h"
+#include "image.h"
+#include "uring.h"
+
+// Submission queue entries of the ring.
+#define LOADER_RING_ENTRIES 64
+// Files that are opened or read at the same time. Every load needs
+// at most two submission entries at once.
+#define MAX_LOADS_IN_FLIGHT 32
+
+// A command whose image is being read, see image_loader.c.
+struct LoadRequest;
+
+/**
+ * Reads image files with io_uring without blocking the event loop.
+ *
+ * A file is opened with an openat that is linked to a statx of the path,
+ * so both go to the kernel in one submission. Once the size is known,
+ * the contents are read into a pooled buffer. Many files are in flight
+ * at the same time; the kernel signals completions on the eventfd of the
+ * source, which is registered with the event loop.
+ *
+ * Requests are kept in the order of the commands, so images come out in
+ * that order even if a later file is read faster.
+ */
+struct ImageLoader {
+    struct EventSource source;
+    struct Uring ring;
+    struct LoadRequest* head;
+    struct LoadRequest* tail;
+    size_t inFlight;
+};
+
+/**
+ * Set up the ring and register the loader with the event loop.
+ *
+ * \return 0 on success, -1 with errno set if io_uring is not available.
+ *         The caller then has to read the files with blocking calls.
+ */
+int imageLoaderInit(struct ImageLoader* loader, int epollFd);
+
+/**
+ * Free the ring and all pending requests.
+ */
+void imageLoaderDestroy(struct ImageLoader* loader);
+
+/**
+ * Append a command to the requests.
+ *
+ * \param image
+ * NULL to read the file named by the command line. Otherwise the image
+ * is already available and only waits for the requests before it;
+ * the loader takes over the reference. The loader never takes over
+ * command->fd.
+ */
+void imageLoaderSubmit(struct ImageLoader* loader, const struct Command* command, struct Image* image);
+
+/**
+ * Append a command without a file, e.g. image taken, to the requests,
+ * so that it does not overtake the files that are still being read.
+ * imageLoaderNext() returns it without an image.
+ */
+void imageLoaderSubmitCommand(struct ImageLoader* loader, const struct Command* command);
+
+/**
+ * Return TRUE if there is a request that has not been taken yet.
+ */
+Boolean imageLoaderHasPending(const struct ImageLoader* loader);
+
+/**
+ * Handle the completions signalled by the eventfd and start the next reads.
+ */
+void imageLoaderProcess(struct ImageLoader* loader);
+
+/**
+ * Take the oldest request if it is done.
+ *
+ * \param image
+ * Receives the reference to the image, or NULL if the file could not be read
+ * or the command has no file.
+ * \param loaded
+ * Set to TRUE if the image has been read by the loader.
+ * \return FALSE if the oldest request is still in flight or there is none.
+ */
+Boolean imageLoaderNext(struct ImageLoader* loader, struct Command* command,
+        struct Image** image, Boolean* loaded);
+
+#endif
@@ -0,0 +1,837 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * End-to-end benchmark of the server. The harness starts the server on
+ * loopback and plays both sides around it: the libipho-core side, which
+ * writes "+" and file names of synthetic images into the FIFO at a fixed
+ * rate, and one or more Android screens, which keep the heartbeat
+ * connection open and parse the frames on the data port.
+ *
+ * The latency of an image is measured from the write into the FIFO to
+ * the last byte received by a screen. Every image file starts with the
+ * sequence number of the command it was written for, so screens that
+ * fall behind or lose images are measured correctly. The results are
+ * printed as a single JSON object to stdout.
+ */
+
+#define _GNU_SOURCE
+
+#include "boolean_util.h"
+#include "err_util.h"
+#include "net_util.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DATA_PORT 1338
+#define HEARTBEAT_PORT 1339
+
+#define DEFAULT_CLIENTS 1
+#define DEFAULT_IMAGES 50
+#define DEFAULT_RATE 10
+#define DEFAULT_IMAGE_KB 3000
+#define DEFAULT_RECONNECTS 5
+#define MAX_CLIENTS 64
+#define MAX_SERVER_ARGS 32
+
+// The synthetic images are rewritten in turn. A file is only rewritten
+// after this many newer commands, long after it has been sent.
+#define NUM_IMAGE_FILES 16
+#define SEQUENCE_LENGTH 8
+
+// How long screens wait for the outstanding images after the last command.
+#define DRAIN_TIMEOUT_MS 5000
+#define STARTUP_TIMEOUT_MS 5000
+#define RECEIVE_BUFFER_SIZE (256 * 1024)
+#define POLL_INTERVAL_MS 100
+
+typedef enum {
+    STAGE_HEADER,     // collecting a frame header
+    STAGE_START_SIZE, // collecting the size in FRAME_IMAGE_START
+    STAGE_PAYLOAD     // streaming a payload
+} ParseStage;
+
+/**
+ * Incremental parser of what the server sends on the data port.
+ * Payloads are not stored, only the sequence number at the start
+ * of an image is kept.
+ */
+struct Parser {
+    Boolean legacy;        // protocol version 1
+    ParseStage stage;
+    unsigned char small[FRAME_HEADER_LENGTH];
+    size_t have;
+    size_t need;
+    uint64_t remaining;    // payload bytes left
+    Boolean imagePayload;  // the payload belongs to an image
+    Boolean endsImage;     // the image is complete after the payload
+    unsigned char sequence[SEQUENCE_LENGTH];
+    size_t sequenceHave;
+};
+
+struct Client {
+    int index;
+    int dataFd;
+    int heartbeatFd;
+    pthread_t thread;
+    struct Parser parser;
+    long images;
+    long duplicates;     // images received again, e.g. replays
+    long taken;
+    uint64_t bytes;
+    int64_t lastByteNs;
+    int64_t* latencies;  // nanoseconds, indexed by sequence number, -1 if unknown
+};
+
+// Settings
+static const char* serverPath = NULL;
+static const char* serverArgs[MAX_SERVER_ARGS];
+static int numServerArgs = 0;
+static const char* logPath = "/dev/null";
+static int numClients = DEFAULT_CLIENTS;
+static long numImages = DEFAULT_IMAGES;
+static double rate = DEFAULT_RATE;
+static size_t imageSize = (size_t) DEFAULT_IMAGE_KB * 1024;
+static int numReconnects = DEFAULT_RECONNECTS;
+static Boolean legacy = FALSE;
+static uint8_t capabilities = 0;
+
+static char workDir[] = "/tmp/ipho-bench-XXXXXX";
+static char fifoPath[PATH_MAX];
+static char imagePaths[NUM_IMAGE_FILES][PATH_MAX];
+static pid_t serverPid = -1;
+
+// Time each command was written into the FIFO, indexed by sequence number.
+static _Atomic int64_t* writtenNs;
+static atomic_bool writing;
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepUntilNs(int64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int connectLoopback(int port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int optval = RECEIVE_BUFFER_SIZE;
+
+    if (fd == -1) {
+        errExit("socket");
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static Boolean readExactly(int fd, char* buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = read(fd, buffer, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        buffer += n;
+        length -= n;
+    }
+    return TRUE;
+}
+
+/**
+ * Connect a screen: heartbeat first, like the app does, then the data
+ * port with the hello of protocol version 2.
+ */
+static Boolean connectClient(struct Client* client)
+{
+    char hello[HELLO_LENGTH];
+    struct Hello ours;
+    struct Hello theirs;
+
+    client->heartbeatFd = connectLoopback(HEARTBEAT_PORT);
+    client->dataFd = connectLoopback(DATA_PORT);
+    if (client->heartbeatFd == -1 || client->dataFd == -1) {
+        return FALSE;
+    }
+    memset(&client->parser, 0, sizeof(client->parser));
+    client->parser.legacy = legacy;
+    client->parser.need = legacy ? 1 : FRAME_HEADER_LENGTH;
+    if (legacy) {
+        return TRUE;
+    }
+    ours.version = PROTOCOL_VERSION;
+    ours.capabilities = capabilities;
+    ours.window = MAX_WINDOW;
+    encodeHello(&ours, hello);
+    if (!writeFully(client->dataFd, hello, HELLO_LENGTH)
+            || !readExactly(client->dataFd, hello, HELLO_LENGTH)
+            || !decodeHello(hello, &theirs)) {
+        return FALSE;
+    }
+    return theirs.version == PROTOCOL_VERSION;
+}
+
+static void disconnectClient(struct Client* client)
+{
+    if (client->dataFd != -1) {
+        close(client->dataFd);
+    }
+    if (client->heartbeatFd != -1) {
+        close(client->heartbeatFd);
+    }
+    client->dataFd = -1;
+    client->heartbeatFd = -1;
+}
+
+static void imageReceived(struct Client* client, int64_t now)
+{
+    struct Parser* parser = &client->parser;
+    uint64_t sequence = 0;
+    int i;
+
+    if (parser->sequenceHave == SEQUENCE_LENGTH) {
+        for (i = SEQUENCE_LENGTH - 1; i >= 0; --i) {
+            sequence = (sequence << 8) | parser->sequence[i];
+        }
+    }
+    parser->sequenceHave = 0;
+    if (client->latencies != NULL && sequence < (uint64_t) numImages) {
+        int64_t written = atomic_load_explicit(&writtenNs[sequence], memory_order_acquire);
+        if (client->latencies[sequence] != 0) {
+            // Only the first delivery of an image counts.
+            client->duplicates++;
+            return;
+        }
+        client->latencies[sequence] = written != 0 ? now - written : -1;
+    }
+    client->images++;
+}
+
+/**
+ * A complete frame header (or version 1 command) has been collected.
+ */
+static void handleHeader(struct Client* client, int64_t now)
+{
+    struct Parser* parser = &client->parser;
+    struct FrameHeader frame;
+
+    parser->have = 0;
+    parser->stage = STAGE_HEADER;
+    parser->need = parser->legacy ? 1 : FRAME_HEADER_LENGTH;
+
+    if (parser->legacy) {
+        if (parser->small[0] == COMMAND_IMAGE_TAKEN) {
+            client->taken++;
+        } else if (parser->small[0] == COMMAND_IMAGE_DATA) {
+            parser->need = 5; // the length follows
+            parser->have = 1;
+        }
+        return;
+    }
+    decodeFrameHeader((const char*) parser->small, &frame);
+    switch (frame.type) {
+    case FRAME_IMAGE_TAKEN:
+        client->taken++;
+        return;
+    case FRAME_IMAGE_START:
+        parser->stage = STAGE_START_SIZE;
+        parser->need = START_PAYLOAD_LENGTH;
+        parser->sequenceHave = 0;
+        return;
+    case FRAME_IMAGE_DATA:
+        parser->sequenceHave = 0;
+        parser->imagePayload = TRUE;
+        parser->endsImage = TRUE;
+        break;
+    case FRAME_IMAGE_CHUNK:
+        parser->imagePayload = TRUE;
+        parser->endsImage = (frame.flags & FRAME_FLAG_LAST) != 0;
+        break;
+    default:
+        parser->imagePayload = FALSE;
+        parser->endsImage = FALSE;
+        break;
+    }
+    parser->remaining = frame.length;
+    if (frame.length == 0) {
+        if (parser->endsImage) {
+            imageReceived(client, now);
+        }
+        return;
+    }
+    parser->stage = STAGE_PAYLOAD;
+}
+
+/**
+ * The version 1 image command with its base-255 length is complete.
+ */
+static void handleLegacyLength(struct Client* client, int64_t now)
+{
+    struct Parser* parser = &client->parser;
+    uint64_t length = 0;
+    int i;
+
+    for (i = 4; i >= 1; --i) {
+        length = length * 0xff + parser->small[i];
+    }
+    parser->have = 0;
+    parser->need = 1;
+    parser->sequenceHave = 0;
+    parser->imagePayload = TRUE;
+    parser->endsImage = TRUE;
+    parser->remaining = length;
+    if (length == 0) {
+        imageReceived(client, now);
+        return;
+    }
+    parser->stage = STAGE_PAYLOAD;
+}
+
+/**
+ * Feed received bytes through the parser.
+ */
+static void parseData(struct Client* client, const unsigned char* data, size_t length, int64_t now)
+{
+    struct Parser* parser = &client->parser;
+
+    while (length > 0) {
+        if (parser->stage == STAGE_PAYLOAD) {
+            size_t n = length < parser->remaining ? length : (size_t) parser->remaining;
+            if (parser->imagePayload && parser->sequenceHave < SEQUENCE_LENGTH) {
+                size_t copy = SEQUENCE_LENGTH - parser->sequenceHave;
+                copy = copy < n ? copy : n;
+                memcpy(parser->sequence + parser->sequenceHave, data, copy);
+                parser->sequenceHave += copy;
+            }
+            data += n;
+            length -= n;
+            parser->remaining -= n;
+            if (parser->remaining == 0) {
+                parser->stage = STAGE_HEADER;
+                parser->have = 0;
+                parser->need = parser->legacy ? 1 : FRAME_HEADER_LENGTH;
+                if (parser->endsImage) {
+                    imageReceived(client, now);
+                }
+            }
+            continue;
+        }
+        size_t n = parser->need - parser->have;
+        n = n < length ? n : length;
+        memcpy(parser->small + parser->have, data, n);
+        parser->have += n;
+        data += n;
+        length -= n;
+        if (parser->have < parser->need) {
+            continue;
+        }
+        if (parser->stage == STAGE_START_SIZE) {
+            // The size is not needed, the chunks tell where the image ends.
+            parser->stage = STAGE_HEADER;
+            parser->have = 0;
+            parser->need = FRAME_HEADER_LENGTH;
+        } else if (parser->legacy && parser->need == 5) {
+            handleLegacyLength(client, now);
+        } else {
+            handleHeader(client, now);
+        }
+    }
+}
+
+/**
+ * Receive until the client has seen expected images, or until nothing
+ * has arrived for timeoutMs once the writer has finished.
+ *
+ * \return FALSE if a connection was closed by the server.
+ */
+static Boolean receiveImages(struct Client* client, long expected, int timeoutMs)
+{
+    static __thread unsigned char buffer[RECEIVE_BUFFER_SIZE];
+    struct pollfd pfds[2];
+    int64_t lastActivity = nowNs();
+    ssize_t n;
+    int res;
+
+    pfds[0].fd = client->dataFd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = client->heartbeatFd;
+    pfds[1].events = POLLIN;
+    while (client->images < expected) {
+        res = poll(pfds, 2, POLL_INTERVAL_MS);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("poll");
+        }
+        if (res == 0) {
+            if (!atomic_load(&writing) && nowNs() - lastActivity > (int64_t) timeoutMs * 1000000) {
+                return TRUE;
+            }
+            continue;
+        }
+        if (pfds[1].revents) {
+            // Heartbeat probes only have to be consumed.
+            n = read(client->heartbeatFd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                return FALSE;
+            }
+        }
+        if (pfds[0].revents) {
+            n = read(client->dataFd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                return FALSE;
+            }
+            lastActivity = nowNs();
+            client->bytes += n;
+            client->lastByteNs = lastActivity;
+            parseData(client, buffer, n, lastActivity);
+        }
+    }
+    return TRUE;
+}
+
+static void* runClient(void* clientVoid)
+{
+    struct Client* client = clientVoid;
+    if (!receiveImages(client, numImages, DRAIN_TIMEOUT_MS)) {
+        fprintf(stderr, "Screen %d was disconnected.\n", client->index);
+    }
+    return NULL;
+}
+
+static void createImages()
+{
+    char* data = malloc(imageSize);
+    size_t i;
+    int f;
+
+    if (data == NULL) {
+        errExit("malloc");
+    }
+    for (i = 0; i < imageSize; ++i) {
+        data[i] = (char) (i * 131 + 7);
+    }
+    for (f = 0; f < NUM_IMAGE_FILES; ++f) {
+        snprintf(imagePaths[f], PATH_MAX, "%s/IMG_%02d.JPG", workDir, f);
+        int fd = open(imagePaths[f], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || !writeFully(fd, data, imageSize)) {
+            errExit("write image");
+        }
+        close(fd);
+    }
+    free(data);
+}
+
+/**
+ * Stamp the file with the sequence number of the command. This also
+ * changes its modification time, so the server reads it like a new photo.
+ */
+static void stampImage(const char* path, uint64_t sequence)
+{
+    unsigned char bytes[SEQUENCE_LENGTH];
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    int i;
+
+    for (i = 0; i < SEQUENCE_LENGTH; ++i) {
+        bytes[i] = (unsigned char) (sequence >> (8 * i));
+    }
+    if (fd == -1 || pwrite(fd, bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+        errExit("stamp image");
+    }
+    close(fd);
+}
+
+static void startServer()
+{
+    const char* argv[MAX_SERVER_ARGS + 3];
+    int i;
+    int attempt;
+    int fd;
+
+    argv[0] = serverPath;
+    for (i = 0; i < numServerArgs; ++i) {
+        argv[i + 1] = serverArgs[i];
+    }
+    argv[numServerArgs + 1] = fifoPath;
+    argv[numServerArgs + 2] = NULL;
+
+    serverPid = fork();
+    if (serverPid == -1) {
+        errExit("fork");
+    }
+    if (serverPid == 0) {
+        fd = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1) {
+            _exit(127);
+        }
+        execv(serverPath, (char* const*) argv);
+        _exit(127);
+    }
+
+    // The server listens once it has set up its event loop.
+    for (attempt = 0; attempt < STARTUP_TIMEOUT_MS / 10; ++attempt) {
+        fd = connectLoopback(HEARTBEAT_PORT);
+        if (fd != -1) {
+            close(fd);
+            return;
+        }
+        if (waitpid(serverPid, NULL, WNOHANG) == serverPid) {
+            fprintf(stderr, "Server %s exited during startup.\n", serverPath);
+            exit(EXIT_FAILURE);
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "Server did not start listening.\n");
+    kill(serverPid, SIGTERM);
+    exit(EXIT_FAILURE);
+}
+
+static void stopServer()
+{
+    kill(serverPid, SIGTERM);
+    waitpid(serverPid, NULL, 0);
+}
+
+/**
+ * Write the commands into the FIFO at the configured rate.
+ * Returns the time of the first write.
+ */
+static int64_t writeCommands()
+{
+    char line[PATH_MAX + 4];
+    int64_t interval = rate > 0 ? (int64_t) (1e9 / rate) : 0;
+    int64_t start;
+    int64_t next;
+    long i;
+    int fifoFd = open(fifoPath, O_WRONLY | O_CLOEXEC);
+
+    if (fifoFd == -1) {
+        errExit("open fifo");
+    }
+    start = nowNs();
+    next = start;
+    for (i = 0; i < numImages; ++i) {
+        const char* path = imagePaths[i % NUM_IMAGE_FILES];
+        int length = snprintf(line, sizeof(line), "+\n%s\n", path);
+        stampImage(path, i);
+        atomic_store_explicit(&writtenNs[i], nowNs(), memory_order_release);
+        if (!writeFully(fifoFd, line, length)) {
+            errExit("write fifo");
+        }
+        next += interval;
+        sleepUntilNs(next);
+    }
+    close(fifoFd);
+    return start;
+}
+
+/**
+ * Time from connecting a screen until the replayed latest image has
+ * been received completely, in nanoseconds, or -1 if it did not arrive.
+ */
+static int64_t measureReconnect()
+{
+    struct Client client;
+    int64_t start = nowNs();
+
+    memset(&client, 0, sizeof(client));
+    client.dataFd = -1;
+    client.heartbeatFd = -1;
+    if (!connectClient(&client)) {
+        disconnectClient(&client);
+        return -1;
+    }
+    receiveImages(&client, 1, DRAIN_TIMEOUT_MS);
+    disconnectClient(&client);
+    return client.images == 1 ? client.lastByteNs - start : -1;
+}
+
+static int compareInt64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentileMs(const int64_t* sorted, size_t count, double p)
+{
+    size_t rank;
+    if (count == 0) {
+        return 0.0;
+    }
+    rank = (size_t) (p / 100.0 * count + 0.999999);
+    rank = rank == 0 ? 1 : rank > count ? count : rank;
+    return sorted[rank - 1] / 1e6;
+}
+
+static void usage(const char* programName)
+{
+    fprintf(stderr, "Measure the latency and throughput of libipho-screen-server.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage: %s [-s server] [-c clients] [-n images] [-r rate] [-z kilobytes]\n", programName);
+    fprintf(stderr, "       [-R reconnects] [-1] [-C] [-L logfile] [-- server options]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -s server:     server executable (default: next to this program).\n");
+    fprintf(stderr, "  -c clients:    number of screens (default %d).\n", DEFAULT_CLIENTS);
+    fprintf(stderr, "  -n images:     number of images (default %d).\n", DEFAULT_IMAGES);
+    fprintf(stderr, "  -r rate:       images per second, 0 writes as fast as possible\n");
+    fprintf(stderr, "                 (default %d).\n", DEFAULT_RATE);
+    fprintf(stderr, "  -z kilobytes:  size of an image (default %d).\n", DEFAULT_IMAGE_KB);
+    fprintf(stderr, "  -R reconnects: reconnects whose time is measured (default %d).\n", DEFAULT_RECONNECTS);
+    fprintf(stderr, "  -1:            screens use protocol version 1.\n");
+    fprintf(stderr, "  -C:            screens request chunked transfers.\n");
+    fprintf(stderr, "  -L logfile:    keep the output of the server.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The server has to be able to bind ports %d and %d.\n", DATA_PORT, HEARTBEAT_PORT);
+    exit(1);
+}
+
+static void parseArguments(int argc, char* argv[])
+{
+    static char defaultServer[PATH_MAX];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:n:r:z:R:1CL:")) != -1) {
+        switch (opt) {
+        case 's':
+            serverPath = optarg;
+            break;
+        case 'c':
+            numClients = strtol(optarg, NULL, 10);
+            if (numClients <= 0 || numClients > MAX_CLIENTS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            numImages = strtol(optarg, NULL, 10);
+            if (numImages <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            if (rate < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'z': {
+            long kb = strtol(optarg, NULL, 10);
+            if (kb <= 0) {
+                usage(argv[0]);
+            }
+            imageSize = (size_t) kb * 1024;
+            break;
+        }
+        case 'R':
+            numReconnects = strtol(optarg, NULL, 10);
+            if (numReconnects < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case '1':
+            legacy = TRUE;
+            break;
+        case 'C':
+            capabilities |= CAP_CHUNKED;
+            break;
+        case 'L':
+            logPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind > MAX_SERVER_ARGS) {
+        usage(argv[0]);
+    }
+    while (optind < argc) {
+        serverArgs[numServerArgs++] = argv[optind++];
+    }
+    if (serverPath == NULL) {
+        ssize_t n = readlink("/proc/self/exe", defaultServer, sizeof(defaultServer) - 1);
+        if (n == -1) {
+            errExit("readlink");
+        }
+        defaultServer[n] = '\0';
+        snprintf(defaultServer + strlen(dirname(defaultServer)), 32, "/libipho-screen-server");
+        serverPath = defaultServer;
+    }
+    if (SEQUENCE_LENGTH > imageSize) {
+        usage(argv[0]);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    struct Client clients[MAX_CLIENTS];
+    int64_t* latencies;
+    int64_t* reconnects;
+    size_t numLatencies = 0;
+    size_t numReconnected = 0;
+    uint64_t totalBytes = 0;
+    long received = 0;
+    long duplicates = 0;
+    long taken = 0;
+    int64_t start;
+    int64_t end = 0;
+    double latencySum = 0;
+    double reconnectSum = 0;
+    long i;
+    int c;
+    int f;
+
+    parseArguments(argc, argv);
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        errExit("signal");
+    }
+    if (mkdtemp(workDir) == NULL) {
+        errExit("mkdtemp");
+    }
+    snprintf(fifoPath, sizeof(fifoPath), "%s/fifo", workDir);
+    if (mkfifo(fifoPath, S_IRUSR | S_IWUSR) == -1) {
+        errExit("mkfifo");
+    }
+    createImages();
+    writtenNs = calloc(numImages, sizeof(*writtenNs));
+    latencies = calloc((size_t) numImages * numClients, sizeof(int64_t));
+    reconnects = calloc(numReconnects > 0 ? numReconnects : 1, sizeof(int64_t));
+    if (writtenNs == NULL || latencies == NULL || reconnects == NULL) {
+        errExit("calloc");
+    }
+
+    startServer();
+    atomic_store(&writing, TRUE);
+    for (c = 0; c < numClients; ++c) {
+        memset(&clients[c], 0, sizeof(clients[c]));
+        clients[c].index = c;
+        clients[c].latencies = latencies + (size_t) c * numImages;
+        if (!connectClient(&clients[c])) {
+            fprintf(stderr, "Screen %d cannot connect.\n", c);
+            stopServer();
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (c = 0; c < numClients; ++c) {
+        int perr = pthread_create(&clients[c].thread, NULL, runClient, &clients[c]);
+        if (perr != 0) {
+            errExitEN(perr, "pthread_create");
+        }
+    }
+
+    start = writeCommands();
+    atomic_store(&writing, FALSE);
+    for (c = 0; c < numClients; ++c) {
+        pthread_join(clients[c].thread, NULL);
+    }
+    for (c = 0; c < numClients; ++c) {
+        for (i = 0; i < numImages; ++i) {
+            if (clients[c].latencies[i] > 0) {
+                latencies[numLatencies++] = clients[c].latencies[i];
+                latencySum += clients[c].latencies[i];
+            }
+        }
+        received += clients[c].images;
+        duplicates += clients[c].duplicates;
+        taken += clients[c].taken;
+        totalBytes += clients[c].bytes;
+        if (clients[c].lastByteNs > end) {
+            end = clients[c].lastByteNs;
+        }
+        disconnectClient(&clients[c]);
+    }
+    qsort(latencies, numLatencies, sizeof(int64_t), compareInt64);
+
+    // Let the server notice that the screens are gone.
+    usleep(100000);
+    for (i = 0; i < numReconnects; ++i) {
+        int64_t t = measureReconnect();
+        if (t >= 0) {
+            reconnects[numReconnected++] = t;
+            reconnectSum += t;
+        }
+        usleep(50000);
+    }
+    qsort(reconnects, numReconnected, sizeof(int64_t), compareInt64);
+    stopServer();
+
+    printf("{\"clients\": %d, \"images\": %ld, \"image_bytes\": %zu, \"rate\": %.3f, ",
+            numClients, numImages, imageSize, rate);
+    printf("\"protocol\": \"%s\", ", legacy ? "v1" : (capabilities & CAP_CHUNKED) ? "v2-chunked" : "v2");
+    printf("\"received\": %ld, \"lost\": %ld, \"duplicates\": %ld, \"image_taken\": %ld, ",
+            received, numImages * numClients - received, duplicates, taken);
+    printf("\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f}, ",
+            percentileMs(latencies, numLatencies, 50), percentileMs(latencies, numLatencies, 99),
+            percentileMs(latencies, numLatencies, 100),
+            numLatencies > 0 ? latencySum / numLatencies / 1e6 : 0.0);
+    printf("\"throughput_mb_s\": %.3f, ",
+            end > start ? totalBytes / (1024.0 * 1024.0) / ((end - start) / 1e9) : 0.0);
+    printf("\"reconnect_ms\": {\"count\": %zu, \"p50\": %.3f, \"max\": %.3f, \"mean\": %.3f}}\n",
+            numReconnected, percentileMs(reconnects, numReconnected, 50),
+            percentileMs(reconnects, numReconnected, 100),
+            numReconnected > 0 ? reconnectSum / numReconnected / 1e6 : 0.0);
+
+    for (f = 0; f < NUM_IMAGE_FILES; ++f) {
+        unlink(imagePaths[f]);
+    }
+    unlink(fifoPath);
+    rmdir(workDir);
+    return 0;
+}
@@ -0,0 +1,244 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "jpeg_meta.h"
+
+#include <string.h>
+
+#define MARKER_SOI  0xD8
+#define MARKER_EOI  0xD9
+#define MARKER_SOS  0xDA
+#define MARKER_APP1 0xE1
+#define MARKER_TEM  0x01
+
+#define TIFF_SHORT 3
+#define TIFF_LONG  4
+#define TIFF_ASCII 2
+#define IFD_ENTRY_LENGTH 12
+
+#define TAG_ORIENTATION 0x0112
+#define TAG_DATE_TIME 0x0132
+#define TAG_EXIF_IFD 0x8769
+#define TAG_DATE_TIME_ORIGINAL 0x9003
+
+/**
+ * The TIFF structure inside an EXIF segment. Offsets are relative to data.
+ */
+struct Tiff {
+    const unsigned char* data;
+    size_t size;
+    Boolean bigEndian;
+};
+
+static uint16_t readBe16(const unsigned char* p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint16_t tiff16(const struct Tiff* tiff, size_t offset)
+{
+    const unsigned char* p = tiff->data + offset;
+    return tiff->bigEndian ? readBe16(p) : (uint16_t) (p[1] << 8 | p[0]);
+}
+
+static uint32_t tiff32(const struct Tiff* tiff, size_t offset)
+{
+    const unsigned char* p = tiff->data + offset;
+    if (tiff->bigEndian) {
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    }
+    return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
+
+/**
+ * TRUE if length bytes at offset lie within the TIFF data.
+ */
+static Boolean inTiff(const struct Tiff* tiff, size_t offset, size_t length)
+{
+    return offset <= tiff->size && tiff->size - offset >= length ? TRUE : FALSE;
+}
+
+/**
+ * Copy the date and time of an ASCII entry if it has the EXIF format.
+ */
+static void readDateTime(const struct Tiff* tiff, size_t entry, char* captureTime)
+{
+    static const char pattern[] = "dddd:dd:dd dd:dd:dd";
+    uint32_t count = tiff32(tiff, entry + 4);
+    size_t offset;
+    size_t i;
+
+    if (tiff16(tiff, entry + 2) != TIFF_ASCII || count < CAPTURE_TIME_LENGTH) {
+        return;
+    }
+    // Values longer than 4 bytes are stored at an offset.
+    offset = tiff32(tiff, entry + 8);
+    if (!inTiff(tiff, offset, CAPTURE_TIME_LENGTH)) {
+        return;
+    }
+    for (i = 0; i < CAPTURE_TIME_LENGTH; ++i) {
+        char c = (char) tiff->data[offset + i];
+        if (pattern[i] == 'd' ? (c < '0' || c > '9') : c != pattern[i]) {
+            return;
+        }
+    }
+    memcpy(captureTime, tiff->data + offset, CAPTURE_TIME_LENGTH);
+    captureTime[CAPTURE_TIME_LENGTH] = '\0';
+}
+
+/**
+ * Read the entries of the IFD at offset that we are interested in.
+ * \return the offset of the EXIF IFD, 0 if there is none.
+ */
+static uint32_t readIfd(const struct Tiff* tiff, size_t offset,
+        struct ImageMetadata* metadata, char* dateTime)
+{
+    uint32_t exifIfd = 0;
+    size_t count;
+    size_t entry;
+    size_t i;
+
+    if (!inTiff(tiff, offset, 2)) {
+        return 0;
+    }
+    count = tiff16(tiff, offset);
+    for (i = 0; i < count; ++i) {
+        entry = offset + 2 + i * IFD_ENTRY_LENGTH;
+        if (!inTiff(tiff, entry, IFD_ENTRY_LENGTH)) {
+            break;
+        }
+        switch (tiff16(tiff, entry)) {
+        case TAG_ORIENTATION:
+            if (tiff16(tiff, entry + 2) == TIFF_SHORT) {
+                uint16_t orientation = tiff16(tiff, entry + 8);
+                metadata->orientation = orientation >= 1 && orientation <= 8 ? orientation : 0;
+            }
+            break;
+        case TAG_DATE_TIME:
+            readDateTime(tiff, entry, dateTime);
+            break;
+        case TAG_DATE_TIME_ORIGINAL:
+            readDateTime(tiff, entry, metadata->captureTime);
+            break;
+        case TAG_EXIF_IFD:
+            if (tiff16(tiff, entry + 2) == TIFF_LONG) {
+                exifIfd = tiff32(tiff, entry + 8);
+            }
+            break;
+        }
+    }
+    return exifIfd;
+}
+
+/**
+ * Parse the TIFF structure of an EXIF segment. Only IFD0 and the EXIF IFD
+ * it points to are read, so malformed offsets cannot cause loops.
+ */
+static void readExif(const unsigned char* data, size_t size, struct ImageMetadata* metadata)
+{
+    struct Tiff tiff;
+    char dateTime[CAPTURE_TIME_LENGTH + 1] = "";
+    uint32_t exifIfd;
+
+    if (size < 8) {
+        return;
+    }
+    if (data[0] == 'I' && data[1] == 'I') {
+        tiff.bigEndian = FALSE;
+    } else if (data[0] == 'M' && data[1] == 'M') {
+        tiff.bigEndian = TRUE;
+    } else {
+        return;
+    }
+    tiff.data = data;
+    tiff.size = size;
+    if (tiff16(&tiff, 2) != 42) {
+        return;
+    }
+    exifIfd = readIfd(&tiff, tiff32(&tiff, 4), metadata, dateTime);
+    if (exifIfd != 0) {
+        readIfd(&tiff, exifIfd, metadata, dateTime);
+    }
+    // The time the file was written is the next best thing.
+    if (metadata->captureTime[0] == '\0') {
+        memcpy(metadata->captureTime, dateTime, sizeof(dateTime));
+    }
+}
+
+/**
+ * SOF0 to SOF15, without DHT, JPG and DAC that share the range.
+ */
+static Boolean isFrameHeader(unsigned char marker)
+{
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC
+        ? TRUE : FALSE;
+}
+
+Boolean jpegScanMetadata(const unsigned char* data, size_t size, struct ImageMetadata* metadata)
+{
+    static const unsigned char exifHeader[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+    size_t pos = 2;
+    size_t length;
+    unsigned char marker;
+
+    memset(metadata, 0, sizeof(*metadata));
+    if (size < 4 || data[0] != 0xFF || data[1] != MARKER_SOI) {
+        return FALSE;
+    }
+    while (size - pos >= 4) {
+        if (data[pos] != 0xFF) {
+            return FALSE;
+        }
+        marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++; // fill byte
+            continue;
+        }
+        pos += 2;
+        if (marker == MARKER_SOI || marker == MARKER_TEM || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue; // no segment follows
+        }
+        if (marker == MARKER_EOI || marker == MARKER_SOS) {
+            return FALSE; // the headers end without a frame header
+        }
+        length = readBe16(data + pos);
+        if (length < 2 || length > size - pos) {
+            return FALSE;
+        }
+        if (isFrameHeader(marker)) {
+            // precision, height, width
+            if (length < 7) {
+                return FALSE;
+            }
+            metadata->height = readBe16(data + pos + 3);
+            metadata->width = readBe16(data + pos + 5);
+            return TRUE;
+        }
+        if (marker == MARKER_APP1 && length - 2 >= sizeof(exifHeader)
+                && memcmp(data + pos + 2, exifHeader, sizeof(exifHeader)) == 0) {
+            readExif(data + pos + 2 + sizeof(exifHeader), length - 2 - sizeof(exifHeader), metadata);
+        }
+        pos += length;
+    }
+    return FALSE;
+}
@@ -0,0 +1,55 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef JPEG_META_H_
+#define JPEG_META_H_
+
+#include "boolean_util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Length of an EXIF date and time, "YYYY:MM:DD HH:MM:SS".
+#define CAPTURE_TIME_LENGTH 19
+
+/**
+ * What a screen needs to lay out an image before it is decoded.
+ */
+struct ImageMetadata {
+    uint16_t width;       // as stored, before the orientation is applied
+    uint16_t height;
+    uint8_t orientation;  // EXIF orientation 1 to 8, 0 if unknown
+    char captureTime[CAPTURE_TIME_LENGTH + 1]; // local time of the camera, empty if unknown
+};
+
+/**
+ * Walk the markers of the JPEG in data up to its first frame header,
+ * without decoding anything or allocating memory. The size is taken from
+ * the SOFn segment, the orientation and the capture time from the EXIF
+ * data in APP1, if there is any. Every offset is checked against size,
+ * so truncated or malformed files are safe to scan.
+ *
+ * \return TRUE if data starts like a JPEG and has a frame header.
+ */
+Boolean jpegScanMetadata(const unsigned char* data, size_t size, struct ImageMetadata* metadata);
+
+#endif
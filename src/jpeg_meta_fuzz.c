@@ -0,0 +1,411 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+ * Checks the bounds handling of jpegScanMetadata(). Without arguments,
+ * the driver builds JPEG headers that hit the limits of the scanner, e.g.
+ * a truncated APP1 segment, IFD offsets past its end, an IFD that claims
+ * 0xFFFF entries and a frame header that is too short. The result of each
+ * is checked, then every prefix of it and every variant with one byte
+ * replaced is scanned as well. Files given as arguments are scanned as
+ * they are, e.g. to replay what a fuzzer has found.
+ *
+ * Every input ends right in front of an inaccessible page, so reading past
+ * its end faults even without a sanitizer. Built with -DLIBFUZZER, only
+ * LLVMFuzzerTestOneInput() is compiled and libFuzzer provides main().
+ */
+
+#include "boolean_util.h"
+#include "jpeg_meta.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef LIBFUZZER
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+/**
+ * Whatever the input, the metadata has to stay within its ranges.
+ */
+static void checkMetadata(const struct ImageMetadata* metadata)
+{
+    size_t length = strnlen(metadata->captureTime, sizeof(metadata->captureTime));
+
+    if (metadata->orientation > 8) {
+        fprintf(stderr, "Orientation %u is out of range.\n", metadata->orientation);
+        abort();
+    }
+    if (length != 0 && length != CAPTURE_TIME_LENGTH) {
+        fprintf(stderr, "The capture time has %zu characters.\n", length);
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    struct ImageMetadata metadata;
+
+    jpegScanMetadata(data, size, &metadata);
+    checkMetadata(&metadata);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+#define MAX_INPUT_SIZE 65536
+#define CASE_SIZE 256
+
+#define DATE_TIME "2026:10:16 12:00:00"
+#define DATE_TIME_ORIGINAL "2026:10:16 12:00:01"
+
+// Offsets in the TIFF structure of the generated EXIF segment.
+#define IFD0_OFFSET 8
+#define EXIF_IFD_OFFSET 50
+#define DATE_TIME_OFFSET 68
+#define DATE_TIME_ORIGINAL_OFFSET 88
+#define TIFF_SIZE 108
+#define SOF_LENGTH 17
+
+/**
+ * How a generated header deviates from a well-formed one.
+ * Fields that are 0 keep their proper value.
+ */
+struct Variant {
+    Boolean bigEndian;
+    uint32_t ifd0Offset;
+    uint16_t ifd0Count;
+    uint32_t exifIfdOffset;
+    uint32_t dateTimeOffset;
+    uint32_t dateTimeOriginalOffset;
+    uint16_t app1Length;
+    uint16_t sofLength;
+    size_t size;           // the file ends here
+};
+
+struct Expected {
+    Boolean found;
+    uint16_t width;
+    uint16_t height;
+    uint8_t orientation;
+    const char* captureTime;
+};
+
+struct Case {
+    const char* name;
+    struct Variant variant;
+    struct Expected expected;
+};
+
+static const struct Case cases[] = {
+    { "well-formed, little endian", { .bigEndian = FALSE },
+        { TRUE, 640, 480, 6, DATE_TIME_ORIGINAL } },
+    { "well-formed, big endian", { .bigEndian = TRUE },
+        { TRUE, 640, 480, 6, DATE_TIME_ORIGINAL } },
+    { "truncated APP1", { .size = 60 },
+        { FALSE, 0, 0, 0, "" } },
+    { "APP1 longer than the file", { .app1Length = 0xFFFF },
+        { FALSE, 0, 0, 0, "" } },
+    { "APP1 too short for the TIFF header", { .app1Length = 2 + 6 + 7 },
+        { FALSE, 0, 0, 0, "" } },
+    { "IFD0 offset past the end", { .ifd0Offset = 0xFFFFFFF0 },
+        { TRUE, 640, 480, 0, "" } },
+    { "IFD0 offset at the last byte", { .ifd0Offset = TIFF_SIZE - 1 },
+        { TRUE, 640, 480, 0, "" } },
+    { "EXIF IFD offset past the end", { .exifIfdOffset = 0xFFFFFFFF },
+        { TRUE, 640, 480, 6, DATE_TIME } },
+    { "date offsets past the end",
+        { .dateTimeOffset = TIFF_SIZE - CAPTURE_TIME_LENGTH + 1, .dateTimeOriginalOffset = 0x7FFFFFFF },
+        { TRUE, 640, 480, 6, "" } },
+    { "IFD0 count 0xFFFF", { .ifd0Count = 0xFFFF },
+        { TRUE, 640, 480, 6, DATE_TIME_ORIGINAL } },
+    { "IFD0 count 0xFFFF, big endian", { .bigEndian = TRUE, .ifd0Count = 0xFFFF },
+        { TRUE, 640, 480, 6, DATE_TIME_ORIGINAL } },
+    { "SOF length 6", { .sofLength = 6 },
+        { FALSE, 0, 0, 6, DATE_TIME_ORIGINAL } },
+    { "SOF length 2", { .sofLength = 2 },
+        { FALSE, 0, 0, 6, DATE_TIME_ORIGINAL } },
+    { "SOF length 1", { .sofLength = 1 },
+        { FALSE, 0, 0, 6, DATE_TIME_ORIGINAL } },
+    { "SOF longer than the file", { .sofLength = 0xFFFF },
+        { FALSE, 0, 0, 6, DATE_TIME_ORIGINAL } },
+};
+
+struct Builder {
+    unsigned char* data;
+    size_t size;
+    Boolean bigEndian;
+};
+
+static void put8(struct Builder* b, unsigned value)
+{
+    b->data[b->size++] = (unsigned char) value;
+}
+
+static void putBe16(struct Builder* b, unsigned value)
+{
+    put8(b, value >> 8);
+    put8(b, value);
+}
+
+static void putTiff16(struct Builder* b, unsigned value)
+{
+    if (b->bigEndian) {
+        putBe16(b, value);
+    } else {
+        put8(b, value);
+        put8(b, value >> 8);
+    }
+}
+
+static void putTiff32(struct Builder* b, uint32_t value)
+{
+    if (b->bigEndian) {
+        putTiff16(b, value >> 16);
+        putTiff16(b, value);
+    } else {
+        putTiff16(b, value);
+        putTiff16(b, value >> 16);
+    }
+}
+
+static void putEntry(struct Builder* b, unsigned tag, unsigned type, uint32_t count, uint32_t value)
+{
+    putTiff16(b, tag);
+    putTiff16(b, type);
+    putTiff32(b, count);
+    if (type == 3) {
+        putTiff16(b, value); // a SHORT is stored in the first half
+        putTiff16(b, 0);
+    } else {
+        putTiff32(b, value);
+    }
+}
+
+static uint32_t orDefault(uint32_t value, uint32_t proper)
+{
+    return value != 0 ? value : proper;
+}
+
+/**
+ * Write the header of a 640x480 JPEG with an EXIF segment into data,
+ * which has to provide CASE_SIZE bytes, and apply variant.
+ *
+ * \return the size of the file
+ */
+static size_t buildJpeg(const struct Variant* variant, unsigned char* data)
+{
+    struct Builder b = { data, 0, variant->bigEndian };
+    size_t tiffStart;
+    size_t i;
+
+    putBe16(&b, 0xFFD8);
+    putBe16(&b, 0xFFE1);
+    putBe16(&b, orDefault(variant->app1Length, 2 + 6 + TIFF_SIZE));
+    memcpy(b.data + b.size, "Exif\0\0", 6);
+    b.size += 6;
+    tiffStart = b.size;
+    put8(&b, variant->bigEndian ? 'M' : 'I');
+    put8(&b, variant->bigEndian ? 'M' : 'I');
+    putTiff16(&b, 42);
+    putTiff32(&b, orDefault(variant->ifd0Offset, IFD0_OFFSET));
+    putTiff16(&b, orDefault(variant->ifd0Count, 3));
+    putEntry(&b, 0x0112, 3, 1, 6);
+    putEntry(&b, 0x0132, 2, CAPTURE_TIME_LENGTH + 1,
+        orDefault(variant->dateTimeOffset, DATE_TIME_OFFSET));
+    putEntry(&b, 0x8769, 4, 1, orDefault(variant->exifIfdOffset, EXIF_IFD_OFFSET));
+    putTiff32(&b, 0);
+    putTiff16(&b, 1);
+    putEntry(&b, 0x9003, 2, CAPTURE_TIME_LENGTH + 1,
+        orDefault(variant->dateTimeOriginalOffset, DATE_TIME_ORIGINAL_OFFSET));
+    putTiff32(&b, 0);
+    memcpy(b.data + b.size, DATE_TIME, CAPTURE_TIME_LENGTH + 1);
+    b.size += CAPTURE_TIME_LENGTH + 1;
+    memcpy(b.data + b.size, DATE_TIME_ORIGINAL, CAPTURE_TIME_LENGTH + 1);
+    b.size += CAPTURE_TIME_LENGTH + 1;
+    if (b.size - tiffStart != TIFF_SIZE) {
+        fprintf(stderr, "The TIFF structure has %zu bytes.\n", b.size - tiffStart);
+        abort();
+    }
+    // Baseline frame header: precision, height, width and three components.
+    putBe16(&b, 0xFFC0);
+    putBe16(&b, orDefault(variant->sofLength, SOF_LENGTH));
+    put8(&b, 8);
+    putBe16(&b, 480);
+    putBe16(&b, 640);
+    put8(&b, 3);
+    for (i = 0; i < 3; ++i) {
+        put8(&b, i + 1);
+        put8(&b, 0x11);
+        put8(&b, 0);
+    }
+    putBe16(&b, 0xFFDA);
+    return variant->size != 0 && variant->size < b.size ? variant->size : b.size;
+}
+
+/**
+ * Memory whose end is followed by a page that cannot be read.
+ */
+static unsigned char* guardedEnd;
+
+static void allocateGuarded()
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t length = (MAX_INPUT_SIZE + pageSize - 1) / pageSize * pageSize;
+    unsigned char* region = mmap(NULL, length + pageSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    if (mprotect(region + length, pageSize, PROT_NONE) == -1) {
+        perror("mprotect");
+        exit(EXIT_FAILURE);
+    }
+    guardedEnd = region + length;
+}
+
+/**
+ * Scan a copy of size bytes that ends at the guard page.
+ */
+static Boolean scanGuarded(const unsigned char* data, size_t size, struct ImageMetadata* metadata)
+{
+    unsigned char* copy = guardedEnd - size;
+    Boolean found;
+
+    memcpy(copy, data, size);
+    found = jpegScanMetadata(copy, size, metadata);
+    checkMetadata(metadata);
+    return found;
+}
+
+static Boolean matches(const struct ImageMetadata* metadata, Boolean found, const struct Expected* expected)
+{
+    return found == expected->found
+        && metadata->width == expected->width
+        && metadata->height == expected->height
+        && metadata->orientation == expected->orientation
+        && strcmp(metadata->captureTime, expected->captureTime) == 0 ? TRUE : FALSE;
+}
+
+/**
+ * Check the result of a case, then scan all its prefixes and variants
+ * with a single byte replaced.
+ *
+ * \return the number of inputs scanned, 0 if the result is wrong
+ */
+static unsigned long runCase(const struct Case* c)
+{
+    static const unsigned char replacements[] = { 0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF };
+    unsigned char data[CASE_SIZE];
+    unsigned char mutated[CASE_SIZE];
+    struct ImageMetadata metadata;
+    unsigned long scanned = 1;
+    size_t size = buildJpeg(&c->variant, data);
+    size_t i;
+    size_t r;
+    Boolean found;
+
+    printf("%s: ", c->name);
+    found = scanGuarded(data, size, &metadata);
+    if (!matches(&metadata, found, &c->expected)) {
+        printf("FAIL, found %d, %ux%u, orientation %u, capture time \"%s\"\n", found,
+            metadata.width, metadata.height, metadata.orientation, metadata.captureTime);
+        return 0;
+    }
+    for (i = 0; i < size; ++i, ++scanned) {
+        scanGuarded(data, i, &metadata);
+    }
+    for (i = 0; i < size; ++i) {
+        memcpy(mutated, data, size);
+        for (r = 0; r < sizeof(replacements); ++r, ++scanned) {
+            mutated[i] = replacements[r];
+            scanGuarded(mutated, size, &metadata);
+        }
+    }
+    printf("ok\n");
+    return scanned;
+}
+
+/**
+ * Scan the file at path as it is.
+ */
+static Boolean runFile(const char* path)
+{
+    static unsigned char data[MAX_INPUT_SIZE];
+    struct ImageMetadata metadata;
+    FILE* file = fopen(path, "rb");
+    size_t size;
+
+    if (file == NULL) {
+        perror(path);
+        return FALSE;
+    }
+    size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    printf("%s: ", path);
+    fflush(stdout);
+    if (scanGuarded(data, size, &metadata)) {
+        printf("%ux%u, orientation %u, capture time \"%s\"\n",
+            metadata.width, metadata.height, metadata.orientation, metadata.captureTime);
+    } else {
+        printf("no frame header\n");
+    }
+    return TRUE;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned long total = 0;
+    unsigned long scanned;
+    Boolean ok = TRUE;
+    size_t i;
+    int a;
+
+    // Show the case that was running if the scanner faults.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    allocateGuarded();
+    if (argc > 1) {
+        for (a = 1; a < argc; ++a) {
+            ok = runFile(argv[a]) && ok;
+        }
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        scanned = runCase(&cases[i]);
+        if (scanned == 0) {
+            ok = FALSE;
+        }
+        total += scanned;
+    }
+    printf("%lu inputs scanned.\n", total);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
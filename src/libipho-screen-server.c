@@ -19,20 +19,41 @@ You should have received a copy of the GNU General Public License
 along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include "boolean_util.h"
+#include "command_queue.h"
+#include "connection.h"
+#include "dir_watch.h"
 #include "err_util.h"
+#include "event_util.h"
 #include "file_util.h"
+#include "image.h"
+#include "image_loader.h"
 #include "log_util.h"
 #include "net_util.h"
+#include "preparer.h"
+#include "preview.h"
+#include "producer.h"
+#include "protocol.h"
+#include "replay_ring.h"
+#include "stats.h"
+#include "stats_client.h"
+#include "tail_watch.h"
 #include "time_util.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
 
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,351 +62,1162 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 #define DATA_PORT_NUM "1338"
 #define HEARTBEAT_PORT_NUM "1339"
 
-#define BACKLOG 0
-#define MAX_FN_LENGHT 255;
+#define DEFAULT_BACKLOG 16
+
+#define DEFAULT_QUEUE_DEPTH 32
+#define HEARTBEAT_INTERVAL_MS 500
+// A client whose probes stay unsent or unacknowledged this long is dead.
+#define HEARTBEAT_TIMEOUT_MS 2000
+#define MAX_EVENTS 64
+#define DEFAULT_REPLAY_CAPACITY 4
+#define DEFAULT_REPLAY_MEGABYTES 64
+#define DEFAULT_REPLAY_COUNT 1
+#define MAX_REPLAY_IMAGES 64
+#define DEFAULT_EXTENSIONS "jpg,jpeg"
+#define DEFAULT_STATS_INTERVAL_S 60
+
+// Commands read from the FIFO are handed from the reading thread
+// to the event loop through this queue.
+static struct CommandQueue commandQueue;
+
+// The event loop runs in the main thread. It owns the listening sockets,
+// the client connections and the consumer side of the command queue.
+static int epollFd;
+static struct EventSource dataListener;
+static struct EventSource heartbeatListener;
+static struct EventSource commandSource;
+static struct Connection* connections = NULL;
+static struct TimerWheel timers;
+static int backlog = DEFAULT_BACKLOG;
+
+// The most recent images, replayed to screens when they connect.
+static struct ReplayRing replayRing;
+static size_t replayCount = DEFAULT_REPLAY_COUNT;
+
+// In latest-wins mode, an image that has not been sent yet is superseded
+// by a newer one, so that a slow screen does not fall further behind.
+static Boolean latestWins = FALSE;
+// Commands taken from the queue in one go by forwardImages().
+static struct Command* commandBatch;
+
+// Files announced with TAIL_PREFIX are sent while they are being written.
+#define TAIL_PREFIX '>'
+#define TAIL_CHECK_INTERVAL_MS 1000
+static struct TailWatch tailWatch;
+static struct Timer tailTimer; // pending while a file is being written
+
+// Capture directories that are watched in addition to the FIFO.
+static struct DirWatch dirWatch;
+static const char* watchedDirs[MAX_WATCHED_DIRS];
+static size_t numWatchedDirs = 0;
+static const char* extensions = DEFAULT_EXTENSIONS;
+static struct Command dirBatch[DIR_WATCH_BATCH];
+
+// Local socket through which producers send batches of commands.
+static const char* commandSocketPath = NULL;
+static struct EventSource commandListener;
+static struct Producer* producers = NULL;
+static struct Command producerBatch[MAX_DATAGRAM_COMMANDS];
+
+// With io_uring, files are read without blocking the event loop.
+static Boolean asyncLoading = FALSE;
+static struct ImageLoader imageLoader;
+
+// Local socket that serves the counters, and how often they are logged.
+static const char* statsSocketPath = NULL;
+static struct EventSource statsListener;
+static struct StatsClient* statsClients = NULL;
+static long statsIntervalS = DEFAULT_STATS_INTERVAL_S;
+static struct Timer statsTimer;
+
+// Threads that prepare images and render previews for clients with small
+// screens, by default one per CPU.
+static long numWorkers = -1;
+static struct WorkerPool workerPool;
+static Boolean preparing = FALSE;
+static struct Preparer preparer;
+static Boolean previews = FALSE;
+
+// signature is enforced by the pthread_create function
+void* readCommandsFromFifo(void* fifo_filename_void) {
+    const char* fifo_filename = (const char*) fifo_filename_void;
+    struct LineReader reader;
+    const char* line;
+    int fifoFd = -1;
+    ssize_t res;
+
+    for (;;) {
+        if (fifoFd < 0) {
+            LOG_INFO("Waiting for a command on the FIFO %s\n", fifo_filename);
+            fifoFd = openFifo(fifo_filename);
+            lineReaderInit(&reader, fifoFd, MAX_COMMAND_LENGTH - 1);
+        }
+
+        res = lineReaderNext(&reader, &line);
+        if (res == -1) {
+            LOG_WARN("FIFO was closed.\n");
+            close(fifoFd);
+            fifoFd = -1;
+            continue;
+        }
+        if (res == -2) {
+            LOG_WARN("Error while reading from FIFO. Trying again...\n");
+            continue;
+        }
+        if (res == 0) {
+            // Ignore empty lines.
+            continue;
+        }
 
-#define COMMAND_IMAGE_TAKEN 1
-#define COMMAND_IMAGE_DATA  2
-#define COMMAND_HEARBEAT_PROBE 3;
+        // We read a line from the fifo. Let's forward it to the consuming thread.
+        // Lines that arrived in one read() wait for the ones before them.
+        if (!commandQueuePush(&commandQueue, line)) {
+            LOG_WARN("Command queue is full, dropped command %s\n", line);
+        }
+        statsAdd(&stats.fifoCommands, 1);
+        histogramRecordSince(&stats.fifoReceive, &reader.lastRead);
+    }
+    return NULL;
+}
 
-typedef enum { DEAD, ALIVE } ClientStatus;
-// clientStatus indicates wheter the Android app is connected or not.
-// Access to the clientStatus is secured via the mutex ClientStatusMtx.
-// A thread can be waiting for the clientStatus to become ALIVE.
-// To this end, we set up the clientAliveCond conditional variable
-// that is notified once the client has connected.
-static ClientStatus clientStatus = DEAD;
-static pthread_mutex_t clientStatusMtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t clientAliveCond = PTHREAD_COND_INITIALIZER;
+/**
+ * Log the counters of the command queue.
+ */
+void logCommandQueueStats()
+{
+    struct CommandQueueStats stats;
+    commandQueueGetStats(&commandQueue, &stats);
+    LOG_INFO("Command queue: %llu enqueued, %llu dequeued, %llu dropped.\n",
+            (unsigned long long) stats.enqueued,
+            (unsigned long long) stats.dequeued,
+            (unsigned long long) stats.dropped);
+}
 
 /**
- * Wake up threads that wait for the client app to become available.
+ * Return TRUE if the host has an open heartbeat connection.
  */
-void wakeClientAliveWaiter()
+static Boolean hasHeartbeat(const char* peerHost)
 {
-    int perr = pthread_cond_signal(&clientAliveCond); // Wake waiting thread
-    if (perr != 0) {
-        errExitEN(perr, "pthread_cond_signal");
+    struct Connection* conn;
+    for (conn = connections; conn != NULL; conn = conn->next) {
+        if (connectionAlive(conn) && conn->type == CONNECTION_HEARTBEAT
+                && strcmp(conn->peerHost, peerHost) == 0) {
+            return TRUE;
+        }
     }
+    return FALSE;
 }
 
 /**
- * Suspend the current thread until a client app has become available.
- * Returns immediately if the client is already available.
+ * A screen opens a heartbeat and an image connection. Pair the new
+ * connection with the newest open connection of the other type from
+ * the same host that has no partner yet, so that several screens
+ * behind one address are told apart. The newest, because an older one
+ * may belong to an earlier attempt that has not been noticed dead yet.
  */
-void waitForClientAlive()
+static void pairConnection(struct Connection* conn)
 {
-    int perr = pthread_mutex_lock(&clientStatusMtx);
-    if (perr != 0) {
-        errExitEN(perr, "pthread_mutex_lock");
+    struct Connection* other;
+
+    // New connections are at the front of the list.
+    for (other = connections; other != NULL; other = other->next) {
+        if (other != conn && other->type != conn->type && other->peer == NULL
+                && connectionAlive(other) && strcmp(other->peerHost, conn->peerHost) == 0) {
+            conn->peer = other;
+            other->peer = conn;
+            return;
+        }
     }
-    while (clientStatus == DEAD) {
-        perr = pthread_cond_wait(&clientAliveCond, &clientStatusMtx);
-        if (perr != 0) {
-            errExitEN(perr, "pthread_cond_wait");
+}
+
+/**
+ * Mark the connection as closed. If it was the heartbeat connection of
+ * a client, the client is considered dead and its image connection is
+ * closed as well.
+ */
+static void closeConnection(struct Connection* conn)
+{
+    struct Connection* peer = conn->peer;
+    struct Connection* other;
+
+    if (!connectionAlive(conn)) {
+        return;
+    }
+    atomic_store_explicit(&conn->state, CLIENT_DEAD, memory_order_release);
+    timerStop(&timers, &conn->timer);
+    timerStop(&timers, &conn->ackTimer);
+    if (peer != NULL) {
+        peer->peer = NULL;
+        conn->peer = NULL;
+    }
+    if (conn->type == CONNECTION_DATA) {
+        statsAdd(&stats.dataDisconnects, 1);
+        LOG_INFO("Closing image connection of %s.\n", conn->peerHost);
+        logCommandQueueStats();
+        logStats();
+        return;
+    }
+    statsAdd(&stats.heartbeatDisconnects, 1);
+    LOG_INFO("Heartbeat of %s stopped.\n", conn->peerHost);
+    if (peer != NULL) {
+        LOG_INFO("The heartbeat signaled that the client is dead.\n");
+        closeConnection(peer);
+    }
+    if (hasHeartbeat(conn->peerHost)) {
+        return;
+    }
+    // Image connections that were never paired belong to no other heartbeat.
+    for (other = connections; other != NULL; other = other->next) {
+        if (other->type == CONNECTION_DATA && other->peer == NULL
+                && strcmp(other->peerHost, conn->peerHost) == 0) {
+            LOG_INFO("The heartbeat signaled that the client is dead.\n");
+            closeConnection(other);
         }
     }
-    perr = pthread_mutex_unlock(&clientStatusMtx);
-    if (perr != 0) {
-        errExitEN(perr, "pthread_mutex_unlock");
+}
+
+/**
+ * Destroy all connections, producers and stats clients that have been
+ * closed while handling events.
+ */
+static void destroyClosedConnections()
+{
+    struct StatsClient** statsLink = &statsClients;
+    while (*statsLink != NULL) {
+        struct StatsClient* client = *statsLink;
+        if (client->closed) {
+            *statsLink = client->next;
+            statsClientDestroy(client);
+        } else {
+            statsLink = &client->next;
+        }
+    }
+
+    struct Producer** producerLink = &producers;
+    while (*producerLink != NULL) {
+        struct Producer* producer = *producerLink;
+        if (producer->closed) {
+            *producerLink = producer->next;
+            producerDestroy(producer);
+        } else {
+            producerLink = &producer->next;
+        }
+    }
+
+    struct Connection** link = &connections;
+    while (*link != NULL) {
+        struct Connection* conn = *link;
+        if (!connectionAlive(conn)) {
+            *link = conn->next;
+            connectionDestroy(conn);
+        } else {
+            link = &conn->next;
+        }
     }
 }
 
 /**
- * Safely set the client status secured by the corresponding mutex.
+ * A client that owes an answer for ACK_TIMEOUT_MS holds the window
+ * closed, or the image it was offered, and is dropped.
  */
-void setClientStatus(ClientStatus status)
+static void ackDue(struct Timer* timer)
 {
-    int perr;
-    perr = pthread_mutex_lock(&clientStatusMtx);
-    if (perr != 0) {
-        errExitEN(perr, "pthread_mutex_unlock");
+    struct Connection* conn = timer->arg;
+
+    LOG_INFO("Client %s did not answer for %d ms.\n", conn->peerHost, ACK_TIMEOUT_MS);
+    closeConnection(conn);
+}
+
+static void flushConnection(struct Connection* conn)
+{
+    if (connectionAlive(conn) && connectionFlush(conn) == FLUSH_ERROR) {
+        closeConnection(conn);
     }
-    clientStatus = status;
-    perr = pthread_mutex_unlock(&clientStatusMtx);
-    if (perr != 0) {
-        errExitEN(perr, "pthread_mutex_unlock");
+    if (!connectionAlive(conn) || conn->type != CONNECTION_DATA) {
+        return;
+    }
+    if (!connectionWaitsForClient(conn)) {
+        timerStop(&timers, &conn->ackTimer);
+    } else if (!timerPending(&conn->ackTimer)) {
+        timerStart(&timers, &conn->ackTimer, ACK_TIMEOUT_MS);
     }
 }
 
 /**
- * Safely get the client status secured by the corresponding mutex.
+ * Let a newly connected screen catch up with the most recent images.
  */
-ClientStatus getClientStatus()
+static void replayLatestImages(struct Connection* conn)
 {
-    int status;
-    int perr;
-    perr = pthread_mutex_lock(&clientStatusMtx);
-    if (perr != 0) {
-        errExitEN(perr, "pthread_mutex_unlock");
+    struct Image* images[MAX_REPLAY_IMAGES];
+    size_t count = replayRingLatest(&replayRing, images, replayCount);
+    size_t i;
+
+    if (count > 0) {
+        LOG_INFO("Replaying %zu images to %s.\n", count, conn->peerHost);
     }
-    status = clientStatus;
-    perr = pthread_mutex_unlock(&clientStatusMtx);
-    if (perr != 0) {
-        errExitEN(perr, "pthread_mutex_unlock");
+    for (i = 0; i < count; ++i) {
+        connectionQueueImage(conn, images[i], NULL);
     }
-    return status;
 }
 
 /**
- * Writes a heartbeat probe to the provided file descriptor.
- * If an error occurrs while writing, assume that the client is not alive.
- *
- * \param cfd
- * File descriptor that we send a heartbeat probe to.
- * \return
- * TRUE if the client is alive, FALSE otherwise.
- *
+ * A random value for the first image id. Falls back to the clock
+ * if the kernel cannot provide one.
  */
-Boolean isClientHearbeatAlive(int cfd) {
-    char cmd[1];
-    cmd[0] = COMMAND_HEARBEAT_PROBE;
+static uint32_t randomSeed(void)
+{
+    uint32_t seed;
+    struct timespec now;
 
-    if (!writeFully(cfd, cmd, sizeof(cmd))) {
-        errMsg("Error on write of keepalive probe");
-        return FALSE;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed)) {
+        return seed;
     }
-    return TRUE;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint32_t) (now.tv_sec ^ now.tv_nsec);
 }
 
+/**
+ * Transfers can be resumed as long as the image is held by the replay ring,
+ * and, unless it is held in memory, its file is unchanged.
+ */
+static struct Image* findResumableImage(uint32_t id)
+{
+    struct Image* image = replayRingFindId(&replayRing, id);
+
+    if (image != NULL && image->data == NULL && !imageFileUnchanged(image)) {
+        return NULL;
+    }
+    return image;
+}
 
 /**
- * Continuously sends a hearbeat probe to the client.
- * The function returns as soon the heartbeat channel
- * cannot be written to anymore.
- *
- * \param cfd
- * File descriptor to send the probe to.
+ * Images are hashed on the workers before they are offered to clients
+ * that deduplicate them, so the event loop never reads a whole file.
+ */
+static void hashImage(struct Image* image)
+{
+    preparerHash(&preparer, image);
+}
+
+/**
+ * Switch a client that did not send a hello in time to protocol version 1
+ * and send what has been queued for it meanwhile.
+ */
+static void negotiationDue(struct Timer* timer)
+{
+    struct Connection* conn = timer->arg;
+
+    connectionCheckNegotiation(conn, monotonicNow());
+    flushConnection(conn);
+}
+
+/**
+ * Send the next heartbeat probe. A client that still has not received the
+ * previous probe does not get another one, and is dead once it missed
+ * probes for HEARTBEAT_TIMEOUT_MS. If the probe cannot be written or the
+ * kernel gives up on it, the client is dead as well.
+ */
+static void heartbeatDue(struct Timer* timer)
+{
+    struct Connection* conn = timer->arg;
+    unsigned int rtt;
+
+    if (conn->queueHead != NULL) {
+        conn->missedHeartbeats++;
+        if (conn->missedHeartbeats * HEARTBEAT_INTERVAL_MS >= HEARTBEAT_TIMEOUT_MS) {
+            LOG_INFO("%s did not take a heartbeat for %d ms.\n", conn->peerHost, HEARTBEAT_TIMEOUT_MS);
+            closeConnection(conn);
+            return;
+        }
+    } else {
+        conn->missedHeartbeats = 0;
+        connectionQueueCommand(conn, MESSAGE_HEARTBEAT);
+        flushConnection(conn);
+        if (!connectionAlive(conn)) {
+            return;
+        }
+        statsAdd(&stats.heartbeatsSent, 1);
+        if (getRoundTripTime(conn->source.fd, &rtt) == 0) {
+            histogramRecord(&stats.heartbeatRtt, rtt);
+        }
+    }
+    timerStart(&timers, timer, HEARTBEAT_INTERVAL_MS);
+}
+
+/**
+ * Process what the client has sent. Acknowledgements may open the window,
+ * so try to send more afterwards.
  */
-void hearbeat(int cfd)
+static void readFromConnection(struct Connection* conn)
 {
+    unsigned long acked = conn->imagesAcked;
+
+    if (!connectionReceive(conn)) {
+        closeConnection(conn);
+        return;
+    }
+    if (conn->imagesAcked != acked) {
+        timerStop(&timers, &conn->ackTimer); // the client makes progress, start over
+    }
+    flushConnection(conn);
+}
+
+/**
+ * Accept all pending connections on the listening socket.
+ */
+static void acceptConnections(struct EventSource* listener, ConnectionType type)
+{
+    struct sockaddr_storage claddr;
+    socklen_t addrlen;
+    int cfd;
+
     for (;;) {
-        if (!isClientHearbeatAlive(cfd)) {
-            setClientStatus(DEAD);
-            break;
+        addrlen = sizeof(struct sockaddr_storage);
+        cfd = accept4(listener->fd, (struct sockaddr*) &claddr, &addrlen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                errMsg("accept");
+            }
+            return;
         }
-        usleep(5e5);
+        struct Connection* conn = connectionCreate(epollFd, cfd, type,
+                (struct sockaddr*) &claddr, addrlen);
+        if (conn == NULL) {
+            close(cfd);
+            continue;
+        }
+        conn->next = connections;
+        connections = conn;
+        pairConnection(conn);
+
+        if (type == CONNECTION_HEARTBEAT) {
+            statsAdd(&stats.heartbeatConnects, 1);
+            LOG_INFO("Hearbeat connection of %s accepted.\n", conn->peerHost);
+            if (setUserTimeout(cfd, HEARTBEAT_TIMEOUT_MS) == -1) {
+                errMsg("setsockopt TCP_USER_TIMEOUT");
+            }
+            // Probe right away so that the client sees us alive without waiting for the next tick.
+            connectionQueueCommand(conn, MESSAGE_HEARTBEAT);
+            flushConnection(conn);
+            timerInit(&conn->timer, heartbeatDue, conn);
+            timerStart(&timers, &conn->timer, HEARTBEAT_INTERVAL_MS);
+        } else {
+            statsAdd(&stats.dataConnects, 1);
+            LOG_INFO("Image connection of %s accepted.\n", conn->peerHost);
+            timerInit(&conn->ackTimer, ackDue, conn);
+            if (conn->protocol == PROTOCOL_NEGOTIATING) {
+                // The client sent a hello before, wait for it.
+                timerInit(&conn->timer, negotiationDue, conn);
+                timerStart(&timers, &conn->timer, NEGOTIATION_TIMEOUT_MS);
+            }
+            replayLatestImages(conn);
+            // A hello that arrived with the connection upgrades it before anything is sent.
+            readFromConnection(conn);
+        }
+    }
+}
+
+/**
+ * Write the stats to the log every statsIntervalS seconds.
+ */
+static void statsDue(struct Timer* timer)
+{
+    logStats();
+    timerStart(&timers, timer, statsIntervalS * 1000);
+}
+
+/**
+ * Return the image named by path, preferably from the replay ring
+ * so that it is not read from disk again.
+ * The caller owns a reference to the returned image.
+ * If the file is read asynchronously, NULL is returned and the image
+ * is forwarded by forwardLoadedImages() once it has been read.
+ */
+static struct Image* acquireImage(const struct Command* cmd)
+{
+    const char* path = cmd->line;
+    struct Image* image = replayRingFind(&replayRing, path);
+    if (image != NULL) {
+        LOG_INFO("Using file %s from the replay ring.\n", path);
+        return imageRef(image);
+    }
+    if (asyncLoading) {
+        LOG_INFO("Reading file %s.\n", path);
+        imageLoaderSubmit(&imageLoader, cmd, NULL);
+        return NULL;
+    }
+    if (preparing) {
+        LOG_INFO("Preparing file %s.\n", path);
+        preparerSubmit(&preparer, cmd, NULL);
+        return NULL;
     }
-    if (close(cfd) == -1) {
-        errMsg("close");
+    LOG_INFO("Trying to open file %s.\n", path);
+    struct timespec start = monotonicNow();
+    image = imageOpen(path);
+    if (image == NULL) {
+        LOG_INFO("Could not open file %s.\n", path);
+        return NULL;
     }
+    replayRingAdd(&replayRing, image);
+    histogramRecordSince(&stats.fileRead, &start);
+    return image;
 }
 
+/**
+ * Send what has become available to all image connections.
+ */
+static void flushDataConnections()
+{
+    struct Connection* conn;
+    for (conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->type == CONNECTION_DATA) {
+            flushConnection(conn);
+        }
+    }
+}
 
-static pthread_mutex_t commandMtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t commandCond = PTHREAD_COND_INITIALIZER;
-static int commandAvailable = 0;
-#define MAX_COMMAND_LENGTH 255
-char command[MAX_COMMAND_LENGTH];
+/**
+ * A growing image is complete, keep it for screens that connect later.
+ */
+static void completeTailedImage(struct Image* image)
+{
+    LOG_INFO("File %s is complete (%lld bytes).\n", image->path, (long long) image->file.size);
+    replayRingAdd(&replayRing, image);
+}
 
-// signature is enforced by the pthread_create function
-void* readCommandsFromFifo(void* fifo_filename_void) {
-    const char* fifo_filename = (const char*) fifo_filename_void;
-    char line[MAX_COMMAND_LENGTH];
-    int perr;
-    int fifoFd = -1;
-    int res;
+static void completeTailedImages(struct Image** finished, size_t count)
+{
+    size_t i;
 
-    for (;;) {
-        LOG_INFO("Waiting for a command on the FIFO %s\n", fifo_filename);
-        if (fifoFd < 0) {
-            fifoFd = openFifo(fifo_filename);
+    for (i = 0; i < count; ++i) {
+        completeTailedImage(finished[i]);
+        imageUnref(finished[i]);
+    }
+    flushDataConnections();
+}
+
+/**
+ * Handle the modifications of the files that are being written.
+ */
+static void handleTailEvents()
+{
+    struct Image* finished[MAX_TAILS];
+    completeTailedImages(finished, tailWatchProcess(&tailWatch, finished));
+}
+
+/**
+ * Finish the files whose writer has gone quiet without closing them.
+ */
+static void tailDue(struct Timer* timer)
+{
+    struct Image* finished[MAX_TAILS];
+
+    completeTailedImages(finished, tailWatchExpire(&tailWatch, finished));
+    if (tailWatchGrowing(&tailWatch)) {
+        timerStart(&timers, timer, TAIL_CHECK_INTERVAL_MS);
+    }
+}
+
+/**
+ * The completion of a file that has been announced for tail mode
+ * before is announced. It has been forwarded already.
+ *
+ * \return FALSE if the file was not announced for tail mode.
+ */
+static Boolean takeTailedImage(const char* path)
+{
+    Boolean wasGrowing = FALSE;
+    struct Image* image = tailWatchTake(&tailWatch, path, &wasGrowing);
+
+    if (image == NULL) {
+        return FALSE;
+    }
+    if (wasGrowing) {
+        completeTailedImage(image);
+        flushDataConnections();
+    }
+    imageUnref(image);
+    return TRUE;
+}
+
+/**
+ * Release what a command that is not forwarded holds.
+ */
+static void discardCommand(const struct Command* cmd)
+{
+    if (cmd->fd != -1) {
+        close(cmd->fd);
+    }
+}
+
+/**
+ * Create the image of a command whose file has been passed by the producer.
+ * The file is not looked up by its name.
+ * If images are prepared on the workers, NULL is returned and the image
+ * is forwarded by forwardPreparedImages() once it is ready.
+ */
+static struct Image* adoptImage(const struct Command* cmd)
+{
+    const char* name = cmd->line + 1;
+    struct Image* image;
+
+    if (preparing) {
+        LOG_INFO("Preparing passed file %s.\n", name);
+        preparerSubmit(&preparer, cmd, NULL);
+        return NULL;
+    }
+    image = imageFromFd(cmd->fd, name);
+    if (image == NULL) {
+        LOG_INFO("Passed file %s cannot be sent.\n", name);
+        return NULL;
+    }
+    replayRingAdd(&replayRing, image);
+    return image;
+}
+
+/**
+ * Queue the image for a client. If it wants previews, they are rendered
+ * on the pool and sent first, so the screen shows something early.
+ * Growing images are never previewed.
+ */
+static void queueImage(struct Connection* conn, struct Image* image,
+        const struct timespec* received)
+{
+    struct Rendition* rendition = NULL;
+
+    if (previews && connectionWantsPreview(conn) && !image->growing) {
+        rendition = previewRequest(&workerPool, image, conn->previewWidth, conn->previewHeight);
+    }
+    if (rendition != NULL) {
+        connectionQueuePreview(conn, image, rendition, received);
+        if (conn->previewOnly) {
+            return;
         }
+    }
+    connectionQueueImage(conn, image, received);
+}
 
-        res = readLine(fifoFd, line, sizeof(line));
-        if (res == -1) {
-            fprintf(stderr, "FIFO was closed.\n");
-            fifoFd = -1;
+/**
+ * Queue the image for all image connections, or the image taken
+ * message if image is NULL. The reference to the image is consumed.
+ */
+static void queueForClients(const struct Command* cmd, struct Image* image)
+{
+    struct Connection* conn;
+    size_t dropped;
+
+    for (conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->type != CONNECTION_DATA || !connectionAlive(conn)) {
             continue;
         }
-        if (res == -2) {
-            fprintf(stderr, "Error while reading from FIFO. Trying again...\n");
-            continue;
+        if (image == NULL) {
+            connectionQueueCommand(conn, MESSAGE_IMAGE_TAKEN);
+        } else {
+            if (latestWins) {
+                // Images still waiting in the queue mean the client is behind.
+                dropped = connectionDropStaleImages(conn);
+                if (dropped > 0) {
+                    LOG_INFO("Client %s is behind, skipping %zu older images.\n",
+                            conn->peerHost, dropped);
+                    statsAdd(&stats.imagesCoalesced, dropped);
+                }
+            }
+            queueImage(conn, image, &cmd->received);
         }
-        if (res == 0) {
-            fprintf(stderr, "Received EOF on the FIFO. Trying again...\n");
-            fifoFd = -1;
-            continue;
+        flushConnection(conn);
+        if (connectionAlive(conn) && connectionOverloaded(conn)) {
+            LOG_WARN("Client %s is too far behind, closing its image connection.\n", conn->peerHost);
+            closeConnection(conn);
         }
+    }
+    if (image != NULL) {
+        imageUnref(image);
+    }
+}
 
-        // We read a line from the fifo. Let's forward it to the consuming thread.
-        perr = pthread_mutex_lock(&commandMtx);
-        if (perr != 0) {
-            errExitEN(perr, "pthread_mutex_lock");
+/**
+ * Forward a single command from the FIFO to all image connections.
+ * Images are also kept in the replay ring for screens that connect later.
+ * A file announced with TAIL_PREFIX is forwarded while it is being
+ * written and enters the replay ring once it is complete.
+ * The command is consumed, including a passed file.
+ */
+static void forwardCommand(const struct Command* cmd)
+{
+    const char* command = cmd->line;
+    struct Connection* conn;
+    struct Image* image = NULL;
+    Boolean haveClient = FALSE;
+
+    if (cmd->fd == -1 && command[0] != '+' && command[0] != TAIL_PREFIX
+            && takeTailedImage(command)) {
+        return;
+    }
+
+    for (conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->type == CONNECTION_DATA && connectionAlive(conn)) {
+            haveClient = TRUE;
         }
+    }
+    if (!haveClient && (command[0] == '+' || replayRing.capacity == 0)) {
+        LOG_INFO("No image receiver is connected, dropping command %s.\n", command);
+        discardCommand(cmd);
+        return;
+    }
 
-        memcpy(command, line, MAX_COMMAND_LENGTH);
-        commandAvailable = 1;
+    if (command[0] == '+') {
+        // We received a special command that indicates
+        // the "Image has just been taken" command.
+        LOG_INFO("Sending 'Image taken' command.\n");
+    } else if (cmd->fd != -1) {
+        image = adoptImage(cmd);
+        if (image == NULL) {
+            return;
+        }
+        if (haveClient) {
+            LOG_INFO("Transmitting passed file %s.\n", command + 1);
+        }
+    } else if (command[0] == TAIL_PREFIX) {
+        LOG_INFO("Following file %s while it is written.\n", command + 1);
+        image = tailWatchStart(&tailWatch, command + 1);
+        if (image == NULL) {
+            LOG_INFO("Could not follow file %s.\n", command + 1);
+            return;
+        }
+        if (!timerPending(&tailTimer)) {
+            timerStart(&timers, &tailTimer, TAIL_CHECK_INTERVAL_MS);
+        }
+    } else {
+        image = acquireImage(cmd);
+        if (image == NULL) {
+            return;
+        }
+        if (haveClient) {
+            LOG_INFO("Transmitting file %s.\n", command);
+        }
+    }
 
-        perr = pthread_mutex_unlock(&commandMtx);
-        if (perr != 0) {
-            errExitEN(perr, "pthread_mutex_unlock");
+    // Files that are still being read or prepared came first,
+    // image taken may not overtake them either.
+    if (asyncLoading && imageLoaderHasPending(&imageLoader)) {
+        if (image != NULL) {
+            imageLoaderSubmit(&imageLoader, cmd, image);
+        } else {
+            imageLoaderSubmitCommand(&imageLoader, cmd);
+        }
+        return;
+    }
+    if (preparing && preparerHasPending(&preparer)) {
+        if (image != NULL) {
+            preparerSubmit(&preparer, cmd, image);
+        } else {
+            preparerSubmitCommand(&preparer, cmd);
         }
+        return;
+    }
+    queueForClients(cmd, image);
+}
+
+/**
+ * Forward the images whose files have been read, in the order of their commands.
+ */
+static void forwardLoadedImages()
+{
+    struct Command cmd;
+    struct Image* image;
+    Boolean loaded;
 
-        perr = pthread_cond_signal(&commandCond); // Wake consumer
-        if (perr != 0) {
-            errExitEN(perr, "pthread_cond_signal");
+    imageLoaderProcess(&imageLoader);
+    while (imageLoaderNext(&imageLoader, &cmd, &image, &loaded)) {
+        if (image == NULL && cmd.line[0] == '+') {
+            queueForClients(&cmd, NULL);
+            continue;
+        }
+        if (image == NULL) {
+            LOG_INFO("Could not open file %s.\n", cmd.line);
+            continue;
+        }
+        if (loaded) {
+            replayRingAdd(&replayRing, image);
+            LOG_INFO("Transmitting file %s.\n", cmd.line);
         }
+        queueForClients(&cmd, image);
     }
-    return NULL;
 }
 
-void forwardImages(int cfd)
+/**
+ * Forward the images that the workers have prepared, in the order of their commands.
+ */
+static void forwardPreparedImages()
 {
-    int perr;
-    char commandCopy[MAX_COMMAND_LENGTH];
-    char cmd[1];
+    struct Command cmd;
+    struct Image* image;
+    Boolean prepared;
 
-    for (;;) {
-        perr = pthread_mutex_lock(&commandMtx);
-        if (perr != 0)
-            errExitEN(perr, "pthread_mutex_lock");
-
-        while (commandAvailable == 0) { // Wait for producer
-            struct timespec timeout_time = computeAbsoluteTimeout(5e8);
-            perr = pthread_cond_timedwait(&commandCond, &commandMtx, &timeout_time);
-            if (perr == ETIMEDOUT) {
-                // Check wheter the client is still alive.
-                if (getClientStatus() == DEAD) {
-                    LOG_INFO("While waiting for commands, the heartbeat signaled that the client is dead.\n");
-                    perr = pthread_mutex_unlock(&commandMtx);
-                    // Also close our file descriptor
-                    if (close(cfd) == -1) {
-                        errMsg("close");
-                    }
-                    return;
-                }
-            } else if (perr != 0) { // all other error cases
-                errExitEN(perr, "pthread_cond_wait");
+    while (preparerNext(&preparer, &cmd, &image, &prepared)) {
+        if (image == NULL && cmd.line[0] == '+') {
+            queueForClients(&cmd, NULL);
+            continue;
+        }
+        if (image == NULL) {
+            LOG_INFO("Could not open file %s.\n", cmd.line);
+            continue;
+        }
+        if (prepared) {
+            if (image->hashState == HASH_VALID) {
+                imageSetHash(image, image->hash); // the workers cannot fill the cache
             }
+            replayRingAdd(&replayRing, image);
+            LOG_INFO("Transmitting file %s.\n", cmd.fd != -1 ? cmd.line + 1 : cmd.line);
         }
+        queueForClients(&cmd, image);
+    }
+}
+
+/**
+ * Complete the tasks that the workers have finished: previews become
+ * ready and prepared images are forwarded.
+ */
+static void completeTasks()
+{
+    struct Task* task = workerPoolTakeFinished(&workerPool);
 
-        if (commandAvailable == 0) {
-            // Nothing is available. Just continue to wait.
-            perr = pthread_mutex_unlock(&commandMtx);
+    while (task != NULL) {
+        struct Task* next = task->next;
+        task->complete(task);
+        task = next;
+    }
+    if (preparing) {
+        forwardPreparedImages();
+    }
+    flushDataConnections();
+}
+
+/**
+ * Forward commands that arrived at about the same time.
+ * In latest-wins mode, only the last image of them is forwarded.
+ * Image taken commands are never skipped.
+ */
+static void forwardBatch(const struct Command* batch, size_t count)
+{
+    size_t lastImage = 0;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (batch[i].line[0] != '+') {
+            lastImage = i;
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        if (latestWins && batch[i].line[0] != '+' && i < lastImage) {
+            LOG_INFO("Skipping file %s, a newer image is waiting.\n", batch[i].line);
+            statsAdd(&stats.imagesCoalesced, 1);
+            discardCommand(&batch[i]);
             continue;
         }
+        forwardCommand(&batch[i]);
+    }
+}
 
-        // fetch the command from the other thread
-        memcpy(commandCopy, command, MAX_COMMAND_LENGTH);
-        commandAvailable = 0;
-        perr = pthread_mutex_unlock(&commandMtx);
-        if (perr != 0) {
-            errExitEN(perr, "pthread_mutex_unlock");
+/**
+ * Forward all commands that are available in the command queue.
+ * The image data of every image is fanned out to all connected clients.
+ */
+void forwardImages()
+{
+    uint64_t value;
+    size_t count;
+
+    // Reset the eventfd before looking at the queue so that
+    // no wakeup for a command pushed meanwhile gets lost.
+    if (read(commandQueue.dataFd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        errExit("eventfd read");
+    }
+    do {
+        count = 0;
+        while (count < commandQueue.capacity
+                && commandQueuePop(&commandQueue, &commandBatch[count])) {
+            histogramRecordSince(&stats.queueWait, &commandBatch[count].received);
+            count++;
         }
+        forwardBatch(commandBatch, count);
+    } while (count == commandQueue.capacity);
+}
 
-        if (commandCopy[0] == '+') {
-            // We received a special command that indicates
-            // the "Image has just been taken" command.
-            cmd[0] = COMMAND_IMAGE_TAKEN;
-            LOG_INFO("Sending 'Image taken' command.\n");
-            if (!writeFully(cfd, cmd, sizeof(cmd))) {
-                fprintf(stderr, "Error on write of command\n");
-                break;
+/**
+ * Forward the files that have appeared in the watched directories.
+ */
+static void forwardNewFiles()
+{
+    forwardBatch(dirBatch, dirWatchProcess(&dirWatch, dirBatch));
+}
+
+/**
+ * Accept all pending producer connections on the command socket.
+ */
+static void acceptProducers()
+{
+    struct Producer* producer;
+    int fd;
+
+    for (;;) {
+        fd = accept4(commandListener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
+            if (errno != EAGAIN) {
+                errMsg("accept");
+            }
+            return;
+        }
+        producer = producerCreate(epollFd, fd);
+        if (producer == NULL) {
+            close(fd);
             continue;
         }
+        LOG_INFO("Producer connected to the command socket.\n");
+        producer->next = producers;
+        producers = producer;
+    }
+}
 
-        LOG_INFO("Trying to read file %s.\n", commandCopy);
-        struct File file;
-        if (readFileData(commandCopy, &file) == -1) {
-            LOG_INFO("Could not read file %s.\n", commandCopy);
+/**
+ * Accept all pending connections on the stats socket.
+ */
+static void acceptStatsClients()
+{
+    struct StatsClient* client;
+    int fd;
+
+    for (;;) {
+        fd = accept4(statsListener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                errMsg("accept");
+            }
+            return;
+        }
+        client = statsClientCreate(epollFd, fd);
+        if (client == NULL) {
+            close(fd);
             continue;
         }
+        client->next = statsClients;
+        statsClients = client;
+    }
+}
 
-        LOG_INFO("Transmitting file %s.\n", commandCopy);
-
-        char numBytesSplit[4];
-        intToByteArray(file.size, numBytesSplit);
+/**
+ * Forward the commands of all datagrams the producer has sent.
+ */
+static void readFromProducer(struct Producer* producer)
+{
+    ssize_t count;
 
-        cmd[0] = COMMAND_IMAGE_DATA;
-        if (!writeFully(cfd, cmd, sizeof(cmd))) {
-            fprintf(stderr, "Error on write of command\n");
-            free(file.data);
-            break;
-        }
-        if (!writeFully(cfd, numBytesSplit, sizeof(numBytesSplit))) {
-            fprintf(stderr, "Error on write of num bytes\n");
-            free(file.data);
-            break;
+    while ((count = producerReceive(producer, producerBatch)) != 0) {
+        if (count == PRODUCER_TRUNCATED) {
+            LOG_WARN("Dropped a datagram of a producer that exceeds %d bytes or %d files.\n",
+                    PRODUCER_DATAGRAM_SIZE, MAX_DATAGRAM_FDS);
+            continue;
         }
-        if (!writeFully(cfd, file.data, file.size)) {
-            fprintf(stderr, "Error on writing file data to the socket.\n");
-            free(file.data);
+        if (count == -1) {
             break;
         }
-
-        LOG_INFO("File has been transmitted.\n");
-        free(file.data);
+        forwardBatch(producerBatch, count);
     }
-    setClientStatus(DEAD);
-    if (close(cfd) == -1) {
-        errMsg("close");
+    if (count == -1) {
+        LOG_INFO("Producer disconnected from the command socket.\n");
+        producer->closed = TRUE;
     }
 }
 
 /**
- * Wait for an incoming client connection.
- * As soon as a client connect, forward commands and
- * image filenames taken from the fifo to the client.
- * If any error occurrs while writing to the client,
- * the connection is closed and we wait for the
- * next incoming client.
+ * Start watching the capture directories. The newest files that are
+ * already there are kept in the replay ring, so screens see them when
+ * they connect, even if they were written while the server was down.
  */
-void acceptDataConnection()
+static void watchDirectories()
 {
-    struct sockaddr_storage claddr;
-    int cfd;
-    socklen_t addrlen;
+    size_t maxFiles = replayRing.capacity < DIR_WATCH_BATCH ? replayRing.capacity : DIR_WATCH_BATCH;
+    size_t count;
+    size_t i;
 
-    for (;;) { // Serve only one client connection at a time.
-        LOG_INFO("Waiting for the client heartbeat.\n");
-        waitForClientAlive();
-
-        int lfd = bindServerSocket(DATA_PORT_NUM, BACKLOG);
-        addrlen = sizeof(struct sockaddr_storage);
-        LOG_INFO("Waiting for an image receiver to connect.\n");
-        cfd = accept(lfd, (struct sockaddr*) &claddr, &addrlen);
-        if (cfd == -1) {
-            errMsg("accept");
-            continue;
+    dirWatchInit(&dirWatch, epollFd, extensions);
+    for (i = 0; i < numWatchedDirs; ++i) {
+        if (dirWatchAdd(&dirWatch, watchedDirs[i]) == -1) {
+            LOG_ERROR("Cannot watch directory %s.\n", watchedDirs[i]);
+            exit(EXIT_FAILURE);
         }
-        LOG_INFO("Connection accepted.\n");
+        LOG_INFO("Watching directory %s for new images.\n", watchedDirs[i]);
+    }
+    // Found files can only be kept for screens that connect later.
+    if (replayRing.capacity == 0) {
+        LOG_WARN("No images are kept (-n 0), images that are already in the watched directories are ignored.\n");
+        return;
+    }
+    count = dirWatchScan(&dirWatch, dirBatch, maxFiles);
+    for (i = 0; i < count; ++i) {
+        forwardCommand(&dirBatch[i]);
+    }
+}
+
+static void handleEvent(struct epoll_event* ev)
+{
+    struct EventSource* source = ev->data.ptr;
 
-        forwardImages(cfd);
-        if (close(cfd) == -1) {
-          errMsg("close");
+    switch (source->type) {
+    case SOURCE_DATA_LISTENER:
+        acceptConnections(source, CONNECTION_DATA);
+        break;
+    case SOURCE_HEARTBEAT_LISTENER:
+        acceptConnections(source, CONNECTION_HEARTBEAT);
+        break;
+    case SOURCE_COMMAND_QUEUE:
+        forwardImages();
+        break;
+    case SOURCE_TAIL_WATCH:
+        handleTailEvents();
+        break;
+    case SOURCE_DIR_WATCH:
+        forwardNewFiles();
+        break;
+    case SOURCE_IMAGE_LOADER:
+        forwardLoadedImages();
+        break;
+    case SOURCE_STATS_LISTENER:
+        acceptStatsClients();
+        break;
+    case SOURCE_STATS_CLIENT: {
+        struct StatsClient* client = (struct StatsClient*) source;
+        if (!client->closed) {
+            statsClientReceive(client);
         }
-        if (close(lfd) == -1) {
-          errMsg("close");
+        break;
+    }
+    case SOURCE_COMMAND_LISTENER:
+        acceptProducers();
+        break;
+    case SOURCE_TIMER:
+        timerWheelRun(&timers);
+        break;
+    case SOURCE_WORKER_POOL:
+        completeTasks();
+        break;
+    case SOURCE_PRODUCER: {
+        struct Producer* producer = (struct Producer*) source;
+        if (!producer->closed) {
+            readFromProducer(producer);
         }
+        break;
+    }
+    case SOURCE_CONNECTION: {
+        struct Connection* conn = (struct Connection*) source;
+        if (!connectionAlive(conn)) {
+            break;
+        }
+        if (ev->events & (EPOLLERR | EPOLLHUP)) {
+            closeConnection(conn);
+            break;
+        }
+        if (ev->events & EPOLLOUT) {
+            flushConnection(conn);
+        }
+        if (ev->events & (EPOLLIN | EPOLLRDHUP)) {
+            readFromConnection(conn);
+        }
+        break;
+    }
     }
 }
 
+/**
+ * Create a listening socket and register it with the event loop.
+ * The socket stays open for the lifetime of the process.
+ */
+static void listenOn(struct EventSource* listener, EventSourceType type, const char* portNum)
+{
+    listener->type = type;
+    listener->fd = bindServerSocket(portNum, backlog);
+    addEventSource(epollFd, listener, EPOLLIN);
+}
 
-void* acceptHeartbeatConnection()
+/**
+ * Serve any number of image and heartbeat connections from a single thread.
+ * Commands taken from the fifo are forwarded to all image connections.
+ * If any error occurrs while writing to a client, its connection is closed.
+ * The other clients are not affected.
+ */
+void runEventLoop()
 {
-    struct sockaddr_storage claddr;
-    int cfd;
-    socklen_t addrlen;
+    struct epoll_event events[MAX_EVENTS];
+    int numEvents;
+    int i;
 
-    for (;;) { // Serve only one client connection at a time.
-        addrlen = sizeof(struct sockaddr_storage);
-        int lfd = bindServerSocket(HEARTBEAT_PORT_NUM, BACKLOG);
-        LOG_INFO("Waiting for a client to connect to the heartbeat channel.\n");
-        cfd = accept(lfd, (struct sockaddr*) &claddr, &addrlen);
-        if (cfd == -1) {
-            errMsg("accept heartbeat");
-            continue;
+    epollFd = createEventLoop();
+    timerWheelInit(&timers, epollFd);
+    listenOn(&dataListener, SOURCE_DATA_LISTENER, DATA_PORT_NUM);
+    listenOn(&heartbeatListener, SOURCE_HEARTBEAT_LISTENER, HEARTBEAT_PORT_NUM);
+    commandSource.type = SOURCE_COMMAND_QUEUE;
+    commandSource.fd = commandQueue.dataFd;
+    addEventSource(epollFd, &commandSource, EPOLLIN);
+    tailWatchInit(&tailWatch, epollFd);
+    timerInit(&tailTimer, tailDue, NULL);
+    if (asyncLoading && imageLoaderInit(&imageLoader, epollFd) == -1) {
+        LOG_INFO("io_uring is not available (%s), reading files with blocking calls.\n",
+                strerror(errno));
+        asyncLoading = FALSE;
+    }
+    if (numWatchedDirs > 0) {
+        watchDirectories();
+    }
+    if (commandSocketPath != NULL) {
+        commandListener.type = SOURCE_COMMAND_LISTENER;
+        commandListener.fd = bindLocalSocket(commandSocketPath, SOCK_SEQPACKET, backlog);
+        addEventSource(epollFd, &commandListener, EPOLLIN);
+    }
+    if (statsSocketPath != NULL) {
+        statsListener.type = SOURCE_STATS_LISTENER;
+        statsListener.fd = bindLocalSocket(statsSocketPath, SOCK_STREAM, backlog);
+        addEventSource(epollFd, &statsListener, EPOLLIN);
+    }
+    if (numWorkers > 0) {
+        workerPoolInit(&workerPool, epollFd, numWorkers);
+        // With io_uring, the files are read by the kernel already.
+        preparing = !asyncLoading;
+        preparerInit(&preparer, &workerPool, replayRing.capacity > 0 ? replayRing.maxBytes : 0);
+        connectionEnableDedup(hashImage);
+        previews = previewSupported();
+        if (previews) {
+            connectionEnablePreviews();
+        } else {
+            LOG_INFO("Built without libjpeg, previews are not available.\n");
         }
-        LOG_INFO("Hearbeat connection accepted.\n");
-        setClientStatus(ALIVE);
-        wakeClientAliveWaiter();
-        hearbeat(cfd);
-        // hearbeat will only return if the cfd is close.
-        if (close(lfd) != 0) {
-            errExit("hearbeat close_lfd");
+    }
+    if (statsIntervalS > 0) {
+        timerInit(&statsTimer, statsDue, NULL);
+        timerStart(&timers, &statsTimer, statsIntervalS * 1000);
+    }
+
+    LOG_INFO("Waiting for clients to connect.\n");
+    for (;;) {
+        numEvents = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (numEvents == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+        for (i = 0; i < numEvents; ++i) {
+            handleEvent(&events[i]);
         }
+        destroyClosedConnections();
     }
 }
 
@@ -393,28 +1225,187 @@ void usage(const char* programName)
 {
     printf("Send image data to the screen of the libipho photobooth.\n");
     printf("\n");
-    printf("Usage: %s fifo_filename\n", programName);
+    printf("Usage: %s [-q depth] [-o policy] [-b backlog] [-n images] [-m megabytes]\n", programName);
+    printf("       [-k images] [-l] [-w directory]... [-e extensions] [-u socket] [-H]\n");
+    printf("       [-i backend] [-S socket] [-t seconds] [-L level] [-j workers]\n");
+    printf("       fifo_filename\n");
     printf("\n");
     printf("  fifo_filename: the file name of the fifo under which\n");
     printf("                 this server receives commands.\n");
+    printf("                 A file name prefixed with '%c' is sent while the\n", TAIL_PREFIX);
+    printf("                 file is still being written.\n");
+    printf("  -q depth:      number of commands that can be queued\n");
+    printf("                 for the client (default %d).\n", DEFAULT_QUEUE_DEPTH);
+    printf("  -o policy:     what to do with a command if the queue is full:\n");
+    printf("                 block, drop-oldest (default) or drop-newest.\n");
+    printf("  -b backlog:    number of pending connections per port\n");
+    printf("                 (default %d).\n", DEFAULT_BACKLOG);
+    printf("  -n images:     number of recent images kept in memory for\n");
+    printf("                 screens that reconnect, 0 disables (default %d).\n", DEFAULT_REPLAY_CAPACITY);
+    printf("  -m megabytes:  memory limit of these images (default %d).\n", DEFAULT_REPLAY_MEGABYTES);
+    printf("  -k images:     number of recent images sent to a screen\n");
+    printf("                 when it connects (default %d).\n", DEFAULT_REPLAY_COUNT);
+    printf("  -l:            latest wins: if a screen cannot keep up, images that\n");
+    printf("                 it has not started to receive are replaced by newer ones.\n");
+    printf("  -w directory:  also forward every image that is written to or moved\n");
+    printf("                 into the directory, up to %d times. At startup, the\n", MAX_WATCHED_DIRS);
+    printf("                 newest images found there are kept for screens, as many\n");
+    printf("                 as -n allows (at most %d); none with -n 0.\n", DIR_WATCH_BATCH);
+    printf("  -e extensions: comma separated file name extensions of the images\n");
+    printf("                 in these directories (default %s).\n", DEFAULT_EXTENSIONS);
+    printf("  -H:            use huge pages for image buffers.\n");
+    printf("  -i backend:    how image files are read: blocking (default) or\n");
+    printf("                 io_uring, which reads several files at once without\n");
+    printf("                 blocking. Falls back to blocking if the kernel lacks it.\n");
+    printf("  -S socket:     serve counters and latency histograms on a local stream\n");
+    printf("                 socket at this path. Send \"json\" or an empty line.\n");
+    printf("  -t seconds:    interval of the stats in the log, 0 disables\n");
+    printf("                 (default %d).\n", DEFAULT_STATS_INTERVAL_S);
+    printf("  -L level:      least severe messages that are logged: error, warn,\n");
+    printf("                 info (default) or debug.\n");
+    printf("  -j workers:    threads that open and read image files, unless io_uring\n");
+    printf("                 is used, and render previews for screens that ask for\n");
+    printf("                 them, and hash images for screens that deduplicate them.\n");
+    printf("                 0 does everything in the main thread and disables\n");
+    printf("                 previews and deduplication (default: one per CPU).\n");
+    printf("  -u socket:     also receive commands through a local seqpacket socket\n");
+    printf("                 at this path. A datagram holds one or more commands.\n");
+    printf("                 The file of a command '%cname' is passed as descriptor.\n", FD_PREFIX);
     exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
+    long queueDepth = DEFAULT_QUEUE_DEPTH;
+    long replayCapacity = DEFAULT_REPLAY_CAPACITY;
+    long replayMegabytes = DEFAULT_REPLAY_MEGABYTES;
+    long count;
+    OverflowPolicy overflowPolicy = OVERFLOW_DROP_OLDEST;
+    Boolean hugePages = FALSE;
+    int verbosity = LOG_LEVEL_INFO;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "q:o:b:n:m:k:lw:e:u:Hi:S:t:L:j:")) != -1) {
+        switch (opt) {
+        case 'q':
+            queueDepth = strtol(optarg, NULL, 10);
+            if (queueDepth <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            if (parseOverflowPolicy(optarg, &overflowPolicy) == -1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            backlog = strtol(optarg, NULL, 10);
+            if (backlog <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            replayCapacity = strtol(optarg, NULL, 10);
+            if (replayCapacity < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            replayMegabytes = strtol(optarg, NULL, 10);
+            if (replayMegabytes <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            count = strtol(optarg, NULL, 10);
+            if (count < 0 || count > MAX_REPLAY_IMAGES) {
+                usage(argv[0]);
+            }
+            replayCount = count;
+            break;
+        case 'l':
+            latestWins = TRUE;
+            break;
+        case 'w':
+            if (numWatchedDirs == MAX_WATCHED_DIRS) {
+                usage(argv[0]);
+            }
+            watchedDirs[numWatchedDirs++] = optarg;
+            break;
+        case 'e':
+            extensions = optarg;
+            break;
+        case 'u':
+            commandSocketPath = optarg;
+            break;
+        case 'H':
+            hugePages = TRUE;
+            break;
+        case 'S':
+            statsSocketPath = optarg;
+            break;
+        case 't':
+            statsIntervalS = strtol(optarg, NULL, 10);
+            if (statsIntervalS < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            if (parseLogLevel(optarg, &verbosity) == -1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'j':
+            numWorkers = strtol(optarg, NULL, 10);
+            if (numWorkers < 0 || numWorkers > MAX_WORKERS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "io_uring") == 0) {
+                asyncLoading = TRUE;
+            } else if (strcmp(optarg, "blocking") == 0) {
+                asyncLoading = FALSE;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
         usage(argv[0]);
     }
-    const char* fifo_filename = argv[1];
+    const char* fifo_filename = argv[optind];
+
+    if (numWorkers < 0) {
+        numWorkers = workerPoolDefaultSize();
+    }
+
+    logSetLevel(verbosity);
+    logInit();
 
     // Ignore the sigpipe so that we can find out about a broken connection
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         errExit("signal\n");
 
     createFifo(fifo_filename);
+    commandQueueInit(&commandQueue, queueDepth, overflowPolicy);
+    statsSetCommandQueue(&commandQueue);
+    commandBatch = calloc(commandQueue.capacity, sizeof(struct Command));
+    if (commandBatch == NULL) {
+        errExit("calloc command batch");
+    }
+    bufferPoolInit((size_t) POOL_CACHE_MEGABYTES * 1024 * 1024, hugePages);
+    replayRingInit(&replayRing, replayCapacity, (size_t) replayMegabytes * 1024 * 1024);
+    if (replayRing.capacity > 0) {
+        connectionEnableResume(findResumableImage);
+    }
+    imageSeedIds(randomSeed());
 
     // Create a thread that reads commands from the pipe
-    // and forwards the commands to our main thread.
+    // and forwards the commands to the event loop in our main thread.
     pthread_t command_tid;
     int perr;
     perr = pthread_create(&command_tid, NULL, readCommandsFromFifo, (void*)fifo_filename);
@@ -422,15 +1413,7 @@ int main(int argc, char *argv[])
         errExitEN(perr, "Error while trying to create a thread.");
     }
 
-    // Create a thread that sends a heartbeat to the client
-    // in order to check whether she is alive
-    pthread_t heartbeat_tid;
-    perr = pthread_create(&heartbeat_tid, NULL, acceptHeartbeatConnection, NULL);
-    if (perr != 0) {
-        errExitEN(perr, "Error while trying to create a thread.");
-    }
-
-    acceptDataConnection();
+    runEventLoop();
     return 0;
 }
 
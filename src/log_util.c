@@ -0,0 +1,429 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include "log_util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_OUTPUT_SIZE 16384
+
+/*
+ * log_util must not use err_util, which writes through this module.
+ * Problems of the logger itself are reported with a plain write() to stderr.
+ */
+
+struct LogRecord {
+    struct timespec time;
+    int level;
+    int length;
+    char text[LOG_RECORD_LENGTH];
+};
+
+/**
+ * Single producer, single consumer ring of one thread.
+ * Rings are never freed, a thread that exits leaves an empty ring behind.
+ */
+struct LogRing {
+    _Atomic size_t head; // next record to write out, advanced by the flusher
+    _Atomic size_t tail; // next free record, advanced by the owning thread
+    struct LogRecord records[LOG_RING_RECORDS];
+    struct LogRing* next;
+};
+
+/**
+ * Buffered output of the flusher for one descriptor.
+ */
+struct LogOutput {
+    int fd;
+    size_t length;
+    char data[LOG_OUTPUT_SIZE];
+};
+
+_Atomic int logLevel = LOG_LEVEL_INFO;
+
+static const char* const levelNames[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static _Atomic(struct LogRing*) rings = NULL;
+static pthread_mutex_t registerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct LogRing* threadRing = NULL;
+
+static _Atomic int started = 0;
+static _Atomic int flusherSleeping = 0;
+static _Atomic uint64_t dropped = 0;
+static uint64_t droppedReported = 0;
+static int wakeFd = -1;
+
+// Only used with drainLock held.
+static struct LogOutput stdoutBuffer = { STDOUT_FILENO, 0, { 0 } };
+static struct LogOutput stderrBuffer = { STDERR_FILENO, 0, { 0 } };
+static time_t cachedSecond = -1;
+static char cachedTime[32];
+
+static void writeAll(int fd, const char* data, size_t length)
+{
+    ssize_t n;
+
+    while (length > 0) {
+        n = write(fd, data, length);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return; // nowhere left to complain
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+static void flushOutput(struct LogOutput* output)
+{
+    writeAll(output->fd, output->data, output->length);
+    output->length = 0;
+}
+
+static void appendOutput(struct LogOutput* output, const char* data, size_t length)
+{
+    if (output->length + length > LOG_OUTPUT_SIZE) {
+        flushOutput(output);
+    }
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+/**
+ * Format the wall clock time of a record, e.g. 2015-06-01 18:30:12.345.
+ * localtime_r() is only called once per second.
+ */
+static size_t formatTime(const struct timespec* time, char* buffer, size_t size)
+{
+    struct tm local;
+
+    if (time->tv_sec != cachedSecond) {
+        localtime_r(&time->tv_sec, &local);
+        strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", &local);
+        cachedSecond = time->tv_sec;
+    }
+    return snprintf(buffer, size, "%s.%03ld", cachedTime, time->tv_nsec / 1000000);
+}
+
+static void appendRecord(const struct LogRecord* record)
+{
+    struct LogOutput* output = record->level <= LOG_LEVEL_WARN ? &stderrBuffer : &stdoutBuffer;
+    char prefix[64];
+    size_t length = record->length;
+    int n;
+
+    n = formatTime(&record->time, prefix, sizeof(prefix));
+    n += snprintf(prefix + n, sizeof(prefix) - n, " %-5s ", levelNames[record->level]);
+    while (length > 0 && record->text[length - 1] == '\n') {
+        length--;
+    }
+    appendOutput(output, prefix, n);
+    appendOutput(output, record->text, length);
+    appendOutput(output, "\n", 1);
+}
+
+/**
+ * Write out all records that are visible in the rings.
+ * drainLock has to be held.
+ *
+ * \return the number of records written.
+ */
+static size_t drainRings(void)
+{
+    struct LogRing* ring = atomic_load_explicit(&rings, memory_order_acquire);
+    struct LogRecord notice;
+    uint64_t lost;
+    size_t count = 0;
+    size_t head;
+    size_t tail;
+
+    for (; ring != NULL; ring = ring->next) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; ++head) {
+            appendRecord(&ring->records[head % LOG_RING_RECORDS]);
+            count++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+
+    lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (lost != droppedReported) {
+        clock_gettime(CLOCK_REALTIME, &notice.time);
+        notice.level = LOG_LEVEL_WARN;
+        notice.length = snprintf(notice.text, sizeof(notice.text),
+                "%llu log messages were dropped.", (unsigned long long) (lost - droppedReported));
+        appendRecord(&notice);
+        droppedReported = lost;
+    }
+    flushOutput(&stderrBuffer);
+    flushOutput(&stdoutBuffer);
+    return count;
+}
+
+static size_t drainLocked(void)
+{
+    size_t count;
+
+    pthread_mutex_lock(&drainLock);
+    count = drainRings();
+    pthread_mutex_unlock(&drainLock);
+    return count;
+}
+
+static void* flushLogs(void* arg)
+{
+    struct pollfd pfd;
+    uint64_t value;
+
+    (void) arg;
+    pfd.fd = wakeFd;
+    pfd.events = POLLIN;
+    for (;;) {
+        if (drainLocked() > 0) {
+            continue;
+        }
+        // Announce the sleep before the final check, so that a writer
+        // either sees the flag or its record is found by the check.
+        // The check loads tail with acquire only, which may be ordered
+        // before the store of the flag without the fence. It pairs with
+        // the fence in wakeFlusher().
+        atomic_store(&flusherSleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (drainLocked() > 0) {
+            atomic_store(&flusherSleeping, 0);
+            continue;
+        }
+        if (poll(&pfd, 1, -1) > 0) {
+            if (read(wakeFd, &value, sizeof(value)) == -1) {
+                // EAGAIN, another wakeup consumed it
+            }
+        }
+        atomic_store(&flusherSleeping, 0);
+    }
+    return NULL;
+}
+
+static void wakeFlusher(void)
+{
+    uint64_t one = 1;
+
+    // Order the store of the record before the load of the flag,
+    // see flushLogs().
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&flusherSleeping) && atomic_exchange(&flusherSleeping, 0)) {
+        if (write(wakeFd, &one, sizeof(one)) == -1) {
+            // the counter is saturated, the flusher wakes up anyway
+        }
+    }
+}
+
+/**
+ * \return the ring of the calling thread, NULL if it cannot have one.
+ */
+static struct LogRing* getThreadRing(void)
+{
+    struct LogRing* ring = threadRing;
+
+    if (ring != NULL || !atomic_load_explicit(&started, memory_order_acquire)) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(struct LogRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&registerLock);
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    atomic_store_explicit(&rings, ring, memory_order_release);
+    pthread_mutex_unlock(&registerLock);
+    threadRing = ring;
+    return ring;
+}
+
+void logWrite(int level, const char* format, ...)
+{
+    struct LogRing* ring = getThreadRing();
+    struct LogRecord* record;
+    va_list args;
+    size_t head;
+    size_t tail;
+    int n;
+
+    if (level < LOG_LEVEL_ERROR) {
+        level = LOG_LEVEL_ERROR;
+    } else if (level > LOG_LEVEL_DEBUG) {
+        level = LOG_LEVEL_DEBUG;
+    }
+
+    if (ring == NULL) {
+        va_start(args, format);
+        vfprintf(level <= LOG_LEVEL_WARN ? stderr : stdout, format, args);
+        va_end(args);
+        return;
+    }
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= LOG_RING_RECORDS) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        wakeFlusher();
+        return;
+    }
+
+    record = &ring->records[tail % LOG_RING_RECORDS];
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->level = level;
+    va_start(args, format);
+    n = vsnprintf(record->text, LOG_RECORD_LENGTH, format, args);
+    va_end(args);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= LOG_RECORD_LENGTH) {
+        n = LOG_RECORD_LENGTH - 1;
+    }
+    record->length = n;
+    atomic_store(&ring->tail, tail + 1);
+    wakeFlusher();
+}
+
+void logWriteNow(int level, const char* format, ...)
+{
+    struct LogRecord record;
+    va_list args;
+    int n;
+
+    if (level < LOG_LEVEL_ERROR) {
+        level = LOG_LEVEL_ERROR;
+    } else if (level > LOG_LEVEL_DEBUG) {
+        level = LOG_LEVEL_DEBUG;
+    }
+
+    if (!atomic_load_explicit(&started, memory_order_acquire)) {
+        fflush(stdout);
+        va_start(args, format);
+        vfprintf(level <= LOG_LEVEL_WARN ? stderr : stdout, format, args);
+        va_end(args);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &record.time);
+    record.level = level;
+    va_start(args, format);
+    n = vsnprintf(record.text, LOG_RECORD_LENGTH, format, args);
+    va_end(args);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= LOG_RECORD_LENGTH) {
+        n = LOG_RECORD_LENGTH - 1;
+    }
+    record.length = n;
+
+    pthread_mutex_lock(&drainLock);
+    drainRings();
+    appendRecord(&record);
+    flushOutput(level <= LOG_LEVEL_WARN ? &stderrBuffer : &stdoutBuffer);
+    pthread_mutex_unlock(&drainLock);
+}
+
+void logFlush(void)
+{
+    if (!atomic_load_explicit(&started, memory_order_acquire)) {
+        fflush(stdout);
+        return;
+    }
+    drainLocked();
+}
+
+static void flushAtExit(void)
+{
+    logFlush();
+}
+
+void logInit(void)
+{
+    static const char failed[] = "Cannot start the log thread, logging synchronously.\n";
+    pthread_t thread;
+    sigset_t all;
+    sigset_t previous;
+    int res;
+
+    if (atomic_load(&started)) {
+        return;
+    }
+    fflush(stdout);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd == -1) {
+        writeAll(STDERR_FILENO, failed, sizeof(failed) - 1);
+        return;
+    }
+    // Signals are left to the other threads.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    res = pthread_create(&thread, NULL, flushLogs, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (res != 0) {
+        close(wakeFd);
+        wakeFd = -1;
+        writeAll(STDERR_FILENO, failed, sizeof(failed) - 1);
+        return;
+    }
+    pthread_detach(thread);
+    atexit(flushAtExit);
+    atomic_store_explicit(&started, 1, memory_order_release);
+}
+
+void logSetLevel(int level)
+{
+    atomic_store_explicit(&logLevel, level, memory_order_relaxed);
+}
+
+int parseLogLevel(const char* name, int* level)
+{
+    int i;
+
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; ++i) {
+        if (strcasecmp(name, levelNames[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint64_t logDropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
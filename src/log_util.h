@@ -22,9 +22,91 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 #ifndef LOG_UTIL_H_
 #define LOG_UTIL_H_
 
-#include <stdio.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
-#define LOG_INFO(...) printf(__VA_ARGS__)
+/*
+ * Threads format their messages into a ring buffer of their own and never
+ * block on the terminal or on a pipe. A background thread started by
+ * logInit() prefixes the messages with a timestamp and the level and writes
+ * them out, errors and warnings to stderr, everything else to stdout.
+ * If the ring of a thread is full, the message is dropped and counted.
+ * Until logInit() has been called, messages are written synchronously.
+ */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
 
+// Messages above this level are not compiled in, e.g. -DLOG_COMPILE_LEVEL=2.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
 #endif
 
+#define LOG_RECORD_LENGTH 512       // longer messages are truncated
+#define LOG_RING_RECORDS 256        // per thread
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILE_LEVEL && logEnabled(level)) \
+            logWrite((level), __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+extern _Atomic int logLevel;
+
+/**
+ * \return non-zero if messages of level are written at runtime.
+ */
+static inline int logEnabled(int level)
+{
+    return level <= atomic_load_explicit(&logLevel, memory_order_relaxed);
+}
+
+/**
+ * Start the flushing thread. Messages of the calling thread that were
+ * written before are flushed first. Pending messages are flushed at exit().
+ */
+void logInit(void);
+
+/**
+ * Change the runtime level. The default is LOG_LEVEL_INFO.
+ */
+void logSetLevel(int level);
+
+/**
+ * Translate the name of a level (error, warn, info or debug).
+ *
+ * \return 0 on success, -1 if name is unknown.
+ */
+int parseLogLevel(const char* name, int* level);
+
+/**
+ * Queue a message regardless of the levels. Use the LOG_* macros instead.
+ * A single trailing newline is optional.
+ */
+void logWrite(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Write a message right away, after all messages queued so far, without
+ * going through the ring of the calling thread. Unlike logWrite() it
+ * cannot drop the message, so use it for errors the process exits on.
+ */
+void logWriteNow(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Write all messages that have been queued so far before returning.
+ */
+void logFlush(void);
+
+/**
+ * \return the number of messages dropped because a ring was full.
+ */
+uint64_t logDropped(void);
+
+#endif
@@ -19,13 +19,23 @@ You should have received a copy of the GNU General Public License
 along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include "err_util.h"
 #include "log_util.h"
 #include "net_util.h"
 
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 int bindServerSocket(const char* portNum, int backlog)
@@ -53,7 +63,7 @@ int bindServerSocket(const char* portNum, int backlog)
     // Walk through the list until we find an address to bind to.
     optval = 1;
     for (rp = result; rp != NULL; rp = rp->ai_next) {
-        lfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        lfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
         if (lfd == -1) {
             continue; // On error, try next address
         }
@@ -78,6 +88,70 @@ int bindServerSocket(const char* portNum, int backlog)
     return lfd;
 }
 
+/**
+ * Remove the socket an earlier run has left at path. Terminates the
+ * process if path is something else or a server still listens on it.
+ */
+static void removeStaleSocket(const struct sockaddr_un* addr, int type)
+{
+    struct stat st;
+    int fd;
+    int res;
+
+    if (lstat(addr->sun_path, &st) == -1) {
+        if (errno != ENOENT) {
+            errExit("stat\n");
+        }
+        return;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        LOG_ERROR("%s exists and is not a socket.\n", addr->sun_path);
+        exit(EXIT_FAILURE);
+    }
+    fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        errExit("socket\n");
+    }
+    // A full backlog (EAGAIN) also means that someone is listening.
+    res = connect(fd, (const struct sockaddr*) addr, sizeof(*addr));
+    if (res == 0 || errno == EAGAIN) {
+        LOG_ERROR("Another server is listening on %s.\n", addr->sun_path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    if (unlink(addr->sun_path) == -1 && errno != ENOENT) {
+        errExit("unlink\n");
+    }
+}
+
+int bindLocalSocket(const char* path, int type, int backlog)
+{
+    struct sockaddr_un addr;
+    int lfd;
+
+    LOG_INFO("Binding local socket to %s.\n", path);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Socket path %s is too long.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    lfd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd == -1) {
+        errExit("socket\n");
+    }
+    removeStaleSocket(&addr, type);
+    if (bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        errExit("bind\n");
+    }
+    if (listen(lfd, backlog) == -1) {
+        errExit("Listen\n");
+    }
+    return lfd;
+}
+
 void intToByteArray(int integer, char* byteArray)
 {
     int i;
@@ -103,3 +177,87 @@ Boolean writeFully(int fd, const char* buffer, size_t length)
     }
     return TRUE;
 }
+
+// Largest chunk that sendfile() transfers in one call.
+#define MAX_SEND_CHUNK 0x7ffff000
+#define COPY_BUFFER_SIZE 65536
+
+ssize_t sendFileChunk(int outFd, int inFd, off_t* offset, off_t count)
+{
+    char buffer[COPY_BUFFER_SIZE];
+    size_t chunk = count > MAX_SEND_CHUNK ? MAX_SEND_CHUNK : (size_t) count;
+    ssize_t n;
+
+    do {
+        n = sendfile(outFd, inFd, offset, chunk);
+    } while (n == -1 && errno == EINTR);
+    if (n != -1 || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) {
+        return n;
+    }
+
+    // sendfile() is not supported for this file, copy through the buffer.
+    if (chunk > COPY_BUFFER_SIZE) {
+        chunk = COPY_BUFFER_SIZE;
+    }
+    do {
+        n = pread(inFd, buffer, chunk, *offset);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+    do {
+        n = send(outFd, buffer, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        *offset += n;
+    }
+    return n;
+}
+
+ssize_t sendVector(int fd, struct iovec* iov, int iovcnt, Boolean more)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+int setCork(int fd, Boolean cork)
+{
+    int optval = cork ? 1 : 0;
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+}
+
+int setNoDelay(int fd)
+{
+    int optval = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
+int setNotSentLowat(int fd, int bytes)
+{
+    return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+}
+
+int getRoundTripTime(int fd, unsigned int* micros)
+{
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1) {
+        return -1;
+    }
+    *micros = info.tcpi_rtt;
+    return 0;
+}
+
+int setUserTimeout(int fd, unsigned int millis)
+{
+    return setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &millis, sizeof(millis));
+}
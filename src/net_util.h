@@ -24,10 +24,16 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 
 #include "boolean_util.h"
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 /**
  * Create a server socket at any available host interface on the provided port.
  * Bind a file descriptor to it and put it into into listen mode.
  * Return the file descriptor that can be used to accept client connections.
+ * The socket is non-blocking and closed on exec. It is meant to be created
+ * once and kept open for the lifetime of the process, so that clients can
+ * reconnect at any time.
  *
  * \param portNum
  * String that represent the port number that the server socket should bind to
@@ -39,18 +45,32 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 int bindServerSocket(const char* portNum, int backlog);
 
 /**
- * Converts an integer into a byte array of 4 bytes so that
- * the byte array representation is independent of the
- * byte order of the host system.
+ * Create a local server socket of the given type, e.g. SOCK_SEQPACKET,
+ * at path and put it into listen mode. A socket left over at path by an earlier run is
+ * removed, unless a server still listens on it. The socket is non-blocking and closed on exec.
+ * Terminates the process on error, or if path is in use.
+ *
+ * \return
+ * File descriptor corresponding to the server socket in listen mode.
+ */
+int bindLocalSocket(const char* path, int type, int backlog);
+
+/**
+ * Converts an integer into the 4-byte length field of protocol version 1.
  *
  * The caller has to provide a pointer byteArray that
  * points to at lease 4 bytes of memory.
- * byteArray will be filled as follows:
+ * byteArray will be filled with the digits of the integer in base 255,
+ * least significant digit first:
+ *
+ * byteArray[0] = integer % 255
+ * byteArray[1] = (integer / 255) % 255
+ * ..
+ * byteArray[3] = Most significant digit
  *
- * byteArray[0] = Least significant 8 bits
- * byteArray[1] = ..
- * byteArray[2] = ..
- * byteArray[3] = Most significant 8 bits
+ * The base is 255 rather than 256. The Android apps that speak
+ * protocol version 1 decode the field this way, so the encoding must
+ * stay as it is. Protocol version 2 uses encodeUint64() instead.
  *
  * \param integer
  * The integer to convert
@@ -70,5 +90,74 @@ void intToByteArray(int integer, char* byteArray);
  * TRUE if all bytes have been sent, FALSE otherwise.
  */
 Boolean writeFully(int fd, const char* buffer, size_t length);
+
+/**
+ * Send as many of the count bytes of inFd, starting at *offset, as outFd
+ * accepts right now, without copying the data through user space, and
+ * advance *offset accordingly. Does not block.
+ * If sendfile() is not supported for inFd, the bytes are copied through
+ * a small buffer instead.
+ *
+ * \return
+ * Number of bytes sent, 0 if the file ended early,
+ * -1 on error. errno is EAGAIN if outFd cannot take more data right now.
+ */
+ssize_t sendFileChunk(int outFd, int inFd, off_t* offset, off_t count);
+
+/**
+ * Send the byte ranges described by iov with a single sendmsg() call
+ * so that small messages end up in as few TCP segments as possible.
+ * Does not block and does not raise SIGPIPE.
+ *
+ * \param more
+ * TRUE if more data of the same message follows right after,
+ * e.g. a file body that is sent with sendfile(). Sets MSG_MORE.
+ * \return
+ * Number of bytes sent, -1 on error. errno is EAGAIN if fd
+ * cannot take more data right now.
+ */
+ssize_t sendVector(int fd, struct iovec* iov, int iovcnt, Boolean more);
+
+/**
+ * Enable or disable TCP_CORK on the socket.
+ * While the socket is corked, only full segments are sent.
+ * Uncorking sends the remaining partial segment.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int setCork(int fd, Boolean cork);
+
+/**
+ * Disable the Nagle algorithm on the socket. Small messages that are
+ * not followed by more data are then sent without delay.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int setNoDelay(int fd);
+
+/**
+ * Set TCP_NOTSENT_LOWAT, so that the socket only accepts more data while
+ * less than bytes of it are waiting to be sent. Keeps the queue inside
+ * the kernel short, so urgent messages we send later are not stuck behind it.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int setNotSentLowat(int fd, int bytes);
+
+/**
+ * Get the smoothed round trip time that the kernel has measured
+ * for the TCP connection, see TCP_INFO in <man tcp>.
+ * \return 0 on success, -1 on error.
+ */
+int getRoundTripTime(int fd, unsigned int* micros);
+
+/**
+ * Set TCP_USER_TIMEOUT, so that the kernel aborts the connection if data
+ * that has been sent is not acknowledged within millis milliseconds.
+ * The error is then reported on the socket like any other.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int setUserTimeout(int fd, unsigned int millis);
 #endif
 
@@ -0,0 +1,200 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "err_util.h"
+#include "preparer.h"
+#include "stats.h"
+#include "time_util.h"
+
+#include <stdlib.h>
+
+struct PrepareJob {
+    struct Task task; // has to be the first member
+    struct Preparer* preparer;
+    struct Command command;
+    struct Image* image;
+    Boolean done;
+    Boolean prepared; // opened by a worker rather than passed in
+    struct PrepareJob* next;
+};
+
+/**
+ * The hashing of an image that is in use. The worker only sees a copy of
+ * what it needs, the image itself belongs to the event loop.
+ */
+struct HashJob {
+    struct Task task; // has to be the first member
+    struct Image* image;
+    struct File file;
+    const char* data;
+    Boolean hashed;
+    uint64_t hash;
+};
+
+/**
+ * Runs on a worker. Nothing else holds the image yet.
+ */
+static void prepareImage(struct Task* task)
+{
+    struct PrepareJob* job = (struct PrepareJob*) task;
+    struct Command* command = &job->command;
+    struct timespec start = monotonicNow();
+    struct timespec step;
+    struct Image* image;
+
+    if (command->fd != -1) {
+        image = imageFromFd(command->fd, command->line + 1);
+    } else {
+        image = imageOpen(command->line);
+    }
+    histogramRecordSince(&stats.prepareOpen, &start);
+    if (image == NULL) {
+        return;
+    }
+    if ((size_t) image->file.size <= job->preparer->loadLimit) {
+        step = monotonicNow();
+        if (imageLoadData(image)) {
+            histogramRecordSince(&stats.prepareRead, &step);
+            step = monotonicNow();
+            imageHashData(image);
+            histogramRecordSince(&stats.prepareHash, &step);
+        }
+    }
+    step = monotonicNow();
+    imageGetMetadata(image);
+    histogramRecordSince(&stats.prepareMetadata, &step);
+    histogramRecordSince(&stats.fileRead, &start);
+    job->image = image;
+}
+
+static void completeImage(struct Task* task)
+{
+    ((struct PrepareJob*) task)->done = TRUE;
+}
+
+void preparerInit(struct Preparer* preparer, struct WorkerPool* pool, size_t loadLimit)
+{
+    preparer->pool = pool;
+    preparer->loadLimit = loadLimit;
+    preparer->head = NULL;
+    preparer->tail = NULL;
+}
+
+static struct PrepareJob* appendJob(struct Preparer* preparer, const struct Command* command)
+{
+    struct PrepareJob* job = calloc(1, sizeof(struct PrepareJob));
+    if (job == NULL) {
+        errExit("calloc prepare job");
+    }
+    job->preparer = preparer;
+    job->command = *command;
+    if (preparer->tail == NULL) {
+        preparer->head = job;
+    } else {
+        preparer->tail->next = job;
+    }
+    preparer->tail = job;
+    return job;
+}
+
+void preparerSubmit(struct Preparer* preparer, const struct Command* command, struct Image* image)
+{
+    struct PrepareJob* job = appendJob(preparer, command);
+
+    if (image != NULL) {
+        job->image = image;
+        job->done = TRUE;
+        return;
+    }
+    job->prepared = TRUE;
+    job->task.run = prepareImage;
+    job->task.complete = completeImage;
+    workerPoolSubmit(preparer->pool, &job->task);
+}
+
+void preparerSubmitCommand(struct Preparer* preparer, const struct Command* command)
+{
+    struct PrepareJob* job = appendJob(preparer, command);
+    job->done = TRUE;
+}
+
+Boolean preparerHasPending(const struct Preparer* preparer)
+{
+    return preparer->head != NULL;
+}
+
+Boolean preparerNext(struct Preparer* preparer, struct Command* command,
+        struct Image** image, Boolean* prepared)
+{
+    struct PrepareJob* job = preparer->head;
+
+    if (job == NULL || !job->done) {
+        return FALSE;
+    }
+    preparer->head = job->next;
+    if (preparer->head == NULL) {
+        preparer->tail = NULL;
+    }
+    *command = job->command;
+    *image = job->image;
+    *prepared = job->prepared;
+    free(job);
+    return TRUE;
+}
+
+static void hashImage(struct Task* task)
+{
+    struct HashJob* job = (struct HashJob*) task;
+    struct timespec start = monotonicNow();
+
+    job->hashed = hashContents(job->data, &job->file, &job->hash);
+    histogramRecordSince(&stats.prepareHash, &start);
+}
+
+static void completeHash(struct Task* task)
+{
+    struct HashJob* job = (struct HashJob*) task;
+
+    if (job->hashed) {
+        imageSetHash(job->image, job->hash);
+    } else {
+        job->image->hashState = HASH_FAILED;
+    }
+    imageUnref(job->image);
+    free(job);
+}
+
+void preparerHash(struct Preparer* preparer, struct Image* image)
+{
+    struct HashJob* job = calloc(1, sizeof(struct HashJob));
+    if (job == NULL) {
+        errExit("calloc hash job");
+    }
+    job->image = imageRef(image);
+    job->file = image->file;
+    job->data = image->data;
+    image->hashState = HASH_PENDING;
+    job->task.run = hashImage;
+    job->task.complete = completeHash;
+    workerPoolSubmit(preparer->pool, &job->task);
+}
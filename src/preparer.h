@@ -0,0 +1,98 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PREPARER_H_
+#define PREPARER_H_
+
+#include "boolean_util.h"
+#include "command_queue.h"
+#include "image.h"
+#include "worker_pool.h"
+
+// A command whose image is being prepared, see preparer.c.
+struct PrepareJob;
+
+/**
+ * Prepares the images of commands on the workers of a pool: the file is
+ * opened, read into a pooled buffer if it is small enough to be kept in
+ * memory and hashed, and its JPEG metadata is scanned. Several images are
+ * prepared at the same time.
+ *
+ * Jobs are kept in the order of the commands, so images come out in
+ * that order even if a later file is prepared faster.
+ */
+struct Preparer {
+    struct WorkerPool* pool;
+    size_t loadLimit; // larger files are sent from the file
+    struct PrepareJob* head;
+    struct PrepareJob* tail;
+};
+
+/**
+ * Prepare images on pool. Files of up to loadLimit bytes are read into memory.
+ */
+void preparerInit(struct Preparer* preparer, struct WorkerPool* pool, size_t loadLimit);
+
+/**
+ * Append a command to the jobs.
+ *
+ * \param image
+ * NULL to prepare the file named by the command line, or the file passed
+ * with the command, which the preparer then takes over. Otherwise the image
+ * is already available and only waits for the jobs before it; the preparer
+ * takes over the reference.
+ */
+void preparerSubmit(struct Preparer* preparer, const struct Command* command, struct Image* image);
+
+/**
+ * Append a command without a file, e.g. image taken, to the jobs,
+ * so that it does not overtake the images that are being prepared.
+ * preparerNext() returns it without an image.
+ */
+void preparerSubmitCommand(struct Preparer* preparer, const struct Command* command);
+
+/**
+ * Return TRUE if there is a job that has not been taken yet.
+ */
+Boolean preparerHasPending(const struct Preparer* preparer);
+
+/**
+ * Take the oldest job if it is done.
+ *
+ * \param image
+ * Receives the reference to the image, or NULL if the file could not be opened
+ * or the command has no file.
+ * \param prepared
+ * Set to TRUE if the image has been prepared by a worker.
+ * \return FALSE if the oldest job is still being prepared or there is none.
+ */
+Boolean preparerNext(struct Preparer* preparer, struct Command* command,
+        struct Image** image, Boolean* prepared);
+
+/**
+ * Hash an image on a worker, e.g. a file that was too large to be read
+ * into memory when it was prepared, or one read by io_uring. The state
+ * of the hash is HASH_PENDING until the worker is done.
+ */
+void preparerHash(struct Preparer* preparer, struct Image* image);
+
+#endif
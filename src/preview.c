@@ -0,0 +1,529 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "err_util.h"
+#include "file_util.h"
+#include "log_util.h"
+#include "preview.h"
+#include "stats.h"
+#include "time_util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_JPEG
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+#endif
+
+/**
+ * Rendering a preview on a worker. The image and the rendition belong to
+ * the event loop, the worker only reads source or the file and fills in
+ * result.
+ */
+struct PreviewJob {
+    struct Task task; // has to be the first member
+    struct Image* image;
+    struct Rendition* rendition;
+    struct Buffer* source; // contents of the image, NULL to read them from fd
+    int fd;
+    size_t size;
+    unsigned int maxWidth;
+    unsigned int maxHeight;
+    struct Buffer* result; // NULL if there is no preview
+    size_t resultSize;
+};
+
+#ifdef HAVE_JPEG
+
+// Weights of the resize are fixed-point numbers with this many fraction bits.
+#define WEIGHT_BITS 12
+#define WEIGHT_ONE (1u << WEIGHT_BITS)
+// Fraction bits that are kept of the horizontal pass.
+#define ROW_BITS 8
+#define CHANNELS 3
+
+typedef uint32_t Vector __attribute__((vector_size(32)));
+#define VECTOR_LANES (sizeof(Vector) / sizeof(uint32_t))
+
+/**
+ * Area-averaging downscale: every destination pixel is the mean of the
+ * source area it covers, with partially covered pixels weighted by the
+ * covered fraction. Source rows are pushed one at a time, so the decoder
+ * never has to hold the whole image.
+ */
+struct Resizer {
+    unsigned int srcWidth;
+    unsigned int srcHeight;
+    unsigned int dstWidth;
+    unsigned int dstHeight;
+    unsigned int taps;      // most source pixels that one destination pixel covers
+    unsigned int* xFirst;   // first source pixel of each destination pixel
+    unsigned int* xCount;   // number of source pixels of each destination pixel
+    uint32_t* xWeights;     // taps weights per destination pixel
+    uint32_t* row;          // the current source row, scaled horizontally
+    uint32_t* sums;         // the destination row being accumulated
+    unsigned int srcY;      // next source row
+    unsigned int dstY;      // destination row being accumulated
+    unsigned char* pixels;  // the destination image, dstWidth x dstHeight RGB
+};
+
+struct JpegError {
+    struct jpeg_error_mgr manager; // has to be the first member
+    jmp_buf escape;
+};
+
+/**
+ * Everything a render allocates, so it can be freed after a longjmp().
+ */
+struct RenderState {
+    struct JpegError error;
+    struct jpeg_decompress_struct decoder;
+    struct jpeg_compress_struct encoder;
+    Boolean decoderCreated;
+    Boolean encoderCreated;
+    struct Resizer resizer;
+    unsigned char* line;
+    unsigned char* encoded;
+    unsigned long encodedSize;
+    Boolean rendered;
+};
+
+/**
+ * The weight of [from, to) within the area [origin, origin + length).
+ * Weights are differences of rounded positions, so the weights of the
+ * pieces of an area add up to exactly WEIGHT_ONE.
+ */
+static uint32_t coverage(uint64_t from, uint64_t to, uint64_t origin, uint64_t length)
+{
+    return (uint32_t) (((to - origin) << WEIGHT_BITS) / length
+            - ((from - origin) << WEIGHT_BITS) / length);
+}
+
+static Boolean resizerInit(struct Resizer* r, unsigned int srcWidth, unsigned int srcHeight,
+        unsigned int dstWidth, unsigned int dstHeight)
+{
+    uint64_t start;
+    uint64_t end;
+    unsigned int x;
+    unsigned int sx;
+
+    r->srcWidth = srcWidth;
+    r->srcHeight = srcHeight;
+    r->dstWidth = dstWidth;
+    r->dstHeight = dstHeight;
+    r->taps = srcWidth / dstWidth + 2;
+    r->srcY = 0;
+    r->dstY = 0;
+    r->xFirst = malloc(dstWidth * sizeof(unsigned int));
+    r->xCount = malloc(dstWidth * sizeof(unsigned int));
+    r->xWeights = malloc((size_t) dstWidth * r->taps * sizeof(uint32_t));
+    r->row = malloc((size_t) dstWidth * CHANNELS * sizeof(uint32_t));
+    r->sums = calloc((size_t) dstWidth * CHANNELS, sizeof(uint32_t));
+    r->pixels = malloc((size_t) dstWidth * dstHeight * CHANNELS);
+    if (r->xFirst == NULL || r->xCount == NULL || r->xWeights == NULL
+            || r->row == NULL || r->sums == NULL || r->pixels == NULL) {
+        return FALSE;
+    }
+
+    // Destination pixel x covers [x * srcWidth, (x + 1) * srcWidth) and
+    // source pixel sx covers [sx * dstWidth, (sx + 1) * dstWidth).
+    for (x = 0; x < dstWidth; ++x) {
+        start = (uint64_t) x * srcWidth;
+        end = start + srcWidth;
+        r->xFirst[x] = start / dstWidth;
+        r->xCount[x] = 0;
+        for (sx = r->xFirst[x]; (uint64_t) sx * dstWidth < end && sx < srcWidth; ++sx) {
+            uint64_t from = (uint64_t) sx * dstWidth;
+            uint64_t to = from + dstWidth;
+            r->xWeights[(size_t) x * r->taps + r->xCount[x]] =
+                    coverage(from > start ? from : start, to < end ? to : end, start, srcWidth);
+            r->xCount[x]++;
+        }
+    }
+    return TRUE;
+}
+
+static void resizerFree(struct Resizer* r)
+{
+    free(r->xFirst);
+    free(r->xCount);
+    free(r->xWeights);
+    free(r->row);
+    free(r->sums);
+    free(r->pixels);
+}
+
+static void scaleRow(struct Resizer* r, const unsigned char* src)
+{
+    unsigned int x;
+    unsigned int k;
+
+    for (x = 0; x < r->dstWidth; ++x) {
+        const unsigned char* p = src + (size_t) r->xFirst[x] * CHANNELS;
+        const uint32_t* w = r->xWeights + (size_t) x * r->taps;
+        uint32_t red = 0;
+        uint32_t green = 0;
+        uint32_t blue = 0;
+        for (k = 0; k < r->xCount[x]; ++k, p += CHANNELS) {
+            red += w[k] * p[0];
+            green += w[k] * p[1];
+            blue += w[k] * p[2];
+        }
+        r->row[x * CHANNELS] = red >> (WEIGHT_BITS - ROW_BITS);
+        r->row[x * CHANNELS + 1] = green >> (WEIGHT_BITS - ROW_BITS);
+        r->row[x * CHANNELS + 2] = blue >> (WEIGHT_BITS - ROW_BITS);
+    }
+}
+
+/**
+ * sums += weight * row, the hot loop of the vertical pass.
+ * Written with vector types so that it compiles to SIMD instructions
+ * of whatever the target has, e.g. SSE2 or NEON.
+ */
+static void accumulateRow(uint32_t* sums, const uint32_t* row, uint32_t weight, size_t n)
+{
+    size_t i = 0;
+    Vector s;
+    Vector v;
+
+    for (; i + VECTOR_LANES <= n; i += VECTOR_LANES) {
+        memcpy(&s, sums + i, sizeof(s));
+        memcpy(&v, row + i, sizeof(v));
+        s += v * weight;
+        memcpy(sums + i, &s, sizeof(s));
+    }
+    for (; i < n; ++i) {
+        sums[i] += row[i] * weight;
+    }
+}
+
+static void emitRow(struct Resizer* r)
+{
+    size_t n = (size_t) r->dstWidth * CHANNELS;
+    unsigned char* out = r->pixels + (size_t) r->dstY * n;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        out[i] = (r->sums[i] + (1u << (WEIGHT_BITS + ROW_BITS - 1))) >> (WEIGHT_BITS + ROW_BITS);
+        r->sums[i] = 0;
+    }
+}
+
+/**
+ * Add the next source row to the destination rows it covers.
+ * Source row y covers [y * dstHeight, (y + 1) * dstHeight),
+ * destination row y covers [y * srcHeight, (y + 1) * srcHeight).
+ */
+static void resizerPushRow(struct Resizer* r, const unsigned char* src)
+{
+    uint64_t rowStart = (uint64_t) r->srcY * r->dstHeight;
+    uint64_t rowEnd = rowStart + r->dstHeight;
+
+    scaleRow(r, src);
+    while (r->dstY < r->dstHeight) {
+        uint64_t start = (uint64_t) r->dstY * r->srcHeight;
+        uint64_t end = start + r->srcHeight;
+        uint64_t from = rowStart > start ? rowStart : start;
+        uint64_t to = rowEnd < end ? rowEnd : end;
+        if (from < to) {
+            accumulateRow(r->sums, r->row, coverage(from, to, start, r->srcHeight),
+                    (size_t) r->dstWidth * CHANNELS);
+        }
+        if (rowEnd < end) {
+            break;
+        }
+        emitRow(r);
+        r->dstY++;
+    }
+    r->srcY++;
+}
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+    longjmp(((struct JpegError*) cinfo->err)->escape, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr cinfo)
+{
+    (void) cinfo; // warnings about slightly corrupt data are of no interest
+}
+
+/**
+ * Compute the size of the preview, keeping the aspect ratio.
+ * \return FALSE if the image fits already.
+ */
+static Boolean fitWithin(unsigned int width, unsigned int height,
+        unsigned int maxWidth, unsigned int maxHeight, unsigned int* fitWidth, unsigned int* fitHeight)
+{
+    if (width <= maxWidth && height <= maxHeight) {
+        return FALSE;
+    }
+    if ((uint64_t) width * maxHeight > (uint64_t) height * maxWidth) {
+        *fitWidth = maxWidth;
+        *fitHeight = ((uint64_t) height * maxWidth + width / 2) / width;
+    } else {
+        *fitHeight = maxHeight;
+        *fitWidth = ((uint64_t) width * maxHeight + height / 2) / height;
+    }
+    if (*fitWidth == 0) {
+        *fitWidth = 1;
+    }
+    if (*fitHeight == 0) {
+        *fitHeight = 1;
+    }
+    return TRUE;
+}
+
+/**
+ * Decode, scale and encode. libjpeg errors longjmp() out of here.
+ */
+static void render(struct RenderState* s, const char* data, size_t size,
+        unsigned int maxWidth, unsigned int maxHeight)
+{
+    struct jpeg_decompress_struct* decoder = &s->decoder;
+    struct jpeg_compress_struct* encoder = &s->encoder;
+    unsigned int width;
+    unsigned int height;
+    unsigned int n;
+    JSAMPROW line;
+
+    jpeg_create_decompress(decoder);
+    s->decoderCreated = TRUE;
+    jpeg_mem_src(decoder, (const unsigned char*) data, size);
+    jpeg_read_header(decoder, TRUE);
+    if (!fitWithin(decoder->image_width, decoder->image_height, maxWidth, maxHeight,
+                &width, &height)) {
+        return;
+    }
+    decoder->out_color_space = JCS_RGB;
+    decoder->dct_method = JDCT_IFAST;
+    decoder->do_fancy_upsampling = FALSE;
+    // The smallest scale of n/8 that still covers the preview.
+    for (n = 1; n <= 8; ++n) {
+        decoder->scale_num = n;
+        decoder->scale_denom = 8;
+        jpeg_calc_output_dimensions(decoder);
+        if (decoder->output_width >= width && decoder->output_height >= height) {
+            break;
+        }
+    }
+    jpeg_start_decompress(decoder);
+    if (decoder->output_components != CHANNELS
+            || !resizerInit(&s->resizer, decoder->output_width, decoder->output_height, width, height)) {
+        return;
+    }
+    s->line = malloc((size_t) decoder->output_width * CHANNELS);
+    if (s->line == NULL) {
+        return;
+    }
+    while (decoder->output_scanline < decoder->output_height) {
+        line = s->line;
+        jpeg_read_scanlines(decoder, &line, 1);
+        resizerPushRow(&s->resizer, s->line);
+    }
+    jpeg_finish_decompress(decoder);
+
+    encoder->err = &s->error.manager;
+    jpeg_create_compress(encoder);
+    s->encoderCreated = TRUE;
+    jpeg_mem_dest(encoder, &s->encoded, &s->encodedSize);
+    encoder->image_width = width;
+    encoder->image_height = height;
+    encoder->input_components = CHANNELS;
+    encoder->in_color_space = JCS_RGB;
+    jpeg_set_defaults(encoder);
+    jpeg_set_quality(encoder, PREVIEW_QUALITY, TRUE);
+    encoder->dct_method = JDCT_IFAST;
+    jpeg_start_compress(encoder, TRUE);
+    while (encoder->next_scanline < height) {
+        line = s->resizer.pixels + (size_t) encoder->next_scanline * width * CHANNELS;
+        jpeg_write_scanlines(encoder, &line, 1);
+    }
+    jpeg_finish_compress(encoder);
+    s->rendered = TRUE;
+}
+
+Boolean previewSupported(void)
+{
+    return TRUE;
+}
+
+Boolean previewRender(const char* data, size_t size, unsigned int maxWidth, unsigned int maxHeight,
+        struct Buffer** result, size_t* resultSize)
+{
+    struct RenderState* s = calloc(1, sizeof(struct RenderState));
+    char message[JMSG_LENGTH_MAX];
+    Boolean ok = FALSE;
+
+    if (s == NULL) {
+        errMsg("calloc preview");
+        return FALSE;
+    }
+    s->decoder.err = jpeg_std_error(&s->error.manager);
+    s->error.manager.error_exit = jpegErrorExit;
+    s->error.manager.output_message = jpegOutputMessage;
+    if (setjmp(s->error.escape) == 0) {
+        render(s, data, size, maxWidth, maxHeight);
+    } else {
+        s->error.manager.format_message((j_common_ptr) &s->decoder, message);
+        LOG_DEBUG("Cannot render a preview: %s.\n", message);
+        s->rendered = FALSE;
+    }
+    if (s->rendered) {
+        *result = bufferAcquire(s->encodedSize);
+        if (*result != NULL) {
+            memcpy((*result)->data, s->encoded, s->encodedSize);
+            *resultSize = s->encodedSize;
+            ok = TRUE;
+        }
+    }
+
+    if (s->encoderCreated) {
+        jpeg_destroy_compress(&s->encoder);
+    }
+    if (s->decoderCreated) {
+        jpeg_destroy_decompress(&s->decoder);
+    }
+    resizerFree(&s->resizer);
+    free(s->line);
+    free(s->encoded);
+    free(s);
+    return ok;
+}
+
+#else
+
+Boolean previewSupported(void)
+{
+    return FALSE;
+}
+
+Boolean previewRender(const char* data, size_t size, unsigned int maxWidth, unsigned int maxHeight,
+        struct Buffer** result, size_t* resultSize)
+{
+    (void) data;
+    (void) size;
+    (void) maxWidth;
+    (void) maxHeight;
+    (void) result;
+    (void) resultSize;
+    return FALSE;
+}
+
+#endif
+
+static void renderPreview(struct Task* task)
+{
+    struct PreviewJob* job = (struct PreviewJob*) task;
+    struct timespec started = monotonicNow();
+    struct Buffer* source = job->source;
+
+    if (source == NULL) {
+        source = bufferAcquire(job->size);
+        if (source != NULL && !readFully(job->fd, source->data, job->size, 0)) {
+            bufferUnref(source);
+            source = NULL;
+        }
+    }
+    if (source != NULL && previewRender(source->data, job->size, job->maxWidth, job->maxHeight,
+                &job->result, &job->resultSize)) {
+        statsAdd(&stats.previewsRendered, 1);
+        histogramRecordSince(&stats.previewRender, &started);
+    }
+    if (source != NULL && source != job->source) {
+        bufferUnref(source);
+    }
+}
+
+/**
+ * The rendition becomes READY or FAILED once the worker is done.
+ */
+static void completePreview(struct Task* task)
+{
+    struct PreviewJob* job = (struct PreviewJob*) task;
+    struct Rendition* rendition = job->rendition;
+
+    rendition->state = RENDITION_FAILED;
+    if (job->result != NULL) {
+        rendition->image = imageFromBuffer(job->result, job->resultSize, job->image->path);
+        if (rendition->image != NULL) {
+            rendition->image->id = job->image->id;
+            rendition->state = RENDITION_READY;
+            LOG_DEBUG("Preview of %s for %ux%u: %zu bytes instead of %lld.\n", job->image->path,
+                    rendition->maxWidth, rendition->maxHeight, job->resultSize,
+                    (long long) job->image->file.size);
+        }
+    }
+    if (job->source != NULL) {
+        bufferUnref(job->source);
+    }
+    imageUnref(job->image);
+    free(job);
+}
+
+struct Rendition* previewRequest(struct WorkerPool* pool, struct Image* image,
+        unsigned int maxWidth, unsigned int maxHeight)
+{
+    struct Rendition* rendition;
+    struct PreviewJob* job;
+
+    for (rendition = image->renditions; rendition != NULL; rendition = rendition->next) {
+        if (rendition->maxWidth == maxWidth && rendition->maxHeight == maxHeight) {
+            return rendition;
+        }
+    }
+    rendition = calloc(1, sizeof(struct Rendition));
+    if (rendition == NULL) {
+        errMsg("calloc rendition");
+        return NULL;
+    }
+    rendition->maxWidth = maxWidth;
+    rendition->maxHeight = maxHeight;
+    rendition->next = image->renditions;
+    image->renditions = rendition;
+    if (image->growing || image->file.size == 0) {
+        rendition->state = RENDITION_FAILED;
+        return rendition;
+    }
+    job = calloc(1, sizeof(struct PreviewJob));
+    if (job == NULL) {
+        errMsg("calloc preview job");
+        rendition->state = RENDITION_FAILED;
+        return rendition;
+    }
+    rendition->state = RENDITION_PENDING;
+    job->task.run = renderPreview;
+    job->task.complete = completePreview;
+    // The reference keeps the file open and the rendition alive.
+    job->image = imageRef(image);
+    job->rendition = rendition;
+    job->source = image->buffer != NULL ? bufferRef(image->buffer) : NULL;
+    job->fd = image->file.fd;
+    job->size = image->file.size;
+    job->maxWidth = maxWidth;
+    job->maxHeight = maxHeight;
+    workerPoolSubmit(pool, &job->task);
+    return rendition;
+}
@@ -0,0 +1,74 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PREVIEW_H_
+#define PREVIEW_H_
+
+#include "boolean_util.h"
+#include "buffer_pool.h"
+#include "image.h"
+#include "worker_pool.h"
+
+#include <stddef.h>
+
+/*
+ * Previews are JPEG images scaled down to the screen of a client, see
+ * CAP_PREVIEW in protocol.h. The JPEG is decoded with the scaled DCT of
+ * libjpeg, which skips most of the work for large reductions, to the
+ * smallest size of n/8 that still covers the screen. The rest of the way
+ * is an area-averaging resize with fixed-point weights, whose vertical
+ * pass runs on SIMD vectors. Without libjpeg at build time, previews are
+ * not supported.
+ */
+
+#define PREVIEW_QUALITY 85
+#define MAX_PREVIEW_DIMENSION 8192
+
+/**
+ * \return TRUE if the server was built with libjpeg.
+ */
+Boolean previewSupported(void);
+
+/**
+ * Scale the JPEG in data down to fit into maxWidth x maxHeight and encode
+ * it as JPEG again. May be called from any thread.
+ *
+ * \param result Receives a pooled buffer with the preview.
+ * \param resultSize Receives the length of the preview.
+ * \return FALSE if data is no JPEG that can be decoded, or if it already
+ *         fits, in which case no preview is needed.
+ */
+Boolean previewRender(const char* data, size_t size, unsigned int maxWidth, unsigned int maxHeight,
+        struct Buffer** result, size_t* resultSize);
+
+/**
+ * Return the rendition of image for maxWidth x maxHeight. If there is none
+ * yet, it is created in state RENDITION_PENDING and rendered on pool.
+ * It becomes READY or FAILED when the event loop completes the task.
+ * Belongs to the event loop.
+ *
+ * \return the rendition or NULL if it cannot be created.
+ */
+struct Rendition* previewRequest(struct WorkerPool* pool, struct Image* image,
+        unsigned int maxWidth, unsigned int maxHeight);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "err_util.h"
+#include "log_util.h"
+#include "producer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Producer* producerCreate(int epollFd, int fd)
+{
+    struct Producer* producer = calloc(1, sizeof(struct Producer));
+    if (producer == NULL) {
+        errMsg("calloc producer");
+        return NULL;
+    }
+    producer->source.type = SOURCE_PRODUCER;
+    producer->source.fd = fd;
+    addEventSource(epollFd, &producer->source, EPOLLIN | EPOLLRDHUP);
+    return producer;
+}
+
+void producerDestroy(struct Producer* producer)
+{
+    if (close(producer->source.fd) == -1) {
+        errMsg("close");
+    }
+    free(producer);
+}
+
+/**
+ * Copy the descriptors passed with the message into fds.
+ * \return the number of descriptors.
+ */
+static size_t takeDescriptors(struct msghdr* msg, int* fds)
+{
+    struct cmsghdr* cmsg;
+    size_t count = 0;
+    size_t n;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count + n > MAX_DATAGRAM_FDS) {
+            n = MAX_DATAGRAM_FDS - count; // cannot happen, the buffer has no room for more
+        }
+        memcpy(fds + count, CMSG_DATA(cmsg), n * sizeof(int));
+        count += n;
+    }
+    return count;
+}
+
+ssize_t producerReceive(struct Producer* producer, struct Command* commands)
+{
+    char buffer[PRODUCER_DATAGRAM_SIZE + 1];
+    union {
+        char buf[CMSG_SPACE(MAX_DATAGRAM_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    struct timespec received;
+    int fds[MAX_DATAGRAM_FDS];
+    size_t numFds;
+    size_t nextFd = 0;
+    size_t count = 0;
+    size_t length;
+    char* line;
+    char* end;
+    ssize_t n;
+
+    iov.iov_base = buffer;
+    iov.iov_len = PRODUCER_DATAGRAM_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do {
+        n = recvmsg(producer->source.fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        errMsg("recvmsg");
+        return -1;
+    }
+    numFds = takeDescriptors(&msg, fds);
+    if (n == 0 && numFds == 0) {
+        return -1; // end of file
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (nextFd = 0; nextFd < numFds; ++nextFd) {
+            close(fds[nextFd]);
+        }
+        return PRODUCER_TRUNCATED;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &received);
+
+    buffer[n] = '\0';
+    for (line = buffer; line < buffer + n; line = end + 1) {
+        end = strchrnul(line, '\n');
+        *end = '\0';
+        length = end - line;
+        if (length == 0) {
+            continue;
+        }
+        if (length >= MAX_COMMAND_LENGTH || count == MAX_DATAGRAM_COMMANDS) {
+            LOG_WARN("Ignoring command %.32s... of producer.\n", line);
+            if (line[0] == FD_PREFIX && nextFd < numFds) {
+                close(fds[nextFd++]);
+            }
+            continue;
+        }
+        commands[count].fd = -1;
+        if (line[0] == FD_PREFIX) {
+            if (nextFd == numFds) {
+                LOG_WARN("No file descriptor was passed for %s.\n", line);
+                continue;
+            }
+            commands[count].fd = fds[nextFd++];
+        }
+        memcpy(commands[count].line, line, length + 1);
+        commands[count].received = received;
+        count++;
+    }
+
+    // Close the descriptors that no command asked for.
+    for (; nextFd < numFds; ++nextFd) {
+        close(fds[nextFd]);
+    }
+    return count;
+}
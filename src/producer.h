@@ -0,0 +1,85 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PRODUCER_H_
+#define PRODUCER_H_
+
+#include "boolean_util.h"
+#include "command_queue.h"
+#include "event_util.h"
+
+#include <sys/types.h>
+
+/*
+ * Producers, e.g. libipho-core, may send commands through a local
+ * SOCK_SEQPACKET socket instead of the FIFO. Each datagram holds one or
+ * more commands with the same syntax as the lines of the FIFO, separated
+ * by newlines. A command of the form "=name" stands for an image file that
+ * the producer has opened already. The descriptors of these files are
+ * attached to the datagram with SCM_RIGHTS, in the order of the commands.
+ */
+
+#define PRODUCER_DATAGRAM_SIZE 16384
+#define MAX_DATAGRAM_COMMANDS 128
+#define MAX_DATAGRAM_FDS 64
+#define FD_PREFIX '='
+
+// producerReceive() dropped a datagram that did not fit into its buffers.
+#define PRODUCER_TRUNCATED (-2)
+
+/**
+ * The connection of a single producer to the command socket.
+ */
+struct Producer {
+    struct EventSource source; // has to be the first member
+    Boolean closed;            // destroyed by the event loop once the current events are handled
+    struct Producer* next;
+};
+
+/**
+ * Wrap the accepted socket fd into a producer and register it
+ * with the event loop epollFd. fd has to be non-blocking.
+ *
+ * \return the producer or NULL if it could not be created.
+ */
+struct Producer* producerCreate(int epollFd, int fd);
+
+/**
+ * Close the socket and free the producer.
+ */
+void producerDestroy(struct Producer* producer);
+
+/**
+ * Receive the next datagram of the producer and parse its commands.
+ * Every command with FD_PREFIX gets one of the passed descriptors,
+ * descriptors that are left over are closed.
+ *
+ * \param commands
+ * Has to provide room for MAX_DATAGRAM_COMMANDS commands.
+ * \return
+ * The number of commands stored, 0 if no datagram is pending,
+ * PRODUCER_TRUNCATED if the datagram was larger than PRODUCER_DATAGRAM_SIZE
+ * or carried more than MAX_DATAGRAM_FDS descriptors and has been dropped,
+ * -1 if the producer has closed the connection or an error occurred.
+ */
+ssize_t producerReceive(struct Producer* producer, struct Command* commands);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "protocol.h"
+
+#include <string.h>
+
+void encodeUint64(uint64_t value, char* bytes)
+{
+    int i;
+    for (i = 0; i < 8; ++i) {
+        bytes[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+uint64_t decodeUint64(const char* bytes)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 7; i >= 0; --i) {
+        value = (value << 8) | (unsigned char) bytes[i];
+    }
+    return value;
+}
+
+uint16_t decodeUint16(const char* bytes)
+{
+    return (unsigned char) bytes[0] | ((unsigned char) bytes[1] << 8);
+}
+
+static void encodeUint32(uint32_t value, char* bytes)
+{
+    int i;
+    for (i = 0; i < 4; ++i) {
+        bytes[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+static uint32_t decodeUint32(const char* bytes)
+{
+    uint32_t value = 0;
+    int i;
+    for (i = 3; i >= 0; --i) {
+        value = (value << 8) | (unsigned char) bytes[i];
+    }
+    return value;
+}
+
+void encodeHello(const struct Hello* hello, char* buffer)
+{
+    memcpy(buffer, PROTOCOL_MAGIC, 4);
+    buffer[4] = (char) hello->version;
+    buffer[5] = (char) hello->capabilities;
+    buffer[6] = (char) (hello->window & 0xff);
+    buffer[7] = (char) (hello->window >> 8);
+}
+
+Boolean decodeHello(const char* buffer, struct Hello* hello)
+{
+    if (memcmp(buffer, PROTOCOL_MAGIC, 4) != 0) {
+        return FALSE;
+    }
+    hello->version = (unsigned char) buffer[4];
+    hello->capabilities = (unsigned char) buffer[5];
+    hello->window = (unsigned char) buffer[6] | ((unsigned char) buffer[7] << 8);
+    return TRUE;
+}
+
+void encodeMetadata(const struct ImageMetadata* metadata, char* buffer)
+{
+    memset(buffer, 0, METADATA_PAYLOAD_LENGTH);
+    buffer[0] = (char) (metadata->width & 0xff);
+    buffer[1] = (char) (metadata->width >> 8);
+    buffer[2] = (char) (metadata->height & 0xff);
+    buffer[3] = (char) (metadata->height >> 8);
+    buffer[4] = (char) metadata->orientation;
+    memcpy(buffer + 8, metadata->captureTime, strlen(metadata->captureTime));
+}
+
+void encodeFrameHeader(const struct FrameHeader* frame, char* buffer)
+{
+    buffer[0] = (char) frame->type;
+    buffer[1] = (char) frame->flags;
+    buffer[2] = 0;
+    buffer[3] = 0;
+    encodeUint32(frame->id, buffer + 4);
+    encodeUint64(frame->length, buffer + 8);
+}
+
+void decodeFrameHeader(const char* buffer, struct FrameHeader* frame)
+{
+    frame->type = (unsigned char) buffer[0];
+    frame->flags = (unsigned char) buffer[1];
+    frame->id = decodeUint32(buffer + 4);
+    frame->length = decodeUint64(buffer + 8);
+}
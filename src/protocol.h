@@ -0,0 +1,220 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include "boolean_util.h"
+#include "jpeg_meta.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Wire protocol between the server and the Android app.
+ *
+ * Version 1 (the original protocol, used if the client sends nothing):
+ *   image taken:  1 byte  COMMAND_IMAGE_TAKEN
+ *   image data:   1 byte  COMMAND_IMAGE_DATA, 4 bytes length as
+ *                 produced by intToByteArray(), the file contents
+ *   heartbeat:    1 byte  COMMAND_HEARBEAT_PROBE on the heartbeat port
+ *
+ * Version 2 is negotiated by the client. Right after connecting to the
+ * data port it sends a hello:
+ *   4 bytes magic "IPHO", 1 byte version, 1 byte capabilities,
+ *   2 bytes window (little endian)
+ * The server answers with a hello of the same layout that carries the
+ * accepted version, the capabilities both sides support and the window.
+ * Version 1 clients never send anything, so the server does not wait for
+ * them: it starts with version 1 right away and switches to version 2 if
+ * the hello arrives before it has sent anything. Otherwise the hello is
+ * ignored and the connection stays at version 1. The client tells by the
+ * first byte it receives, which is the 'I' of the hello only in version 2.
+ * The server remembers the hosts that sent a hello. Their later
+ * connections wait up to NEGOTIATION_TIMEOUT_MS for the hello before
+ * anything is sent, so a screen that reconnects gets version 2.
+ *
+ * Afterwards every message in either direction is a frame:
+ *   1 byte type, 1 byte flags, 2 bytes reserved,
+ *   4 bytes message id, 8 bytes payload length, payload
+ * All integers are little endian. Images carry their image id as message id.
+ * With CAP_ACK, the client acknowledges every displayed image with a
+ * FRAME_ACK carrying its id, and the server keeps at most window images
+ * unacknowledged. A client that owes an acknowledgement, or the answer to
+ * an offer, for ACK_TIMEOUT_MS after the image has been sent is
+ * disconnected, so it cannot hold the window closed forever.
+ *
+ * With CAP_DEDUP, the server first sends a FRAME_IMAGE_OFFER whose payload
+ * is the 64-bit xxHash of the file followed by its 64-bit size. The client
+ * answers with FRAME_HAVE if it already holds an image with that hash,
+ * which also counts as acknowledgement, or with FRAME_WANT, upon which the
+ * server sends the FRAME_IMAGE_DATA as usual.
+ *
+ * With CAP_CHUNKED, an image is not sent as one FRAME_IMAGE_DATA. Instead a
+ * FRAME_IMAGE_START, whose payload is the 64-bit size of the image, is
+ * followed by FRAME_IMAGE_CHUNK frames with the same id that carry at most
+ * CHUNK_SIZE bytes of the image each. The last chunk has FRAME_FLAG_LAST set.
+ * Other frames, in particular FRAME_IMAGE_TAKEN, may appear between the
+ * chunks, so they do not wait until a large image has been transferred.
+ * If the image is still being written, FRAME_FLAG_GROWING is set on the
+ * FRAME_IMAGE_START and its size is 0. Chunks then follow as the file grows,
+ * and the one with FRAME_FLAG_LAST, possibly empty, marks its end.
+ *
+ * With CAP_PREVIEW, the client may send a FRAME_PREVIEW_SIZE whose payload
+ * is the 16-bit width and height of its screen. Every JPEG image larger
+ * than that is then preceded by a FRAME_IMAGE_PREVIEW with the same id,
+ * whose payload is a JPEG scaled down to fit the screen. The original
+ * follows as usual, unless FRAME_FLAG_PREVIEW_ONLY was set on the
+ * FRAME_PREVIEW_SIZE. The preview then stands for the image: it is
+ * acknowledged and counted in the window instead, but never offered. A size of
+ * 0 x 0 turns previews off again. Images that cannot be scaled down are
+ * sent without a preview.
+ *
+ * With CAP_METADATA, the frames of a JPEG image, or its offer, are preceded
+ * by a FRAME_IMAGE_METADATA with the same id, so the screen can lay out the
+ * image while it is still being transferred. Its payload is:
+ *   2 bytes width, 2 bytes height, 1 byte EXIF orientation (0 if unknown),
+ *   3 bytes reserved, 20 bytes capture time "YYYY:MM:DD HH:MM:SS" padded
+ *   with zero bytes (all zero if unknown)
+ * Width and height are those of the stored pixels, before the orientation
+ * is applied. Files that are no JPEG, or that are still growing when they
+ * are sent, have no metadata frame.
+ *
+ * With CAP_RESUME, which requires CAP_CHUNKED, a client whose connection
+ * broke during a transfer may continue it after reconnecting. Together with
+ * its hello, without waiting for the answer, it sends a FRAME_RESUME with
+ * the id of the interrupted image, whose payload is the 64-bit number of
+ * bytes it has received and the 64-bit size from the FRAME_IMAGE_START.
+ * A request that arrives later may find the image replayed from its start
+ * already. If the server still holds that
+ * image, it sends a FRAME_IMAGE_RESUME instead of the FRAME_IMAGE_START,
+ * with the size and the offset as payload, followed by the chunks from
+ * that offset on. Metadata and offers are not repeated. Otherwise the
+ * request is ignored and the client has to discard what it received.
+ * Image ids start at a random value, so they do not repeat after a
+ * restart of the server.
+ */
+
+#define COMMAND_IMAGE_TAKEN 1
+#define COMMAND_IMAGE_DATA  2
+#define COMMAND_HEARBEAT_PROBE 3
+
+#define PROTOCOL_MAGIC "IPHO"
+#define PROTOCOL_VERSION 2
+#define HELLO_LENGTH 8
+#define FRAME_HEADER_LENGTH 16
+#define NEGOTIATION_TIMEOUT_MS 300
+#define ACK_TIMEOUT_MS 10000
+#define MAX_WINDOW 16
+
+// Frame types sent by the server
+#define FRAME_IMAGE_TAKEN COMMAND_IMAGE_TAKEN
+#define FRAME_IMAGE_DATA  COMMAND_IMAGE_DATA
+#define FRAME_IMAGE_OFFER 4
+#define FRAME_IMAGE_START 5
+#define FRAME_IMAGE_CHUNK 6
+#define FRAME_IMAGE_PREVIEW 7
+#define FRAME_IMAGE_METADATA 8
+#define FRAME_IMAGE_RESUME 9
+
+// Frame types sent by the client
+#define FRAME_ACK  0x81
+#define FRAME_HAVE 0x82
+#define FRAME_WANT 0x83
+#define FRAME_PREVIEW_SIZE 0x84
+#define FRAME_RESUME 0x85
+
+// Frame flags
+#define FRAME_FLAG_LAST    0x01
+#define FRAME_FLAG_GROWING 0x02
+#define FRAME_FLAG_PREVIEW_ONLY 0x04
+
+#define OFFER_PAYLOAD_LENGTH 16
+#define START_PAYLOAD_LENGTH 8
+#define PREVIEW_SIZE_PAYLOAD_LENGTH 4
+#define METADATA_PAYLOAD_LENGTH 28
+#define RESUME_PAYLOAD_LENGTH 16
+#define CHUNK_SIZE (64 * 1024)
+
+// Capabilities announced in the hello
+#define CAP_ACK   0x01
+#define CAP_DEDUP 0x02
+#define CAP_CHUNKED 0x04
+#define CAP_PREVIEW 0x08
+#define CAP_METADATA 0x10
+#define CAP_RESUME 0x20
+
+struct Hello {
+    uint8_t version;
+    uint8_t capabilities;
+    uint16_t window;
+};
+
+struct FrameHeader {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+    uint64_t length;
+};
+
+/**
+ * Store value as 8 bytes in little endian order.
+ */
+void encodeUint64(uint64_t value, char* bytes);
+
+/**
+ * Read 8 bytes in little endian order.
+ */
+uint64_t decodeUint64(const char* bytes);
+
+/**
+ * Read 2 bytes in little endian order.
+ */
+uint16_t decodeUint16(const char* bytes);
+
+/**
+ * Write the hello into the HELLO_LENGTH bytes at buffer.
+ */
+void encodeHello(const struct Hello* hello, char* buffer);
+
+/**
+ * Parse the HELLO_LENGTH bytes at buffer.
+ * \return TRUE if the magic matches, FALSE otherwise.
+ */
+Boolean decodeHello(const char* buffer, struct Hello* hello);
+
+/**
+ * Write the payload of a FRAME_IMAGE_METADATA into the
+ * METADATA_PAYLOAD_LENGTH bytes at buffer.
+ */
+void encodeMetadata(const struct ImageMetadata* metadata, char* buffer);
+
+/**
+ * Write the frame header into the FRAME_HEADER_LENGTH bytes at buffer.
+ */
+void encodeFrameHeader(const struct FrameHeader* frame, char* buffer);
+
+/**
+ * Parse the FRAME_HEADER_LENGTH bytes at buffer.
+ */
+void decodeFrameHeader(const char* buffer, struct FrameHeader* frame);
+
+#endif
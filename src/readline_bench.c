@@ -0,0 +1,138 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Microbenchmark that compares readLine() with the buffered LineReader.
+ * A writer thread pushes bursts of file names into a pipe, just like
+ * libipho-core does with the FIFO, and the main thread parses them.
+ */
+
+#include "command_queue.h"
+#include "err_util.h"
+#include "file_util.h"
+#include "net_util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_NUM_LINES 200000
+#define BURST_LENGTH 32
+
+struct WriterArgs {
+    int fd;
+    long numLines;
+};
+
+static void* writeLines(void* argsVoid)
+{
+    struct WriterArgs* args = argsVoid;
+    char burst[BURST_LENGTH * 64];
+    long written = 0;
+
+    while (written < args->numLines) {
+        size_t length = 0;
+        int i;
+        for (i = 0; i < BURST_LENGTH && written < args->numLines; ++i, ++written) {
+            if (written % 8 == 0) {
+                length += sprintf(burst + length, "+\n");
+            } else {
+                length += sprintf(burst + length, "/home/pi/photos/IMG_%06ld.JPG\n", written);
+            }
+        }
+        if (!writeFully(args->fd, burst, length)) {
+            errExit("write pipe");
+        }
+    }
+    close(args->fd);
+    return NULL;
+}
+
+static double secondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Parse numLines lines with either readLine() or the LineReader
+ * and print the time per line.
+ */
+static void runBenchmark(const char* name, Boolean buffered, long numLines)
+{
+    int pipeFds[2];
+    pthread_t writer;
+    struct WriterArgs args;
+    struct LineReader reader;
+    char line[MAX_COMMAND_LENGTH];
+    const char* view;
+    struct timespec start;
+    long lines = 0;
+    unsigned long checksum = 0;
+    ssize_t res;
+
+    if (pipe(pipeFds) == -1) {
+        errExit("pipe");
+    }
+    args.fd = pipeFds[1];
+    args.numLines = numLines;
+    lineReaderInit(&reader, pipeFds[0], MAX_COMMAND_LENGTH - 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int perr = pthread_create(&writer, NULL, writeLines, &args);
+    if (perr != 0) {
+        errExitEN(perr, "pthread_create");
+    }
+    for (;;) {
+        if (buffered) {
+            res = lineReaderNext(&reader, &view);
+        } else {
+            res = readLine(pipeFds[0], line, sizeof(line));
+            view = line;
+        }
+        if (res < 0) {
+            break;
+        }
+        checksum += res > 0 ? (unsigned char) view[res - 1] : 0;
+        ++lines;
+    }
+    double elapsed = secondsSince(&start);
+    pthread_join(writer, NULL);
+    close(pipeFds[0]);
+
+    printf("%-12s %8ld lines  %8.3f ms  %8.1f ns/line  (checksum %lu)\n",
+            name, lines, elapsed * 1e3, elapsed * 1e9 / lines, checksum);
+}
+
+int main(int argc, char* argv[])
+{
+    long numLines = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_NUM_LINES;
+    if (numLines <= 0) {
+        fprintf(stderr, "Usage: %s [num_lines]\n", argv[0]);
+        return 1;
+    }
+    runBenchmark("readLine", FALSE, numLines);
+    runBenchmark("LineReader", TRUE, numLines);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "err_util.h"
+#include "replay_ring.h"
+
+#include <stdlib.h>
+
+void replayRingInit(struct ReplayRing* ring, size_t capacity, size_t maxBytes)
+{
+    ring->capacity = capacity;
+    ring->start = 0;
+    ring->count = 0;
+    ring->maxBytes = maxBytes;
+    ring->bytes = 0;
+    ring->images = NULL;
+    if (capacity > 0) {
+        ring->images = calloc(capacity, sizeof(struct Image*));
+        if (ring->images == NULL) {
+            errExit("calloc replay ring");
+        }
+    }
+}
+
+static struct Image* imageAt(struct ReplayRing* ring, size_t i)
+{
+    return ring->images[(ring->start + i) % ring->capacity];
+}
+
+static void evictOldest(struct ReplayRing* ring)
+{
+    struct Image* image = ring->images[ring->start];
+    ring->images[ring->start] = NULL;
+    ring->start = (ring->start + 1) % ring->capacity;
+    ring->count--;
+    ring->bytes -= image->file.size;
+    imageUnref(image);
+}
+
+void replayRingAdd(struct ReplayRing* ring, struct Image* image)
+{
+    size_t i;
+
+    if (ring->capacity == 0 || (size_t) image->file.size > ring->maxBytes) {
+        return;
+    }
+    for (i = 0; i < ring->count; ++i) {
+        if (imageAt(ring, i) == image) {
+            return;
+        }
+    }
+    while (ring->count == ring->capacity || ring->bytes + image->file.size > ring->maxBytes) {
+        evictOldest(ring);
+    }
+    ring->images[(ring->start + ring->count) % ring->capacity] = imageRef(image);
+    ring->count++;
+    ring->bytes += image->file.size;
+}
+
+struct Image* replayRingFind(struct ReplayRing* ring, const char* path)
+{
+    size_t i;
+
+    // Search from the newest image, that is the one most likely asked for.
+    for (i = ring->count; i > 0; --i) {
+        struct Image* image = imageAt(ring, i - 1);
+        if (imageMatchesFile(image, path)) {
+            return image;
+        }
+    }
+    return NULL;
+}
+
+struct Image* replayRingFindId(struct ReplayRing* ring, uint32_t id)
+{
+    size_t i;
+
+    for (i = ring->count; i > 0; --i) {
+        struct Image* image = imageAt(ring, i - 1);
+        if (image->id == id) {
+            return image;
+        }
+    }
+    return NULL;
+}
+
+size_t replayRingLatest(struct ReplayRing* ring, struct Image** images, size_t k)
+{
+    size_t n = 0;
+    size_t i;
+
+    for (i = ring->count; i > 0 && n < k; --i) {
+        struct Image* image = imageAt(ring, i - 1);
+        if (image->data == NULL && !imageFileUnchanged(image)) {
+            continue;
+        }
+        images[n++] = image;
+    }
+    // Newest first so far.
+    for (i = 0; i < n / 2; ++i) {
+        struct Image* tmp = images[i];
+        images[i] = images[n - 1 - i];
+        images[n - 1 - i] = tmp;
+    }
+    return n;
+}
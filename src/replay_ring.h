@@ -0,0 +1,81 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPLAY_RING_H_
+#define REPLAY_RING_H_
+
+#include "image.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The most recently forwarded images, kept in memory so that a screen
+ * that (re)connects can be shown the latest image right away.
+ *
+ * The ring holds a reference to each image, which keeps its file open and
+ * its contents in memory if they were read when the image was prepared.
+ * The ring never reads a file itself, so adding an image does not block
+ * the event loop. It is bounded both by the number of images and by their
+ * total size. The oldest images are evicted first.
+ */
+struct ReplayRing {
+    struct Image** images;
+    size_t capacity;
+    size_t start;    // index of the oldest image
+    size_t count;
+    size_t maxBytes;
+    size_t bytes;
+};
+
+/**
+ * Allocate a ring for up to capacity images with a total size of
+ * up to maxBytes. A capacity of 0 disables the ring.
+ */
+void replayRingInit(struct ReplayRing* ring, size_t capacity, size_t maxBytes);
+
+/**
+ * Add the image as most recent one. Images larger than maxBytes are not added.
+ */
+void replayRingAdd(struct ReplayRing* ring, struct Image* image);
+
+/**
+ * Return the image in the ring that was read from path, if path still
+ * names the same unchanged file, or NULL. No reference is acquired.
+ */
+struct Image* replayRingFind(struct ReplayRing* ring, const char* path);
+
+/**
+ * Return the image in the ring with the given id, or NULL.
+ * No reference is acquired.
+ */
+struct Image* replayRingFindId(struct ReplayRing* ring, uint32_t id);
+
+/**
+ * Store up to k of the most recent images into images,
+ * oldest first. No references are acquired. Images that are not held in
+ * memory and whose file has been modified since are left out.
+ *
+ * \return the number of images stored.
+ */
+size_t replayRingLatest(struct ReplayRing* ring, struct Image** images, size_t k);
+
+#endif
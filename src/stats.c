@@ -0,0 +1,337 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "buffer_pool.h"
+#include "log_util.h"
+#include "stats.h"
+#include "time_util.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+struct Stats stats;
+
+static struct CommandQueue* commandQueue = NULL;
+
+struct CounterEntry {
+    const char* name;
+    _Atomic uint64_t* counter;
+};
+
+struct HistogramEntry {
+    const char* name;
+    struct Histogram* histogram;
+};
+
+static const struct CounterEntry counters[] = {
+    { "fifo_commands", &stats.fifoCommands },
+    { "images_sent", &stats.imagesSent },
+    { "bytes_sent", &stats.bytesSent },
+    { "images_deduplicated", &stats.imagesDeduplicated },
+    { "bytes_saved", &stats.bytesSaved },
+    { "transfers_resumed", &stats.transfersResumed },
+    { "bytes_resumed", &stats.bytesResumed },
+    { "images_coalesced", &stats.imagesCoalesced },
+    { "data_connects", &stats.dataConnects },
+    { "data_disconnects", &stats.dataDisconnects },
+    { "heartbeat_connects", &stats.heartbeatConnects },
+    { "heartbeat_disconnects", &stats.heartbeatDisconnects },
+    { "heartbeats_sent", &stats.heartbeatsSent },
+    { "lag_ms", &stats.lagMs },
+    { "previews_rendered", &stats.previewsRendered },
+    { "previews_sent", &stats.previewsSent },
+    { "worker_threads", &stats.workerThreads },
+    { "tasks_stolen", &stats.tasksStolen },
+};
+
+static const struct HistogramEntry histograms[] = {
+    { "fifo_receive_us", &stats.fifoReceive },
+    { "queue_wait_us", &stats.queueWait },
+    { "file_read_us", &stats.fileRead },
+    { "send_us", &stats.send },
+    { "lag_us", &stats.lag },
+    { "heartbeat_rtt_us", &stats.heartbeatRtt },
+    { "preview_render_us", &stats.previewRender },
+    { "task_wait_us", &stats.taskWait },
+    { "prepare_open_us", &stats.prepareOpen },
+    { "prepare_read_us", &stats.prepareRead },
+    { "prepare_hash_us", &stats.prepareHash },
+    { "prepare_metadata_us", &stats.prepareMetadata },
+};
+
+#define NUM_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+#define NUM_HISTOGRAMS (sizeof(histograms) / sizeof(histograms[0]))
+
+static size_t bucketIndex(uint64_t value)
+{
+    unsigned int exponent;
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    if (value >> HISTOGRAM_MAX_EXPONENT) {
+        value = ((uint64_t) 1 << HISTOGRAM_MAX_EXPONENT) - 1;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + ((value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * Largest value that is counted in the bucket.
+ */
+static uint64_t bucketEnd(size_t index)
+{
+    size_t group = index / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    unsigned int shift;
+
+    if (group == 0) {
+        return index;
+    }
+    shift = group - 1;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogramRecord(struct Histogram* histogram, uint64_t value)
+{
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&histogram->counts[bucketIndex(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void histogramRecordSince(struct Histogram* histogram, const struct timespec* start)
+{
+    struct timespec now = monotonicNow();
+    int64_t micros = (int64_t) (now.tv_sec - start->tv_sec) * 1000000
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+    histogramRecord(histogram, micros > 0 ? (uint64_t) micros : 0);
+}
+
+uint64_t histogramPercentile(const struct Histogram* histogram, double percent)
+{
+    uint64_t total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    uint64_t rank;
+    uint64_t seen = 0;
+    size_t i;
+
+    if (total == 0) {
+        return 0;
+    }
+    rank = (uint64_t) (percent / 100.0 * total + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t end = bucketEnd(i);
+            return end < max ? end : max;
+        }
+    }
+    return max;
+}
+
+void statsSetCommandQueue(struct CommandQueue* queue)
+{
+    commandQueue = queue;
+}
+
+int readMemoryUsage(long* residentKb, long* peakKb)
+{
+    char line[256];
+    int found = 0;
+    FILE* status = fopen("/proc/self/status", "r");
+
+    if (status == NULL) {
+        return -1;
+    }
+    while (found < 2 && fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", residentKb) == 1
+                || sscanf(line, "VmHWM: %ld kB", peakKb) == 1) {
+            found++;
+        }
+    }
+    fclose(status);
+    return found == 2 ? 0 : -1;
+}
+
+/**
+ * Appends to a fixed buffer and silently truncates.
+ */
+struct Report {
+    char* buffer;
+    size_t size;
+    size_t length;
+};
+
+static void append(struct Report* report, const char* format, ...)
+{
+    va_list args;
+    int n;
+
+    if (report->length + 1 >= report->size) {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(report->buffer + report->length, report->size - report->length, format, args);
+    va_end(args);
+    if (n > 0) {
+        report->length += (size_t) n;
+        if (report->length >= report->size) {
+            report->length = report->size - 1;
+        }
+    }
+}
+
+/**
+ * Add a number to the report, as "name value" line or as JSON member.
+ */
+static void appendValue(struct Report* report, StatsFormat format, Boolean* first,
+        const char* name, unsigned long long value)
+{
+    if (format == STATS_JSON) {
+        append(report, "%s\"%s\": %llu", *first ? "" : ", ", name, value);
+    } else {
+        append(report, "%s %llu\n", name, value);
+    }
+    *first = FALSE;
+}
+
+static void appendHistogram(struct Report* report, StatsFormat format, Boolean* first,
+        const char* name, const struct Histogram* histogram)
+{
+    uint64_t total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    unsigned long long mean = total > 0 ? sum / total : 0;
+    unsigned long long p50 = histogramPercentile(histogram, 50);
+    unsigned long long p90 = histogramPercentile(histogram, 90);
+    unsigned long long p99 = histogramPercentile(histogram, 99);
+    unsigned long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    if (format == STATS_JSON) {
+        append(report, "%s\"%s\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, "
+                "\"p90\": %llu, \"p99\": %llu, \"max\": %llu}", *first ? "" : ", ", name,
+                (unsigned long long) total, mean, p50, p90, p99, max);
+    } else {
+        append(report, "%s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu\n", name,
+                (unsigned long long) total, mean, p50, p90, p99, max);
+    }
+    *first = FALSE;
+}
+
+size_t statsFormat(char* buffer, size_t size, StatsFormat format)
+{
+    struct Report report = { buffer, size, 0 };
+    struct BufferPoolStats pool;
+    struct CommandQueueStats queue;
+    long residentKb;
+    long peakKb;
+    Boolean first = TRUE;
+    size_t i;
+
+    if (size == 0) {
+        return 0;
+    }
+    buffer[0] = '\0';
+    if (format == STATS_JSON) {
+        append(&report, "{\"counters\": {");
+    }
+    for (i = 0; i < NUM_COUNTERS; ++i) {
+        appendValue(&report, format, &first, counters[i].name,
+                atomic_load_explicit(counters[i].counter, memory_order_relaxed));
+    }
+    if (commandQueue != NULL) {
+        commandQueueGetStats(commandQueue, &queue);
+        appendValue(&report, format, &first, "queue_enqueued", queue.enqueued);
+        appendValue(&report, format, &first, "queue_dequeued", queue.dequeued);
+        appendValue(&report, format, &first, "queue_dropped", queue.dropped);
+    }
+    bufferPoolGetStats(&pool);
+    appendValue(&report, format, &first, "buffer_bytes_in_use", pool.bytesInUse);
+    appendValue(&report, format, &first, "buffer_bytes_cached", pool.bytesCached);
+    appendValue(&report, format, &first, "buffer_allocations", pool.allocations);
+    appendValue(&report, format, &first, "buffer_reuses", pool.reuses);
+    appendValue(&report, format, &first, "log_dropped", logDropped());
+    if (readMemoryUsage(&residentKb, &peakKb) == 0) {
+        appendValue(&report, format, &first, "resident_kb", residentKb);
+        appendValue(&report, format, &first, "peak_resident_kb", peakKb);
+    }
+
+    first = TRUE;
+    if (format == STATS_JSON) {
+        append(&report, "}, \"histograms\": {");
+    }
+    for (i = 0; i < NUM_HISTOGRAMS; ++i) {
+        appendHistogram(&report, format, &first, histograms[i].name, histograms[i].histogram);
+    }
+    if (format == STATS_JSON) {
+        append(&report, "}}\n");
+    }
+    return report.length;
+}
+
+void logStats()
+{
+    LOG_INFO("Stats: %llu images sent (%llu bytes), %llu images deduplicated (%llu bytes saved), "
+            "%llu images coalesced, lag %llu ms.\n",
+            (unsigned long long) stats.imagesSent,
+            (unsigned long long) stats.bytesSent,
+            (unsigned long long) stats.imagesDeduplicated,
+            (unsigned long long) stats.bytesSaved,
+            (unsigned long long) stats.imagesCoalesced,
+            (unsigned long long) stats.lagMs);
+    LOG_INFO("Latency p50/p99 in us: queue wait %llu/%llu, file read %llu/%llu, send %llu/%llu, "
+            "lag %llu/%llu, heartbeat rtt %llu/%llu. Connects: %llu image, %llu heartbeat, "
+            "disconnects: %llu image, %llu heartbeat.\n",
+            (unsigned long long) histogramPercentile(&stats.queueWait, 50),
+            (unsigned long long) histogramPercentile(&stats.queueWait, 99),
+            (unsigned long long) histogramPercentile(&stats.fileRead, 50),
+            (unsigned long long) histogramPercentile(&stats.fileRead, 99),
+            (unsigned long long) histogramPercentile(&stats.send, 50),
+            (unsigned long long) histogramPercentile(&stats.send, 99),
+            (unsigned long long) histogramPercentile(&stats.lag, 50),
+            (unsigned long long) histogramPercentile(&stats.lag, 99),
+            (unsigned long long) histogramPercentile(&stats.heartbeatRtt, 50),
+            (unsigned long long) histogramPercentile(&stats.heartbeatRtt, 99),
+            (unsigned long long) stats.dataConnects,
+            (unsigned long long) stats.heartbeatConnects,
+            (unsigned long long) stats.dataDisconnects,
+            (unsigned long long) stats.heartbeatDisconnects);
+
+    struct BufferPoolStats pool;
+    bufferPoolGetStats(&pool);
+    long residentKb;
+    long peakKb;
+    if (readMemoryUsage(&residentKb, &peakKb) == 0) {
+        LOG_INFO("Memory: %ld kB resident (peak %ld kB), buffers: %zu kB in use, %zu kB cached, "
+                "%llu allocated, %llu reused.\n",
+                residentKb, peakKb, pool.bytesInUse / 1024, pool.bytesCached / 1024,
+                (unsigned long long) pool.allocations,
+                (unsigned long long) pool.reuses);
+    }
+}
@@ -0,0 +1,157 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "command_queue.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear histogram in the style of HdrHistogram. Values below
+ * HISTOGRAM_SUB_BUCKETS have a bucket of their own. Every power of two
+ * above is split into HISTOGRAM_SUB_BUCKETS buckets, so a value is known
+ * to within 1/HISTOGRAM_SUB_BUCKETS of itself. Larger values than
+ * 2^HISTOGRAM_MAX_EXPONENT are counted in the last bucket.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Size of a report produced by statsFormat().
+#define STATS_REPORT_SIZE 8192
+
+/**
+ * Histogram of durations in microseconds. Recording takes a few relaxed
+ * atomic additions and never blocks, from any thread.
+ */
+struct Histogram {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+/**
+ * Counters and histograms of the forwarding path. Counters are updated
+ * with statsAdd(), so they may be touched by any thread without locks.
+ */
+struct Stats {
+    _Atomic uint64_t fifoCommands;       // lines read from the FIFO
+    _Atomic uint64_t imagesSent;
+    _Atomic uint64_t bytesSent;
+    _Atomic uint64_t imagesDeduplicated; // the client already had the image
+    _Atomic uint64_t bytesSaved;         // payload bytes that were not sent because of that
+    _Atomic uint64_t transfersResumed;   // continued after the client reconnected
+    _Atomic uint64_t bytesResumed;       // payload bytes the client had received before
+    _Atomic uint64_t imagesCoalesced;    // superseded by a newer image before being sent
+    _Atomic uint64_t dataConnects;
+    _Atomic uint64_t dataDisconnects;
+    _Atomic uint64_t heartbeatConnects;
+    _Atomic uint64_t heartbeatDisconnects;
+    _Atomic uint64_t heartbeatsSent;
+    _Atomic uint64_t lagMs;              // from the command to the delivery of the latest image
+    _Atomic uint64_t previewsRendered;
+    _Atomic uint64_t previewsSent;
+    _Atomic uint64_t workerThreads;
+    _Atomic uint64_t tasksStolen;        // taken by a worker from the queue of another
+
+    struct Histogram fifoReceive;  // from the read() of a line until it is in the command queue
+    struct Histogram queueWait;    // from the command queue until the event loop takes it
+    struct Histogram fileRead;     // opening and reading an image file
+    struct Histogram send;         // from the first byte of an image to its last
+    struct Histogram lag;          // from the command until the image reached a screen
+    struct Histogram heartbeatRtt; // round trip time of heartbeat connections (TCP_INFO)
+    struct Histogram previewRender; // decoding, scaling and encoding a preview on a worker
+    struct Histogram taskWait;      // from submitting a task to the pool until a worker starts it
+    struct Histogram prepareOpen;   // opening an image file on a worker
+    struct Histogram prepareRead;   // reading it into memory on a worker
+    struct Histogram prepareHash;   // hashing it on a worker
+    struct Histogram prepareMetadata; // scanning its JPEG headers on a worker
+};
+
+typedef enum {
+    STATS_TEXT,
+    STATS_JSON
+} StatsFormat;
+
+extern struct Stats stats;
+
+static inline void statsAdd(_Atomic uint64_t* counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void statsSet(_Atomic uint64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+/**
+ * Count value, a duration in microseconds.
+ */
+void histogramRecord(struct Histogram* histogram, uint64_t value);
+
+/**
+ * Count the time from start until now (CLOCK_MONOTONIC).
+ */
+void histogramRecordSince(struct Histogram* histogram, const struct timespec* start);
+
+/**
+ * Return the value below which the given percentage of the values lies,
+ * rounded up to the end of its bucket, or 0 if nothing has been counted.
+ */
+uint64_t histogramPercentile(const struct Histogram* histogram, double percent);
+
+/**
+ * Include the counters of the command queue in the reports.
+ */
+void statsSetCommandQueue(struct CommandQueue* queue);
+
+/**
+ * Read the resident set size of the process and its peak
+ * from /proc/self/status.
+ *
+ * \return 0 on success, -1 if the values are not available.
+ */
+int readMemoryUsage(long* residentKb, long* peakKb);
+
+/**
+ * Write all counters, histograms and the memory usage into buffer,
+ * either as lines of "name value" or as a JSON object.
+ *
+ * \return the length of the report, which is truncated to size - 1.
+ */
+size_t statsFormat(char* buffer, size_t size, StatsFormat format);
+
+/**
+ * Write the counters, the latencies, the memory usage and the state
+ * of the buffer pool to the log.
+ */
+void logStats();
+
+#endif
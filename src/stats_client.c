@@ -0,0 +1,92 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "err_util.h"
+#include "stats.h"
+#include "stats_client.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct StatsClient* statsClientCreate(int epollFd, int fd)
+{
+    struct StatsClient* client = calloc(1, sizeof(struct StatsClient));
+    if (client == NULL) {
+        errMsg("calloc stats client");
+        return NULL;
+    }
+    client->source.type = SOURCE_STATS_CLIENT;
+    client->source.fd = fd;
+    addEventSource(epollFd, &client->source, EPOLLIN | EPOLLRDHUP);
+    return client;
+}
+
+void statsClientDestroy(struct StatsClient* client)
+{
+    if (close(client->source.fd) == -1) {
+        errMsg("close");
+    }
+    free(client);
+}
+
+/**
+ * The report is far smaller than the socket buffer, so it is sent at once.
+ */
+static void sendReport(struct StatsClient* client)
+{
+    char report[STATS_REPORT_SIZE];
+    StatsFormat format = strncmp(client->request, "json", 4) == 0 ? STATS_JSON : STATS_TEXT;
+    size_t length = statsFormat(report, sizeof(report), format);
+
+    if (send(client->source.fd, report, length, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+        errMsg("send stats");
+    }
+    client->closed = TRUE;
+}
+
+void statsClientReceive(struct StatsClient* client)
+{
+    ssize_t n;
+
+    for (;;) {
+        n = recv(client->source.fd, client->request + client->length,
+                sizeof(client->request) - 1 - client->length, 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                client->closed = TRUE;
+            }
+            return;
+        }
+        client->length += n;
+        // Only the start of an overlong request is looked at.
+        if (n == 0 || memchr(client->request, '\n', client->length) != NULL
+                || client->length == sizeof(client->request) - 1) {
+            sendReport(client);
+            return;
+        }
+    }
+}
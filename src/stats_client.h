@@ -0,0 +1,69 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STATS_CLIENT_H_
+#define STATS_CLIENT_H_
+
+#include "boolean_util.h"
+#include "event_util.h"
+
+/*
+ * The counters and histograms can be read through a local SOCK_STREAM
+ * socket. A client sends one line, "json" for a JSON object or anything
+ * else, e.g. an empty line, for lines of "name value", and receives the
+ * report. The server closes the connection afterwards, e.g.
+ *   echo json | nc -U /run/ipho-stats.sock
+ */
+
+#define STATS_REQUEST_LENGTH 16
+
+/**
+ * A connection to the stats socket.
+ */
+struct StatsClient {
+    struct EventSource source; // has to be the first member
+    char request[STATS_REQUEST_LENGTH];
+    size_t length;
+    Boolean closed;            // destroyed by the event loop once the current events are handled
+    struct StatsClient* next;
+};
+
+/**
+ * Wrap the accepted socket fd into a client and register it
+ * with the event loop epollFd. fd has to be non-blocking.
+ *
+ * \return the client or NULL if it could not be created.
+ */
+struct StatsClient* statsClientCreate(int epollFd, int fd);
+
+/**
+ * Close the socket and free the client.
+ */
+void statsClientDestroy(struct StatsClient* client);
+
+/**
+ * Read the request. Once it is complete, send the report
+ * and mark the client as closed.
+ */
+void statsClientReceive(struct StatsClient* client);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "err_util.h"
+#include "log_util.h"
+#include "tail_watch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TAIL_EVENTS (IN_MODIFY | IN_CLOSE_WRITE)
+#define EVENT_BUFFER_SIZE 4096
+
+void tailWatchInit(struct TailWatch* watch, int epollFd)
+{
+    size_t i;
+
+    memset(watch, 0, sizeof(*watch));
+    for (i = 0; i < MAX_TAILS; ++i) {
+        watch->tails[i].wd = -1;
+    }
+    watch->source.type = SOURCE_TAIL_WATCH;
+    watch->source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->source.fd == -1) {
+        errExit("inotify_init1");
+    }
+    addEventSource(epollFd, &watch->source, EPOLLIN);
+}
+
+/**
+ * Writing has finished: stop watching and take the final size.
+ */
+static void finishTail(struct TailWatch* watch, struct Tail* tail)
+{
+    if (tail->wd != -1) {
+        // Fails with EINVAL if the file was deleted meanwhile.
+        inotify_rm_watch(watch->source.fd, tail->wd);
+        tail->wd = -1;
+    }
+    imageRefresh(tail->image);
+    tail->image->growing = FALSE;
+}
+
+static void releaseTail(struct TailWatch* watch, struct Tail* tail)
+{
+    finishTail(watch, tail);
+    imageUnref(tail->image);
+    tail->image = NULL;
+}
+
+static long elapsedMs(const struct timespec* since, const struct timespec* now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000L + (now->tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+/**
+ * Take the current size of a growing file and remember when it grew.
+ */
+static void refreshTail(struct Tail* tail)
+{
+    off_t size = tail->image->file.size;
+
+    imageRefresh(tail->image);
+    if (tail->image->file.size != size) {
+        clock_gettime(CLOCK_MONOTONIC, &tail->changed);
+    }
+}
+
+static struct Tail* findTail(struct TailWatch* watch, const char* path)
+{
+    size_t i;
+    for (i = 0; i < MAX_TAILS; ++i) {
+        if (watch->tails[i].image != NULL && strcmp(watch->tails[i].image->path, path) == 0) {
+            return &watch->tails[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find a free slot. If there is none, the oldest file that has
+ * finished writing gives up its slot.
+ */
+static struct Tail* allocateTail(struct TailWatch* watch)
+{
+    struct Tail* oldest = NULL;
+    size_t i;
+
+    for (i = 0; i < MAX_TAILS; ++i) {
+        struct Tail* tail = &watch->tails[i];
+        if (tail->image == NULL) {
+            return tail;
+        }
+        if (tail->wd == -1 && (oldest == NULL || tail->age < oldest->age)) {
+            oldest = tail;
+        }
+    }
+    if (oldest != NULL) {
+        releaseTail(watch, oldest);
+    }
+    return oldest;
+}
+
+struct Image* tailWatchStart(struct TailWatch* watch, const char* path)
+{
+    struct Tail* tail = findTail(watch, path);
+    struct Image* image;
+
+    if (tail != NULL) {
+        return imageRef(tail->image);
+    }
+    tail = allocateTail(watch);
+    if (tail == NULL) {
+        LOG_WARN("Too many files are being written, cannot follow %s.\n", path);
+        return NULL;
+    }
+    image = imageOpen(path);
+    if (image == NULL) {
+        return NULL;
+    }
+    tail->wd = inotify_add_watch(watch->source.fd, path, TAIL_EVENTS);
+    if (tail->wd == -1) {
+        errMsg("inotify_add_watch");
+        imageUnref(image);
+        return NULL;
+    }
+    image->growing = TRUE;
+    // Catch up with what has been written before the watch was added.
+    imageRefresh(image);
+    tail->image = image;
+    tail->age = watch->nextAge++;
+    clock_gettime(CLOCK_MONOTONIC, &tail->started);
+    tail->changed = tail->started;
+    return imageRef(image);
+}
+
+static struct Tail* findTailByWatch(struct TailWatch* watch, int wd)
+{
+    size_t i;
+    if (wd < 0) {
+        return NULL; // finished tails have no watch
+    }
+    for (i = 0; i < MAX_TAILS; ++i) {
+        if (watch->tails[i].image != NULL && watch->tails[i].wd == wd) {
+            return &watch->tails[i];
+        }
+    }
+    return NULL;
+}
+
+size_t tailWatchProcess(struct TailWatch* watch, struct Image** finished)
+{
+    char buffer[EVENT_BUFFER_SIZE]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    struct Tail* tail;
+    Boolean rescan = FALSE;
+    size_t numFinished = 0;
+    size_t i;
+    ssize_t n;
+
+    for (;;) {
+        n = read(watch->source.fd, buffer, sizeof(buffer));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                errMsg("read inotify");
+            }
+            break;
+        }
+        for (i = 0; i < (size_t) n; i += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*) (buffer + i);
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events have been lost, a closed file is caught by
+                // tailWatchExpire() once it stops growing.
+                LOG_WARN("The inotify queue has overflowed, rescanning the growing files.\n");
+                rescan = TRUE;
+                continue;
+            }
+            tail = findTailByWatch(watch, event->wd);
+            if (tail == NULL) {
+                continue; // finished already, or IN_IGNORED of a removed watch
+            }
+            if (event->mask & IN_CLOSE_WRITE) {
+                LOG_INFO("File %s has been written.\n", tail->image->path);
+                finishTail(watch, tail);
+                finished[numFinished++] = imageRef(tail->image);
+            } else {
+                refreshTail(tail);
+            }
+        }
+    }
+    for (i = 0; rescan && i < MAX_TAILS; ++i) {
+        if (watch->tails[i].image != NULL && watch->tails[i].wd != -1) {
+            refreshTail(&watch->tails[i]);
+        }
+    }
+    return numFinished;
+}
+
+size_t tailWatchExpire(struct TailWatch* watch, struct Image** finished)
+{
+    struct timespec now;
+    size_t numFinished = 0;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < MAX_TAILS; ++i) {
+        struct Tail* tail = &watch->tails[i];
+        if (tail->image == NULL || tail->wd == -1) {
+            continue;
+        }
+        refreshTail(tail);
+        if (elapsedMs(&tail->changed, &now) >= TAIL_IDLE_TIMEOUT_MS
+                || elapsedMs(&tail->started, &now) >= TAIL_MAX_AGE_MS) {
+            LOG_WARN("File %s has not been closed, taking it as written.\n", tail->image->path);
+            finishTail(watch, tail);
+            finished[numFinished++] = imageRef(tail->image);
+        }
+    }
+    return numFinished;
+}
+
+Boolean tailWatchGrowing(const struct TailWatch* watch)
+{
+    size_t i;
+    for (i = 0; i < MAX_TAILS; ++i) {
+        if (watch->tails[i].image != NULL && watch->tails[i].wd != -1) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+struct Image* tailWatchTake(struct TailWatch* watch, const char* path, Boolean* wasGrowing)
+{
+    struct Tail* tail = findTail(watch, path);
+    struct Image* image;
+
+    if (tail == NULL) {
+        return NULL;
+    }
+    *wasGrowing = tail->image->growing;
+    image = imageRef(tail->image);
+    releaseTail(watch, tail);
+    return image;
+}
@@ -0,0 +1,126 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TAIL_WATCH_H_
+#define TAIL_WATCH_H_
+
+#include "boolean_util.h"
+#include "event_util.h"
+#include "image.h"
+
+#include <stddef.h>
+#include <time.h>
+
+#define MAX_TAILS 16
+
+/**
+ * A writer that stops writing without closing the file would otherwise
+ * keep its tail open forever and hold back the clients behind it.
+ * Writing is considered finished if the file has not grown for
+ * TAIL_IDLE_TIMEOUT_MS or has been followed for TAIL_MAX_AGE_MS.
+ */
+#define TAIL_IDLE_TIMEOUT_MS 10000
+#define TAIL_MAX_AGE_MS 300000
+
+/**
+ * A file that was announced while it is still being written.
+ * It stays in the table after writing has finished, until its
+ * completion is announced as well or the slot is needed.
+ */
+struct Tail {
+    struct Image* image; // NULL if the slot is free
+    int wd;              // inotify watch, -1 once writing has finished
+    unsigned long age;   // order in which the tails were started
+    struct timespec started; // monotonic time the file was announced
+    struct timespec changed; // monotonic time the file last grew
+};
+
+/**
+ * Follows growing image files with inotify, so that they can be sent
+ * while the camera is still writing them. A file is complete once the
+ * writer closes it, its completion is announced, or it has been idle or
+ * followed for too long, whatever comes first. The inotify descriptor is registered with the event loop.
+ */
+struct TailWatch {
+    struct EventSource source; // has to be the first member
+    struct Tail tails[MAX_TAILS];
+    unsigned long nextAge;
+};
+
+/**
+ * Create the inotify instance and register it with the event loop.
+ * Terminates the process on error.
+ */
+void tailWatchInit(struct TailWatch* watch, int epollFd);
+
+/**
+ * Open the file at path as growing image and follow its modifications.
+ * If the file is followed already, its image is returned again.
+ *
+ * \return
+ * The image, the caller owns a reference, or NULL if the file cannot
+ * be opened or too many files are being written at the same time.
+ */
+struct Image* tailWatchStart(struct TailWatch* watch, const char* path);
+
+/**
+ * Read the pending inotify events and update the sizes of the
+ * growing images. Images whose file has been closed by the writer
+ * are complete now and stored into finished, which has to provide
+ * room for MAX_TAILS images. If the event queue has overflowed,
+ * the sizes of all growing images are refreshed instead.
+ *
+ * \return
+ * The number of images stored into finished, the caller owns
+ * a reference to each of them.
+ */
+size_t tailWatchProcess(struct TailWatch* watch, struct Image** finished);
+
+/**
+ * Finish the growing images that have reached TAIL_IDLE_TIMEOUT_MS or
+ * TAIL_MAX_AGE_MS and store them into finished, which has to provide
+ * room for MAX_TAILS images. Call this periodically while
+ * tailWatchGrowing() is TRUE.
+ *
+ * \return
+ * The number of images stored into finished, the caller owns
+ * a reference to each of them.
+ */
+size_t tailWatchExpire(struct TailWatch* watch, struct Image** finished);
+
+/**
+ * \return TRUE if a file is still being written.
+ */
+Boolean tailWatchGrowing(const struct TailWatch* watch);
+
+/**
+ * Stop following the file at path, because its completion has been
+ * announced. The image is complete afterwards.
+ *
+ * \param wasGrowing
+ * Set to TRUE if writing had not finished before.
+ * \return
+ * The image of the file, the caller owns a reference,
+ * or NULL if the file was not followed.
+ */
+struct Image* tailWatchTake(struct TailWatch* watch, const char* path, Boolean* wasGrowing);
+
+#endif
@@ -31,11 +31,12 @@ struct timespec timespecAdd(const struct timespec  a, const struct timespec  b)
     return res;
 } 
 
-struct timespec computeAbsoluteTimeout(long deltaNanos) {
-    struct timespec  now;
-    struct timespec  diff;
-    clock_gettime(CLOCK_REALTIME, &now);
-    diff.tv_sec = 0;
-    diff.tv_nsec = deltaNanos;
-    return timespecAdd(now, diff);
+struct timespec monotonicNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+long timespecDiffMillis(const struct timespec a, const struct timespec b) {
+    return (a.tv_sec - b.tv_sec) * 1000 + (a.tv_nsec - b.tv_nsec) / 1000000;
 }
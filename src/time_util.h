@@ -30,8 +30,14 @@ along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
 struct timespec timespecAdd(const struct timespec a, const struct timespec b);
 
 /**
- * Return a timespec that corresponds to NOW + deltaNanos
+ * Return the current time of the monotonic clock,
+ * which is not affected by changes of the wall clock.
  */
-struct timespec computeAbsoluteTimeout(long deltaNanos);
+struct timespec monotonicNow();
+
+/**
+ * Return a-b in milliseconds.
+ */
+long timespecDiffMillis(const struct timespec a, const struct timespec b);
 
 #endif
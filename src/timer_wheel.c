@@ -0,0 +1,283 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "err_util.h"
+#include "time_util.h"
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define NO_TICK UINT64_MAX
+
+// Ticks that the top level reaches ahead of the wheel.
+#define WHEEL_RANGE ((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+/**
+ * \return the current tick, rounded up if roundUp is TRUE.
+ */
+static uint64_t currentTick(const struct TimerWheel* wheel, Boolean roundUp)
+{
+    struct timespec now = monotonicNow();
+    int64_t nanos = (int64_t) (now.tv_sec - wheel->start.tv_sec) * 1000000000
+            + (now.tv_nsec - wheel->start.tv_nsec);
+
+    if (roundUp) {
+        nanos += 999999;
+    }
+    return nanos / 1000000;
+}
+
+static void linkTimer(struct Timer** slot, struct Timer* timer)
+{
+    timer->next = *slot;
+    if (timer->next != NULL) {
+        timer->next->link = &timer->next;
+    }
+    timer->link = slot;
+    *slot = timer;
+}
+
+static void unlinkTimer(struct Timer* timer)
+{
+    *timer->link = timer->next;
+    if (timer->next != NULL) {
+        timer->next->link = timer->link;
+    }
+    timer->next = NULL;
+    timer->link = NULL;
+}
+
+/**
+ * Put timer into the slot for its expiry, relative to the next tick.
+ */
+static void insertTimer(struct TimerWheel* wheel, struct Timer* timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level;
+
+    if (expires < wheel->next) {
+        expires = wheel->next;
+    }
+    delta = expires - wheel->next;
+    if (delta >= WHEEL_RANGE) {
+        expires = wheel->next + WHEEL_RANGE - 1;
+        delta = WHEEL_RANGE - 1;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < (uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+    linkTimer(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK], timer);
+}
+
+/**
+ * Redistribute the timers of a slot to the lower levels.
+ */
+static void cascade(struct TimerWheel* wheel, int level, unsigned int index)
+{
+    struct Timer* timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL) {
+        struct Timer* next = timer->next;
+        insertTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * \return the earliest tick at which a timer may expire or a slot
+ * has to be cascaded, NO_TICK if no timer is pending.
+ */
+static uint64_t nextEvent(const struct TimerWheel* wheel)
+{
+    uint64_t earliest = NO_TICK;
+    uint64_t block;
+    uint64_t first;
+    uint64_t k;
+    int level;
+
+    if (wheel->pending == 0) {
+        return NO_TICK;
+    }
+    for (k = 0; k < TIMER_WHEEL_SLOTS; ++k) {
+        if (wheel->slots[0][(wheel->next + k) & SLOT_MASK] != NULL) {
+            earliest = wheel->next + k;
+            break;
+        }
+    }
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        block = wheel->next >> (TIMER_WHEEL_BITS * level);
+        // The slot of the current block is still due if the wheel stands at its start.
+        first = (wheel->next & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) == 0 ? 0 : 1;
+        for (k = first; k < first + TIMER_WHEEL_SLOTS; ++k) {
+            if (wheel->slots[level][(block + k) & SLOT_MASK] != NULL) {
+                uint64_t tick = (block + k) << (TIMER_WHEEL_BITS * level);
+                if (tick < earliest) {
+                    earliest = tick;
+                }
+                break;
+            }
+        }
+    }
+    return earliest;
+}
+
+/**
+ * Set the timerfd to tick, unless it is set for it already.
+ */
+static void armTimerFd(struct TimerWheel* wheel, uint64_t tick)
+{
+    struct itimerspec spec;
+
+    if (tick == wheel->armed) {
+        return;
+    }
+    memset(&spec, 0, sizeof(spec));
+    if (tick != NO_TICK) {
+        struct timespec offset = { tick / 1000, (tick % 1000) * 1000000L };
+        spec.it_value = timespecAdd(wheel->start, offset);
+    }
+    if (timerfd_settime(wheel->source.fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        errExit("timerfd_settime");
+    }
+    wheel->armed = tick;
+}
+
+void timerWheelInit(struct TimerWheel* wheel, int epollFd)
+{
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->source.type = SOURCE_TIMER;
+    wheel->source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->source.fd == -1) {
+        errExit("timerfd_create");
+    }
+    wheel->start = monotonicNow();
+    wheel->armed = NO_TICK;
+    addEventSource(epollFd, &wheel->source, EPOLLIN);
+}
+
+void timerInit(struct Timer* timer, TimerCallback callback, void* arg)
+{
+    timer->next = NULL;
+    timer->link = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void timerStart(struct TimerWheel* wheel, struct Timer* timer, long delayMs)
+{
+    uint64_t now = currentTick(wheel, FALSE);
+
+    timerStop(wheel, timer);
+    if (wheel->pending == 0 && wheel->next < now) {
+        wheel->next = now; // nothing to catch up with after an idle period
+    }
+    timer->expires = currentTick(wheel, TRUE) + (delayMs > 0 ? delayMs : 0);
+    insertTimer(wheel, timer);
+    wheel->pending++;
+    if (!wheel->running && timer->expires < wheel->armed) {
+        armTimerFd(wheel, nextEvent(wheel));
+    }
+}
+
+void timerStop(struct TimerWheel* wheel, struct Timer* timer)
+{
+    if (timer->link == NULL) {
+        return;
+    }
+    unlinkTimer(timer);
+    wheel->pending--;
+    // The timerfd may fire for nothing, then it is armed for the next timer.
+}
+
+/**
+ * Cascade the upper levels if the lower ones wrap around at the next tick,
+ * then expire the timers of the next tick.
+ */
+static void processTick(struct TimerWheel* wheel)
+{
+    uint64_t tick = wheel->next;
+    struct Timer* expired;
+    int level;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if ((tick & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        cascade(wheel, level, (tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    }
+
+    // Detach the slot first, the callbacks may start timers for this tick.
+    expired = wheel->slots[0][tick & SLOT_MASK];
+    wheel->slots[0][tick & SLOT_MASK] = NULL;
+    if (expired != NULL) {
+        expired->link = &expired;
+    }
+    wheel->next = tick + 1;
+    while (expired != NULL) {
+        struct Timer* timer = expired;
+        unlinkTimer(timer);
+        if (timer->expires > tick) {
+            insertTimer(wheel, timer); // beyond the range of the wheel before
+            continue;
+        }
+        wheel->pending--;
+        timer->callback(timer);
+    }
+}
+
+void timerWheelRun(struct TimerWheel* wheel)
+{
+    uint64_t expirations;
+    uint64_t now;
+    uint64_t tick;
+
+    if (read(wheel->source.fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        errExit("read timerfd");
+    }
+    // The timerfd is not armed anymore once it fired.
+    wheel->armed = NO_TICK;
+    wheel->running = TRUE;
+    now = currentTick(wheel, FALSE);
+    for (;;) {
+        tick = nextEvent(wheel);
+        if (tick > now) {
+            break;
+        }
+        wheel->next = tick;
+        processTick(wheel);
+    }
+    if (wheel->next <= now) {
+        wheel->next = now + 1;
+    }
+    wheel->running = FALSE;
+    armTimerFd(wheel, nextEvent(wheel));
+}
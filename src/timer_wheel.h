@@ -0,0 +1,107 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include "boolean_util.h"
+#include "event_util.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Timers of the event loop, e.g. heartbeat probes and timeouts of clients.
+ * They are kept in a hierarchical timing wheel with a resolution of one
+ * millisecond on the monotonic clock, so starting and stopping a timer
+ * takes constant time. A single timerfd is armed for the earliest timer
+ * and wakes up the event loop, which sleeps as long as no timer is due.
+ *
+ * Level 0 holds the timers of the next 64 ms, one slot per millisecond.
+ * Each further level covers 64 times the range of the previous one with
+ * slots that are 64 times as wide. When the lower levels wrap around,
+ * the next slot of the upper level is cascaded into them.
+ * Timers further ahead than the top level reaches, about 4.6 hours,
+ * wait in its last slot and are cascaded again until they are due.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct Timer;
+
+typedef void (*TimerCallback)(struct Timer* timer);
+
+struct Timer {
+    struct Timer* next;
+    struct Timer** link; // the pointer to this timer in its slot, NULL if not pending
+    uint64_t expires;    // tick of the wheel
+    TimerCallback callback;
+    void* arg;
+};
+
+struct TimerWheel {
+    struct EventSource source; // has to be the first member, the timerfd
+    struct timespec start;     // tick 0
+    uint64_t next;             // first tick that has not been processed
+    uint64_t armed;            // tick the timerfd is set for, UINT64_MAX if disarmed
+    size_t pending;
+    Boolean running;           // the timerfd is armed after the callbacks
+    struct Timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+/**
+ * Create the timerfd and register it with the event loop epollFd.
+ * Terminates the process on error.
+ */
+void timerWheelInit(struct TimerWheel* wheel, int epollFd);
+
+/**
+ * Prepare a timer that is not pending. callback is called with the
+ * timer when it expires, arg is free for the caller.
+ */
+void timerInit(struct Timer* timer, TimerCallback callback, void* arg);
+
+/**
+ * (Re)start timer so that it expires delayMs milliseconds from now,
+ * never earlier. Callbacks may restart their own timer.
+ */
+void timerStart(struct TimerWheel* wheel, struct Timer* timer, long delayMs);
+
+/**
+ * Stop timer if it is pending.
+ */
+void timerStop(struct TimerWheel* wheel, struct Timer* timer);
+
+static inline Boolean timerPending(const struct Timer* timer)
+{
+    return timer->link != NULL ? TRUE : FALSE;
+}
+
+/**
+ * Call the callbacks of all timers that are due and arm the timerfd for
+ * the next one. Call this when the timerfd is readable.
+ */
+void timerWheelRun(struct TimerWheel* wheel);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int ioUringSetup(unsigned int entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int fd, unsigned int opcode, const void* arg, unsigned int nrArgs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static void* mapRing(int fd, size_t size, off_t offset)
+{
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+int uringInit(struct Uring* ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+    int savedErrno;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = ioUringSetup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mapRing(ring->fd, ring->sqRingSize, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mapRing(ring->fd, ring->cqRingSize, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            goto fail;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mapRing(ring->fd, ring->sqesSize, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        goto fail;
+    }
+
+    sq = ring->sqRing;
+    ring->sqHead = (unsigned int*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned int*) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned int*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*) (sq + params.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+    ring->sqSubmitted = ring->sqLocalTail;
+
+    cq = ring->cqRing;
+    ring->cqHead = (unsigned int*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned int*) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned int*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    savedErrno = errno;
+    close(ring->fd);
+    errno = savedErrno;
+    return -1;
+}
+
+void uringDestroy(struct Uring* ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+unsigned int uringSpaceLeft(struct Uring* ring)
+{
+    unsigned int head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    return ring->entries - (ring->sqLocalTail - head);
+}
+
+struct io_uring_sqe* uringGetSqe(struct Uring* ring)
+{
+    struct io_uring_sqe* sqe;
+
+    if (uringSpaceLeft(ring) == 0) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    ring->sqArray[ring->sqLocalTail & ring->sqMask] = ring->sqLocalTail & ring->sqMask;
+    ring->sqLocalTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uringSubmit(struct Uring* ring)
+{
+    unsigned int toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+    int res;
+
+    if (toSubmit == 0) {
+        return 0;
+    }
+    // The entries have to be visible before the kernel sees the new tail.
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    ring->sqSubmitted = ring->sqLocalTail;
+    do {
+        res = ioUringEnter(ring->fd, toSubmit, 0, 0);
+    } while (res == -1 && errno == EINTR);
+    return res;
+}
+
+int uringWait(struct Uring* ring)
+{
+    int res;
+    do {
+        res = ioUringEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while (res == -1 && errno == EINTR);
+    return res == -1 ? -1 : 0;
+}
+
+struct io_uring_cqe* uringPeekCqe(struct Uring* ring)
+{
+    unsigned int head = *ring->cqHead;
+    unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void uringCqeSeen(struct Uring* ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+int uringRegisterEventFd(struct Uring* ring, int efd)
+{
+    return ioUringRegister(ring->fd, IORING_REGISTER_EVENTFD, &efd, 1);
+}
@@ -0,0 +1,125 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef URING_H_
+#define URING_H_
+
+#include "boolean_util.h"
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/**
+ * Minimal io_uring instance on top of the raw system calls.
+ *
+ * Submission entries are filled in with uringGetSqe() and handed to the
+ * kernel in one go with uringSubmit(). Completions are read with
+ * uringPeekCqe() and released with uringCqeSeen(). The ring is used from
+ * a single thread; the memory ordering only deals with the kernel.
+ */
+struct Uring {
+    int fd;
+    unsigned int entries;
+
+    // Submission queue shared with the kernel.
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int sqMask;
+    unsigned int* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned int sqLocalTail; // entries up to here are filled in
+    unsigned int sqSubmitted; // entries up to here have been published
+
+    // Completion queue shared with the kernel.
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe* cqes;
+
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+/**
+ * Set up a ring with room for the given number of submissions.
+ *
+ * \return 0 on success, -1 with errno set if the kernel does not
+ *         support io_uring or does not allow its use.
+ */
+int uringInit(struct Uring* ring, unsigned int entries);
+
+/**
+ * Unmap the rings and close the instance.
+ */
+void uringDestroy(struct Uring* ring);
+
+/**
+ * Get the next free submission entry, cleared.
+ *
+ * \return NULL if the submission queue is full. Submit and try again.
+ */
+struct io_uring_sqe* uringGetSqe(struct Uring* ring);
+
+/**
+ * Return the number of submission entries that can be filled in
+ * before the next uringSubmit().
+ */
+unsigned int uringSpaceLeft(struct Uring* ring);
+
+/**
+ * Hand all filled in entries to the kernel without waiting for them.
+ *
+ * \return the number of submitted entries, -1 on error.
+ */
+int uringSubmit(struct Uring* ring);
+
+/**
+ * Block until at least one completion is available.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int uringWait(struct Uring* ring);
+
+/**
+ * Get the oldest completion without removing it.
+ *
+ * \return NULL if there is no completion.
+ */
+struct io_uring_cqe* uringPeekCqe(struct Uring* ring);
+
+/**
+ * Release the completion returned by uringPeekCqe().
+ */
+void uringCqeSeen(struct Uring* ring);
+
+/**
+ * Let the kernel signal every completion on the eventfd efd,
+ * so that the ring can be waited for in the event loop.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int uringRegisterEventFd(struct Uring* ring, int efd);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "err_util.h"
+#include "stats.h"
+#include "time_util.h"
+#include "worker_pool.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static void notifyFinished(struct WorkerPool* pool)
+{
+    uint64_t one = 1;
+    while (write(pool->source.fd, &one, sizeof(one)) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN) // counter saturated, the event loop wakes up anyway
+            return;
+        errExit("eventfd write");
+    }
+}
+
+/**
+ * Take the oldest task of the queue of worker.
+ */
+static struct Task* popTask(struct Worker* worker)
+{
+    struct Task* task;
+
+    pthread_mutex_lock(&worker->mutex);
+    task = worker->queueHead;
+    if (task != NULL) {
+        worker->queueHead = task->next;
+        if (worker->queueHead == NULL) {
+            worker->queueTail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return task;
+}
+
+/**
+ * Take a task of the own queue, or else steal one from the others,
+ * starting with the next worker so that victims are spread.
+ */
+static struct Task* takeTask(struct Worker* self)
+{
+    struct WorkerPool* pool = self->pool;
+    struct Task* task;
+    size_t i;
+
+    if (atomic_load_explicit(&pool->queued, memory_order_acquire) == 0) {
+        return NULL;
+    }
+    task = popTask(self);
+    for (i = 1; task == NULL && i < pool->numThreads; ++i) {
+        task = popTask(&pool->workers[(self->index + i) % pool->numThreads]);
+        if (task != NULL) {
+            statsAdd(&stats.tasksStolen, 1);
+        }
+    }
+    if (task != NULL) {
+        atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static void finishTask(struct WorkerPool* pool, struct Task* task)
+{
+    Boolean wasEmpty;
+
+    task->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    wasEmpty = pool->finishedHead == NULL ? TRUE : FALSE;
+    if (wasEmpty) {
+        pool->finishedHead = task;
+    } else {
+        pool->finishedTail->next = task;
+    }
+    pool->finishedTail = task;
+    // The event loop takes all finished tasks at once, one wakeup is enough.
+    if (wasEmpty) {
+        notifyFinished(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void* runWorker(void* arg)
+{
+    struct Worker* self = arg;
+    struct WorkerPool* pool = self->pool;
+    struct Task* task;
+
+    for (;;) {
+        task = takeTask(self);
+        if (task != NULL) {
+            histogramRecordSince(&stats.taskWait, &task->submitted);
+            task->run(task);
+            finishTask(pool, task);
+            continue;
+        }
+        // Submitters count the task before they signal under the mutex,
+        // so checking the count under the mutex loses no wakeup.
+        pthread_mutex_lock(&pool->mutex);
+        while (atomic_load_explicit(&pool->queued, memory_order_acquire) == 0) {
+            pthread_cond_wait(&pool->available, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+size_t workerPoolDefaultSize(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus < MAX_WORKERS ? (size_t) cpus : MAX_WORKERS;
+}
+
+void workerPoolInit(struct WorkerPool* pool, int epollFd, size_t numThreads)
+{
+    sigset_t all;
+    sigset_t previous;
+    size_t i;
+    int perr;
+
+    pool->source.type = SOURCE_WORKER_POOL;
+    pool->source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->source.fd == -1) {
+        errExit("eventfd");
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    atomic_init(&pool->queued, 0);
+    pool->finishedHead = pool->finishedTail = NULL;
+    pool->nextWorker = 0;
+    pool->numThreads = numThreads < MAX_WORKERS ? numThreads : MAX_WORKERS;
+    statsSet(&stats.workerThreads, pool->numThreads);
+
+    // Signals are left to the main thread.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    for (i = 0; i < pool->numThreads; ++i) {
+        struct Worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->queueHead = worker->queueTail = NULL;
+        pthread_mutex_init(&worker->mutex, NULL);
+    }
+    for (i = 0; i < pool->numThreads; ++i) {
+        perr = pthread_create(&pool->workers[i].thread, NULL, runWorker, &pool->workers[i]);
+        if (perr != 0) {
+            errExitEN(perr, "pthread_create worker");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    addEventSource(epollFd, &pool->source, EPOLLIN);
+}
+
+void workerPoolSubmit(struct WorkerPool* pool, struct Task* task)
+{
+    struct Worker* worker = &pool->workers[pool->nextWorker];
+
+    pool->nextWorker = (pool->nextWorker + 1) % pool->numThreads;
+    task->next = NULL;
+    task->submitted = monotonicNow();
+    // Counted first, so the count never drops below the queued tasks.
+    atomic_fetch_add_explicit(&pool->queued, 1, memory_order_release);
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->queueTail == NULL) {
+        worker->queueHead = task;
+    } else {
+        worker->queueTail->next = task;
+    }
+    worker->queueTail = task;
+    pthread_mutex_unlock(&worker->mutex);
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+struct Task* workerPoolTakeFinished(struct WorkerPool* pool)
+{
+    struct Task* finished;
+    uint64_t value;
+
+    if (read(pool->source.fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        errExit("eventfd read");
+    }
+    pthread_mutex_lock(&pool->mutex);
+    finished = pool->finishedHead;
+    pool->finishedHead = pool->finishedTail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+    return finished;
+}
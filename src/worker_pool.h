@@ -0,0 +1,112 @@
+/*
+libipho-screen-server is a relay server for photobooth data.
+
+Copyright (C) 2015 Andreas Baak (andreas.baak@gmail.com)
+
+This file is part of libipho-screen-server.
+
+libipho-screen-server is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+libipho-screen-server is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libipho-screen-server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include "boolean_util.h"
+#include "event_util.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define MAX_WORKERS 64
+
+/**
+ * A unit of work for the pool. Callers embed it as the first member of
+ * their own structure. run() is called on a worker thread and must not
+ * touch anything that belongs to the event loop. complete() is called by
+ * the event loop once run() has returned, see workerPoolTakeFinished().
+ */
+struct Task {
+    void (*run)(struct Task* task);
+    void (*complete)(struct Task* task);
+    struct Task* next;
+    struct timespec submitted;
+};
+
+struct WorkerPool;
+
+/**
+ * A worker thread and the tasks that have been handed to it.
+ */
+struct Worker {
+    struct WorkerPool* pool;
+    size_t index;
+    pthread_t thread;
+    pthread_mutex_t mutex; // guards the queue
+    struct Task* queueHead;
+    struct Task* queueTail;
+};
+
+/**
+ * Threads that run CPU heavy tasks, e.g. reading and decoding images,
+ * away from the event loop.
+ *
+ * Every worker has its own queue, and submitted tasks are dealt out to
+ * the queues in turn. A worker whose queue is empty steals the oldest
+ * task of another one, so a worker that is stuck with a slow file does
+ * not hold up the tasks behind it. Tasks are started roughly in the order
+ * they are submitted, but may finish in any order.
+ *
+ * Finished tasks are collected and signaled on the eventfd of the source,
+ * which is registered with the event loop. The loop then takes them over
+ * with workerPoolTakeFinished(). The workers run until the process exits.
+ */
+struct WorkerPool {
+    struct EventSource source; // has to be the first member
+    struct Worker workers[MAX_WORKERS];
+    size_t numThreads;
+    size_t nextWorker;        // receives the next task, event loop only
+    _Atomic size_t queued;    // tasks in all queues
+    pthread_mutex_t mutex;    // guards sleeping workers and the finished tasks
+    pthread_cond_t available;
+    struct Task* finishedHead;
+    struct Task* finishedTail;
+};
+
+/**
+ * \return the number of workers that uses all online CPUs, at most MAX_WORKERS.
+ */
+size_t workerPoolDefaultSize(void);
+
+/**
+ * Start numThreads workers, at most MAX_WORKERS, and register the pool
+ * with the event loop epollFd. Terminates the process on error.
+ */
+void workerPoolInit(struct WorkerPool* pool, int epollFd, size_t numThreads);
+
+/**
+ * Queue a task. Belongs to the event loop.
+ */
+void workerPoolSubmit(struct WorkerPool* pool, struct Task* task);
+
+/**
+ * Reset the eventfd and take all finished tasks, in the order they finished.
+ *
+ * \return the first task, linked through next, or NULL.
+ */
+struct Task* workerPoolTakeFinished(struct WorkerPool* pool);
+
+#endif